@@ -0,0 +1,61 @@
+#include "binary_client.h"
+
+#include <stdexcept>
+
+namespace code_directory {
+
+BinaryClient::BinaryClient() :
+    _socket(_io_context),
+    _next_id(0)
+{}
+
+void BinaryClient::connect_tcp(const std::string &host, std::uint16_t port) {
+    boost::asio::ip::tcp::resolver resolver(_io_context);
+    boost::system::error_code error = boost::asio::error::host_not_found;
+    for (const auto &entry: resolver.resolve(host, std::to_string(port))) {
+        close();
+        _socket.connect(entry.endpoint(), error);
+        if (!error) {
+            _socket.set_option(boost::asio::ip::tcp::no_delay(true));
+            return;
+        }
+    }
+    throw boost::system::system_error(error);
+}
+
+void BinaryClient::connect_local(const std::string &path) {
+    close();
+    _socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+}
+
+void BinaryClient::close() {
+    boost::system::error_code ignored;
+    _socket.close(ignored);
+}
+
+std::uint32_t BinaryClient::send(const binary_requests_t &requests) {
+    auto id = _next_id++;
+    _output.clear();
+    BinaryProtocol::encode_requests(id, requests, &_output);
+    boost::asio::write(_socket, boost::asio::buffer(_output));
+    return id;
+}
+
+std::uint32_t BinaryClient::receive(binary_responses_t *responses) {
+    char header[BinaryProtocol::HEADER_SIZE];
+    boost::asio::read(_socket, boost::asio::buffer(header));
+    _input.resize(BinaryProtocol::frame_size(header));
+    boost::asio::read(_socket, boost::asio::buffer(_input));
+    return BinaryProtocol::decode_responses(_input.data(), _input.size(), responses);
+}
+
+binary_responses_t BinaryClient::call(const binary_requests_t &requests) {
+    auto id = send(requests);
+    binary_responses_t responses;
+    if (receive(&responses) != id) {
+        throw std::invalid_argument("Reply to another frame");
+    }
+    return responses;
+}
+
+}
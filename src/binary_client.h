@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "binary_protocol.h"
+
+namespace code_directory {
+
+/**
+ * \brief Blocking client of BinaryServer.
+ *
+ * call sends one frame and waits for its reply. To pipeline, send several
+ * frames and then receive their replies, which come in the order of frames.
+ * Connection errors throw boost::system::system_error, malformed replies
+ * std::invalid_argument.
+ */
+class BinaryClient {
+public:
+    BinaryClient();
+
+    void connect_tcp(const std::string &host, std::uint16_t port);
+    void connect_local(const std::string &path);
+    void close();
+
+    /// Sends a frame with all \p requests; returns its id
+    std::uint32_t send(const binary_requests_t &requests);
+    /// Waits for the next reply frame; returns its id
+    std::uint32_t receive(binary_responses_t *responses);
+
+    binary_responses_t call(const binary_requests_t &requests);
+
+private:
+    boost::asio::io_context _io_context;
+    boost::asio::generic::stream_protocol::socket _socket;
+    std::uint32_t _next_id;
+    std::string _output;
+    std::vector<char> _input;
+};
+
+}
@@ -0,0 +1,295 @@
+#include "binary_protocol.h"
+
+#include <stdexcept>
+
+#include "byte_codec.h"
+
+namespace code_directory {
+
+namespace {
+
+class Writer : public ByteWriter {
+public:
+    explicit Writer(std::string *out) :
+        ByteWriter(out)
+    {}
+
+    void rate(const rate_string &value) {
+        integer(value.value);
+    }
+
+    /// Starts a frame; its size is set by end_frame
+    void begin_frame(std::uint32_t id, size_t count) {
+        if (count > BinaryProtocol::MAX_MESSAGES) {
+            throw std::invalid_argument("Too many messages in frame");
+        }
+        _frame = _out->size();
+        integer(std::uint32_t(0));
+        integer(id);
+        integer(std::uint16_t(count));
+    }
+
+    void end_frame() {
+        size_t size = _out->size() - _frame - BinaryProtocol::HEADER_SIZE;
+        if (size > BinaryProtocol::MAX_FRAME_SIZE) {
+            throw std::invalid_argument("Frame is too large");
+        }
+        for (size_t i = 0; i < BinaryProtocol::HEADER_SIZE; ++i) {
+            (*_out)[_frame + i] = char((size >> (8 * i)) & 0xFF);
+        }
+    }
+
+private:
+    size_t _frame;
+};
+
+class Reader : public ByteReader {
+public:
+    Reader(const char *data, size_t size) :
+        ByteReader(data, size, "Frame is truncated", "Extra bytes in frame")
+    {}
+
+    code_string code() {
+        code_string value;
+        try {
+            value.set(string());
+        } catch (const std::invalid_argument &) {
+            throw std::invalid_argument("Invalid code in frame");
+        }
+        return value;
+    }
+
+    rate_string rate() {
+        rate_string value;
+        value.value = integer<std::uint64_t>();
+        return value;
+    }
+
+    binary_op_t op() {
+        auto op = integer<std::uint8_t>();
+        if (op < std::uint8_t(binary_op_t::get_rates) || op > std::uint8_t(binary_op_t::lcr)) {
+            throw std::invalid_argument("Unknown operation in frame");
+        }
+        return binary_op_t(op);
+    }
+};
+
+}
+
+size_t BinaryProtocol::frame_size(const char *header) {
+    size_t size = Reader(header, HEADER_SIZE).integer<std::uint32_t>();
+    if (size > MAX_FRAME_SIZE) {
+        throw std::invalid_argument("Frame is too large");
+    }
+    return size;
+}
+
+void BinaryProtocol::encode_requests(std::uint32_t id, const binary_requests_t &requests, std::string *out) {
+    Writer writer(out);
+    writer.begin_frame(id, requests.size());
+    for (const auto &request: requests) {
+        writer.integer(std::uint8_t(request.op));
+        switch (request.op) {
+        case binary_op_t::get_rates:
+            writer.integer(std::int32_t(request.vendor));
+            writer.string(request.codename);
+            break;
+        case binary_op_t::get_vendors:
+            writer.string(request.codename);
+            break;
+        case binary_op_t::lpm:
+            writer.integer(std::int32_t(request.vendor));
+            writer.string(request.number);
+            writer.integer(std::int64_t(request.time));
+            break;
+        case binary_op_t::lcr:
+            writer.string(request.number);
+            writer.integer(std::int64_t(request.time));
+            writer.integer(request.count);
+            break;
+        }
+    }
+    writer.end_frame();
+}
+
+void BinaryProtocol::encode_responses(std::uint32_t id, const binary_responses_t &responses, std::string *out) {
+    Writer writer(out);
+    writer.begin_frame(id, responses.size());
+    for (const auto &response: responses) {
+        writer.integer(std::uint8_t(response.op));
+        writer.integer(std::uint8_t(response.status));
+        if (response.status != binary_status_t::ok) {
+            writer.string(response.message);
+            continue;
+        }
+        switch (response.op) {
+        case binary_op_t::get_rates:
+            writer.rate(response.min);
+            writer.rate(response.max);
+            writer.integer(std::uint32_t(response.rates.size()));
+            for (const auto &rate: response.rates) {
+                writer.string(rate.code);
+                writer.rate(rate.rate);
+            }
+            break;
+        case binary_op_t::get_vendors:
+            writer.integer(std::uint32_t(response.vendors.size()));
+            for (const auto &vendor: response.vendors) {
+                writer.integer(std::int32_t(vendor.vendor));
+                writer.rate(vendor.min);
+                writer.rate(vendor.max);
+            }
+            break;
+        case binary_op_t::lpm:
+            writer.string(response.rate.code);
+            writer.rate(response.rate.rate);
+            break;
+        case binary_op_t::lcr:
+            writer.integer(std::uint16_t(response.routes.size()));
+            for (const auto &route: response.routes) {
+                writer.integer(std::int32_t(route.vendor));
+                writer.string(route.code);
+                writer.rate(route.rate);
+            }
+            break;
+        }
+    }
+    writer.end_frame();
+}
+
+std::uint32_t BinaryProtocol::decode_requests(const char *body, size_t size, binary_requests_t *requests) {
+    Reader reader(body, size);
+    auto id = reader.integer<std::uint32_t>();
+    size_t count = reader.integer<std::uint16_t>();
+    requests->clear();
+    requests->reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        binary_request_s request{};
+        request.op = reader.op();
+        switch (request.op) {
+        case binary_op_t::get_rates:
+            request.vendor = reader.integer<std::int32_t>();
+            request.codename = reader.string();
+            break;
+        case binary_op_t::get_vendors:
+            request.codename = reader.string();
+            break;
+        case binary_op_t::lpm:
+            request.vendor = reader.integer<std::int32_t>();
+            request.number = reader.code();
+            request.time = reader.integer<std::int64_t>();
+            break;
+        case binary_op_t::lcr:
+            request.number = reader.code();
+            request.time = reader.integer<std::int64_t>();
+            request.count = reader.integer<std::uint16_t>();
+            break;
+        }
+        requests->push_back(std::move(request));
+    }
+    reader.finish();
+    return id;
+}
+
+std::uint32_t BinaryProtocol::decode_responses(const char *body, size_t size, binary_responses_t *responses) {
+    Reader reader(body, size);
+    auto id = reader.integer<std::uint32_t>();
+    size_t count = reader.integer<std::uint16_t>();
+    responses->clear();
+    responses->reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        binary_response_s response{};
+        response.op = reader.op();
+        response.status = binary_status_t(reader.integer<std::uint8_t>());
+        if (response.status != binary_status_t::ok) {
+            response.message = reader.string();
+            responses->push_back(std::move(response));
+            continue;
+        }
+        switch (response.op) {
+        case binary_op_t::get_rates: {
+            response.min = reader.rate();
+            response.max = reader.rate();
+            size_t rates = reader.integer<std::uint32_t>();
+            for (size_t j = 0; j < rates; ++j) {
+                auto code = reader.code();
+                response.rates.emplace_back(code, reader.rate());
+            }
+            break;
+        }
+        case binary_op_t::get_vendors: {
+            size_t vendors = reader.integer<std::uint32_t>();
+            for (size_t j = 0; j < vendors; ++j) {
+                VendorId vendor = reader.integer<std::int32_t>();
+                auto min = reader.rate();
+                response.vendors.emplace_back(vendor, min, reader.rate());
+            }
+            break;
+        }
+        case binary_op_t::lpm:
+            response.rate.code = reader.code();
+            response.rate.rate = reader.rate();
+            break;
+        case binary_op_t::lcr: {
+            size_t routes = reader.integer<std::uint16_t>();
+            for (size_t j = 0; j < routes; ++j) {
+                CodeDirectory::route_s route;
+                route.vendor = reader.integer<std::int32_t>();
+                route.code = reader.code();
+                route.rate = reader.rate();
+                response.routes.push_back(route);
+            }
+            break;
+        }
+        }
+        responses->push_back(std::move(response));
+    }
+    reader.finish();
+    return id;
+}
+
+binary_response_s BinaryProtocol::handle(const CodeDirectory &directory, const binary_request_s &request) {
+    binary_response_s response{};
+    response.op = request.op;
+    response.status = binary_status_t::ok;
+    try {
+        switch (request.op) {
+        case binary_op_t::get_rates:
+            response.rates = directory.get_rates(request.vendor, request.codename,
+                                                 &response.min, &response.max);
+            break;
+        case binary_op_t::get_vendors:
+            response.vendors = directory.get_vendors(request.codename);
+            break;
+        case binary_op_t::lpm:
+            response.rate = directory.get_rates_at(request.vendor, { request.number }, { request.time }).front();
+            break;
+        case binary_op_t::lcr:
+            response.routes = directory.get_routes(request.number, request.time, request.count);
+            break;
+        }
+    } catch (const std::out_of_range &e) {
+        response.status = binary_status_t::not_found;
+        response.message = e.what();
+    } catch (const std::invalid_argument &e) {
+        response.status = binary_status_t::bad_request;
+        response.message = e.what();
+    } catch (const std::exception &e) {
+        response.status = binary_status_t::error;
+        response.message = e.what();
+    }
+    return response;
+}
+
+void BinaryProtocol::handle_frame(const CodeDirectory &directory, const char *body, size_t size, std::string *out) {
+    binary_requests_t requests;
+    auto id = decode_requests(body, size, &requests);
+    binary_responses_t responses;
+    responses.reserve(requests.size());
+    for (const auto &request: requests) {
+        responses.push_back(handle(directory, request));
+    }
+    encode_responses(id, responses, out);
+}
+
+}
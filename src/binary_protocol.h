@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "code_directory.h"
+#include "types.h"
+
+namespace code_directory {
+
+/*
+ * Compact binary protocol of the directory queries. Integers are
+ * little-endian, rates are rate_string::value.
+ *
+ *   frame    := u32 size | u32 id | u16 count | count * message
+ *   string   := u16 size | bytes
+ *
+ * size counts the bytes after itself. A client may send frames without
+ * waiting for replies; every request frame is answered by one frame with
+ * the same id and the same count of messages, in the order of requests.
+ *
+ *   request  := u8 op | arguments
+ *     get_rates     i32 vendor | string codename
+ *     get_vendors   string codename
+ *     lpm           i32 vendor | string number | i64 time
+ *     lcr           string number | i64 time | u16 count
+ *
+ *   response := u8 op | u8 status | result if status is ok, else string message
+ *     get_rates     u64 min | u64 max | u32 count | count * (string code | u64 rate)
+ *     get_vendors   u32 count | count * (i32 vendor | u64 min | u64 max)
+ *     lpm           string code | u64 rate
+ *     lcr           u16 count | count * (i32 vendor | string code | u64 rate)
+ */
+
+enum class binary_op_t : std::uint8_t {
+    /// CodeDirectory::get_rates
+    get_rates = 1,
+    /// CodeDirectory::get_vendors
+    get_vendors = 2,
+    /// Longest prefix match of one number, CodeDirectory::get_rates_at
+    lpm = 3,
+    /// Least cost routing of one number, CodeDirectory::get_routes
+    lcr = 4
+};
+
+enum class binary_status_t : std::uint8_t {
+    ok = 0,
+    /// Unknown vendor or codename
+    not_found = 1,
+    bad_request = 2,
+    error = 3
+};
+
+struct binary_request_s {
+    binary_op_t op;
+    /// get_rates, lpm
+    VendorId vendor;
+    /// get_rates, get_vendors
+    codename_t codename;
+    /// lpm, lcr
+    code_string number;
+    time_t time;
+    /// lcr: maximum count of vendors
+    std::uint16_t count;
+};
+typedef std::vector<binary_request_s> binary_requests_t;
+
+struct binary_response_s {
+    binary_op_t op;
+    binary_status_t status;
+    /// Unless status is ok
+    std::string message;
+    /// get_rates
+    CodeDirectory::rates_result_t rates;
+    rate_string min;
+    rate_string max;
+    /// get_vendors
+    CodeDirectory::vendors_result_t vendors;
+    /// lpm
+    CodeDirectory::rate_at_s rate;
+    /// lcr
+    CodeDirectory::routes_t routes;
+};
+typedef std::vector<binary_response_s> binary_responses_t;
+
+class BinaryProtocol {
+public:
+    /// Bytes of the frame size field
+    static constexpr size_t HEADER_SIZE = 4;
+    /// Larger frames are malformed
+    static constexpr size_t MAX_FRAME_SIZE = 16 << 20;
+    /// Most messages in one frame
+    static constexpr size_t MAX_MESSAGES = 0xFFFF;
+
+    /// Size of frame body that follows \p header; throws std::invalid_argument if too large
+    static size_t frame_size(const char *header);
+
+    /// Appends a whole frame, header included, to \p out
+    static void encode_requests(std::uint32_t id, const binary_requests_t &requests, std::string *out);
+    static void encode_responses(std::uint32_t id, const binary_responses_t &responses, std::string *out);
+
+    /**
+     * \brief Decodes frame body of \p size bytes.
+     *
+     * Throws std::invalid_argument if the frame is malformed: the rest of the
+     * stream can't be trusted then.
+     * \return Frame id
+     */
+    static std::uint32_t decode_requests(const char *body, size_t size, binary_requests_t *requests);
+    static std::uint32_t decode_responses(const char *body, size_t size, binary_responses_t *responses);
+
+    /// Runs one request; errors of the query are returned as status
+    static binary_response_s handle(const CodeDirectory &directory, const binary_request_s &request);
+
+    /// Decodes request frame body, runs all requests and appends response frame to \p out
+    static void handle_frame(const CodeDirectory &directory, const char *body, size_t size, std::string *out);
+};
+
+}
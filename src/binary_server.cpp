@@ -0,0 +1,164 @@
+#include "binary_server.h"
+
+#include <unistd.h>
+
+#include <cstring>
+
+#include <boost/log/trivial.hpp>
+
+namespace code_directory {
+
+namespace {
+
+typedef boost::asio::generic::stream_protocol::socket socket_t;
+
+/// Bytes read at once
+constexpr size_t READ_SIZE = 64 << 10;
+
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    Session(const CodeDirectory &directory, socket_t &&socket) :
+        _directory(directory),
+        _socket(std::move(socket)),
+        _used(0)
+    {}
+
+    void start() {
+        read();
+    }
+
+private:
+    void read() {
+        if (_input.size() < _used + READ_SIZE) {
+            _input.resize(_used + READ_SIZE);
+        }
+        auto self = shared_from_this();
+        _socket.async_read_some(boost::asio::buffer(&_input[_used], _input.size() - _used),
+                                [self](const boost::system::error_code &error, size_t size) {
+            if (error) {
+                return;
+            }
+            self->_used += size;
+            self->process();
+        });
+    }
+
+    /// Answers all complete frames read so far
+    void process() {
+        size_t begin = 0;
+        try {
+            while (_used - begin >= BinaryProtocol::HEADER_SIZE) {
+                size_t size = BinaryProtocol::frame_size(&_input[begin]);
+                if (_used - begin < BinaryProtocol::HEADER_SIZE + size) {
+                    break;
+                }
+                BinaryProtocol::handle_frame(_directory, &_input[begin + BinaryProtocol::HEADER_SIZE],
+                                             size, &_output);
+                begin += BinaryProtocol::HEADER_SIZE + size;
+            }
+        } catch (const std::exception &e) {
+            BOOST_LOG_TRIVIAL(warning) << "Closing binary protocol connection: " << e.what();
+            boost::system::error_code ignored;
+            _socket.close(ignored);
+            return;
+        }
+        if (begin != 0) {
+            std::memmove(_input.data(), &_input[begin], _used - begin);
+            _used -= begin;
+        }
+        if (_output.empty()) {
+            read();
+            return;
+        }
+        auto self = shared_from_this();
+        boost::asio::async_write(_socket, boost::asio::buffer(_output),
+                                 [self](const boost::system::error_code &error, size_t) {
+            if (error) {
+                return;
+            }
+            self->_output.clear();
+            self->read();
+        });
+    }
+
+    const CodeDirectory &_directory;
+    socket_t _socket;
+    std::vector<char> _input;
+    /// Bytes of _input read and not answered yet
+    size_t _used;
+    std::string _output;
+};
+
+}
+
+BinaryServer::BinaryServer(const CodeDirectory &directory, boost::asio::io_context &io_context) :
+    _directory(directory),
+    _io_context(io_context)
+{}
+
+BinaryServer::~BinaryServer() {
+    close();
+}
+
+boost::asio::ip::tcp::endpoint BinaryServer::listen_tcp(const boost::asio::ip::tcp::endpoint &endpoint) {
+    _tcp_acceptors.emplace_back(new tcp_acceptor_t(_io_context, endpoint));
+    accept(*_tcp_acceptors.back());
+    return _tcp_acceptors.back()->local_endpoint();
+}
+
+void BinaryServer::listen_local(const std::string &path) {
+    ::unlink(path.c_str());
+    _local_acceptors.emplace_back(new local_acceptor_t(_io_context,
+                                                       boost::asio::local::stream_protocol::endpoint(path)));
+    _local_paths.push_back(path);
+    accept(*_local_acceptors.back());
+}
+
+void BinaryServer::close() {
+    boost::system::error_code ignored;
+    for (auto &acceptor: _tcp_acceptors) {
+        acceptor->close(ignored);
+    }
+    for (auto &acceptor: _local_acceptors) {
+        acceptor->close(ignored);
+    }
+    for (const auto &path: _local_paths) {
+        ::unlink(path.c_str());
+    }
+    _local_paths.clear();
+}
+
+void BinaryServer::accept(tcp_acceptor_t &acceptor) {
+    acceptor.async_accept([this, &acceptor](const boost::system::error_code &error,
+                                            boost::asio::ip::tcp::socket socket) {
+        if (error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (!error) {
+            // Replies are small and must not wait for more data
+            boost::system::error_code ignored;
+            socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+            auto protocol = socket.local_endpoint().protocol();
+            auto handle = socket.release();
+            std::make_shared<Session>(_directory, socket_t(_io_context, protocol, handle))->start();
+        }
+        accept(acceptor);
+    });
+}
+
+void BinaryServer::accept(local_acceptor_t &acceptor) {
+    acceptor.async_accept([this, &acceptor](const boost::system::error_code &error,
+                                            boost::asio::local::stream_protocol::socket socket) {
+        if (error == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (!error) {
+            auto handle = socket.release();
+            std::make_shared<Session>(_directory, socket_t(_io_context, boost::asio::local::stream_protocol(),
+                                                           handle))->start();
+        }
+        accept(acceptor);
+    });
+}
+
+}
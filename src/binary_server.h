@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "binary_protocol.h"
+#include "code_directory.h"
+
+namespace code_directory {
+
+/**
+ * \brief Serves BinaryProtocol over TCP and Unix domain sockets.
+ *
+ * Work is done in the threads running \p io_context. Each connection reads
+ * whatever pipelined frames have arrived, answers all complete ones and
+ * writes the replies at once, so a client that sends many frames without
+ * waiting costs one read and one write per burst. Replies keep the order of
+ * requests. A malformed frame closes the connection.
+ */
+class BinaryServer {
+public:
+    BinaryServer(const CodeDirectory &directory, boost::asio::io_context &io_context);
+    ~BinaryServer();
+
+    /// Starts accepting on \p endpoint; port 0 picks a free one. Returns the bound endpoint.
+    boost::asio::ip::tcp::endpoint listen_tcp(const boost::asio::ip::tcp::endpoint &endpoint);
+    /// Starts accepting on Unix socket \p path, replacing a stale socket file
+    void listen_local(const std::string &path);
+
+    /// Stops accepting; open connections are served until clients close them
+    void close();
+
+private:
+    typedef boost::asio::ip::tcp::acceptor tcp_acceptor_t;
+    typedef boost::asio::local::stream_protocol::acceptor local_acceptor_t;
+
+    void accept(tcp_acceptor_t &acceptor);
+    void accept(local_acceptor_t &acceptor);
+
+    const CodeDirectory &_directory;
+    boost::asio::io_context &_io_context;
+    std::vector<std::unique_ptr<tcp_acceptor_t>> _tcp_acceptors;
+    std::vector<std::unique_ptr<local_acceptor_t>> _local_acceptors;
+    std::vector<std::string> _local_paths;
+};
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace code_directory {
+
+/**
+ * \brief Blocking FIFO queue of limited size between pipeline stages.
+ *
+ * push() waits while the queue is full, so a slow stage holds back the ones
+ * before it instead of letting work pile up in memory. After close() pushes
+ * are dropped and pop() returns false once the queue is drained.
+ */
+template<class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) :
+        _capacity(capacity > 0 ? capacity : 1),
+        _closed(false)
+    {}
+    BoundedQueue(const BoundedQueue &) = delete;
+
+    /// Returns false if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _not_full.wait(lock, [this]() {
+            return _closed || _items.size() < _capacity;
+        });
+        if (_closed) {
+            return false;
+        }
+        _items.push_back(std::move(item));
+        _not_empty.notify_one();
+        return true;
+    }
+
+    /// Returns false when the queue is closed and empty
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _not_empty.wait(lock, [this]() {
+            return _closed || !_items.empty();
+        });
+        if (_items.empty()) {
+            return false;
+        }
+        item = std::move(_items.front());
+        _items.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(_lock);
+        _closed = true;
+        _not_empty.notify_all();
+        _not_full.notify_all();
+    }
+
+private:
+    const size_t _capacity;
+    bool _closed;
+    std::mutex _lock;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<T> _items;
+};
+
+}
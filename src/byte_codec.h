@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace code_directory {
+
+/**
+ * \brief Appends little-endian integers and strings with a 16-bit length
+ * to a buffer; base of the binary protocol and journal encoders.
+ */
+class ByteWriter {
+public:
+    explicit ByteWriter(std::string *out) :
+        _out(out)
+    {}
+
+    template<class Integer>
+    void integer(Integer value) {
+        auto bits = static_cast<std::uint64_t>(value);
+        for (size_t i = 0; i < sizeof(Integer); ++i) {
+            _out->push_back(char(bits & 0xFF));
+            bits >>= 8;
+        }
+    }
+
+    void string(const std::string &value) {
+        if (value.size() > 0xFFFF) {
+            throw std::invalid_argument("String is too long");
+        }
+        integer(std::uint16_t(value.size()));
+        _out->append(value);
+    }
+
+protected:
+    std::string *_out;
+};
+
+/**
+ * \brief Reads what ByteWriter writes from a buffer of known size.
+ *
+ * Throws std::invalid_argument with \p truncated if a value runs past the
+ * end, and with \p extra from finish if bytes are left.
+ */
+class ByteReader {
+public:
+    ByteReader(const char *data, size_t size, const char *truncated, const char *extra) :
+        _data(data),
+        _left(size),
+        _truncated(truncated),
+        _extra(extra)
+    {}
+
+    template<class Integer>
+    Integer integer() {
+        need(sizeof(Integer));
+        std::uint64_t bits = 0;
+        for (size_t i = 0; i < sizeof(Integer); ++i) {
+            bits |= std::uint64_t(static_cast<unsigned char>(_data[i])) << (8 * i);
+        }
+        skip(sizeof(Integer));
+        return static_cast<Integer>(bits);
+    }
+
+    std::string string() {
+        size_t size = integer<std::uint16_t>();
+        need(size);
+        std::string value(_data, size);
+        skip(size);
+        return value;
+    }
+
+    void finish() const {
+        if (_left != 0) {
+            throw std::invalid_argument(_extra);
+        }
+    }
+
+protected:
+    void need(size_t size) const {
+        if (size > _left) {
+            throw std::invalid_argument(_truncated);
+        }
+    }
+    void skip(size_t size) {
+        _data += size;
+        _left -= size;
+    }
+
+    const char *_data;
+    size_t _left;
+
+private:
+    const char *_truncated;
+    const char *_extra;
+};
+
+}
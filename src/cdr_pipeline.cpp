@@ -0,0 +1,300 @@
+#include "cdr_pipeline.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <ostream>
+#include <thread>
+
+#include "bounded_queue.h"
+
+namespace code_directory {
+
+namespace {
+
+constexpr std::uint64_t NANOS = 1000000000;
+
+/// Rate value as count of billionths
+std::uint64_t to_nanos(const rate_string &rate) {
+    return (rate.value >> 32) * NANOS + (rate.value & 0xFFFFFFFF);
+}
+
+rate_string from_nanos(std::uint64_t nanos) {
+    rate_string ret;
+    ret.value = ((nanos / NANOS) << 32) | (nanos % NANOS);
+    return ret;
+}
+
+void append_rate(const rate_string &rate, std::string *out) {
+    if (rate.is_empty()) {
+        return;
+    }
+    char digits[32];
+    int length = std::snprintf(digits, sizeof(digits), "%u.%09u",
+                               unsigned(rate.value >> 32), unsigned(rate.value & 0xFFFFFFFF));
+    // Keep one digit after dot
+    while (length > 0 && digits[length - 1] == '0' && digits[length - 2] != '.') {
+        --length;
+    }
+    out->append(digits, length);
+}
+
+bool parse_integer(const std::string &line, size_t begin, size_t end, std::int64_t *value) {
+    if (begin == end) {
+        return false;
+    }
+    const std::string field = line.substr(begin, end - begin);
+    char *stop = nullptr;
+    errno = 0;
+    *value = std::strtoll(field.c_str(), &stop, 10);
+    return errno == 0 && stop == field.c_str() + field.length();
+}
+
+struct batch_s {
+    size_t sequence;
+    std::vector<std::string> lines;
+    std::vector<cdr_s> cdrs;
+    std::vector<rated_cdr_s> rated;
+    std::uint64_t rejected;
+    std::string text;
+};
+typedef std::unique_ptr<batch_s> batch_pointer_t;
+typedef BoundedQueue<batch_pointer_t> queue_t;
+
+}
+
+CdrPipeline::CdrPipeline(const CodeDirectory &directory, const pipeline_options_s &options) :
+    _directory(directory),
+    _options(options)
+{
+    if (_options.batch_size == 0) {
+        _options.batch_size = DEFAULT_PIPELINE_OPTIONS.batch_size;
+    }
+    if (_options.threads == 0) {
+        _options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+bool CdrPipeline::parse(const std::string &line, cdr_s *cdr) {
+    size_t commas[3];
+    size_t found = 0;
+    for (size_t pos = 0; pos < line.length(); ++pos) {
+        if (line[pos] == ',') {
+            if (found == 3) {
+                return false;
+            }
+            commas[found++] = pos;
+        }
+    }
+    if (found != 3) {
+        return false;
+    }
+    std::int64_t vendor, start, duration;
+    if (!parse_integer(line, commas[0] + 1, commas[1], &vendor) ||
+        !parse_integer(line, commas[1] + 1, commas[2], &start) ||
+        !parse_integer(line, commas[2] + 1, line.length(), &duration) ||
+        commas[0] == 0 || duration < 0 ||
+        vendor < std::numeric_limits<VendorId>::min() || vendor > std::numeric_limits<VendorId>::max()) {
+        return false;
+    }
+    try {
+        cdr->number.set(line.substr(0, commas[0]));
+    } catch (const std::invalid_argument &) {
+        return false;
+    }
+    cdr->vendor = VendorId(vendor);
+    cdr->start = start;
+    cdr->duration = duration;
+    return true;
+}
+
+rate_string CdrPipeline::price(const rate_string &rate, std::int64_t duration) {
+    if (rate.is_empty()) {
+        return rate_string{};
+    }
+    unsigned __int128 cost = static_cast<unsigned __int128>(to_nanos(rate)) * std::uint64_t(duration);
+    return from_nanos(std::uint64_t((cost + 59) / 60));
+}
+
+void CdrPipeline::format(const rated_cdr_s &rated, std::string *out) {
+    out->append(std::string(rated.cdr.number));
+    out->push_back(',');
+    out->append(std::to_string(rated.cdr.vendor));
+    out->push_back(',');
+    out->append(std::to_string(rated.cdr.start));
+    out->push_back(',');
+    out->append(std::to_string(rated.cdr.duration));
+    out->push_back(',');
+    out->append(std::string(rated.code));
+    out->push_back(',');
+    append_rate(rated.rate, out);
+    out->push_back(',');
+    append_rate(rated.cost, out);
+    out->push_back('\n');
+}
+
+pipeline_stats_s CdrPipeline::run(std::istream &in, std::ostream &out) const {
+    const size_t queue_size = _options.queue_batches;
+    queue_t parse_queue(queue_size), lookup_queue(queue_size), price_queue(queue_size), write_queue(queue_size);
+    queue_t *queues[] = { &parse_queue, &lookup_queue, &price_queue, &write_queue };
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+    auto fail = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(error_lock);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        for (auto queue: queues) {
+            queue->close();
+        }
+    };
+
+    // Runs threads taking batches from one queue to the next; the last one closes the next
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<std::atomic<size_t>>> running;
+    auto start_stage = [&](queue_t &from, queue_t &to, std::function<void(batch_s &)> stage) {
+        running.emplace_back(new std::atomic<size_t>(_options.threads));
+        auto &left = *running.back();
+        for (size_t i = 0; i < _options.threads; ++i) {
+            threads.emplace_back([&from, &to, &left, &fail, stage]() {
+                try {
+                    batch_pointer_t batch;
+                    while (from.pop(batch)) {
+                        stage(*batch);
+                        to.push(std::move(batch));
+                    }
+                } catch (...) {
+                    fail();
+                }
+                if (--left == 0) {
+                    to.close();
+                }
+            });
+        }
+    };
+
+    start_stage(parse_queue, lookup_queue, [](batch_s &batch) {
+        batch.cdrs.reserve(batch.lines.size());
+        cdr_s cdr;
+        for (const auto &line: batch.lines) {
+            if (parse(line, &cdr)) {
+                batch.cdrs.push_back(cdr);
+            } else if (!line.empty()) {
+                ++batch.rejected;
+            }
+        }
+        batch.lines.clear();
+    });
+
+    start_stage(lookup_queue, price_queue, [this](batch_s &batch) {
+        batch.rated.resize(batch.cdrs.size());
+        // One batch LPM per vendor
+        std::vector<size_t> order(batch.cdrs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&batch](size_t left, size_t right) {
+            return batch.cdrs[left].vendor < batch.cdrs[right].vendor;
+        });
+        std::vector<code_string> numbers;
+        std::vector<time_t> times;
+        for (size_t first = 0; first < order.size();) {
+            const auto vendor = batch.cdrs[order[first]].vendor;
+            size_t last = first;
+            numbers.clear();
+            times.clear();
+            for (; last < order.size() && batch.cdrs[order[last]].vendor == vendor; ++last) {
+                numbers.push_back(batch.cdrs[order[last]].number);
+                times.push_back(batch.cdrs[order[last]].start);
+            }
+            std::vector<CodeDirectory::rate_at_s> found;
+            try {
+                found = _directory.get_rates_at(vendor, numbers, times);
+            } catch (const std::out_of_range &) {
+                found.resize(numbers.size());
+            }
+            for (size_t i = first; i < last; ++i) {
+                auto &rated = batch.rated[order[i]];
+                rated.cdr = batch.cdrs[order[i]];
+                rated.code = found[i - first].code;
+                rated.rate = found[i - first].rate;
+            }
+            first = last;
+        }
+        batch.cdrs.clear();
+    });
+
+    start_stage(price_queue, write_queue, [](batch_s &batch) {
+        for (auto &rated: batch.rated) {
+            rated.cost = price(rated.rate, rated.cdr.duration);
+            format(rated, &batch.text);
+        }
+    });
+
+    threads.emplace_back([&]() {
+        try {
+            size_t sequence = 0;
+            std::string line;
+            while (in) {
+                batch_pointer_t batch(new batch_s());
+                batch->sequence = sequence++;
+                batch->rejected = 0;
+                batch->lines.reserve(_options.batch_size);
+                while (batch->lines.size() < _options.batch_size && std::getline(in, line)) {
+                    batch->lines.push_back(line);
+                }
+                if (batch->lines.empty() || !parse_queue.push(std::move(batch))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+        parse_queue.close();
+    });
+
+    // Write stage runs here and restores input order
+    pipeline_stats_s stats { 0, 0, 0, 0 };
+    try {
+        std::map<size_t, batch_pointer_t> pending;
+        size_t next = 0;
+        batch_pointer_t batch;
+        while (write_queue.pop(batch)) {
+            pending.emplace(batch->sequence, std::move(batch));
+            for (auto found = pending.find(next); found != pending.end(); found = pending.find(++next)) {
+                const auto &ready = *found->second;
+                out.write(ready.text.data(), ready.text.size());
+                stats.rejected += ready.rejected;
+                for (const auto &rated: ready.rated) {
+                    ++stats.records;
+                    ++(rated.rate.is_empty() ? stats.unrated : stats.rated);
+                }
+                pending.erase(found);
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("Can't write rated records");
+        }
+    } catch (...) {
+        fail();
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return stats;
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+#include "code_directory.h"
+#include "types.h"
+
+namespace code_directory {
+
+/// Call detail record
+struct cdr_s {
+    code_string number;
+    VendorId vendor;
+    /// Call start, in the same units as Rate::effective_date
+    time_t start;
+    /// Seconds
+    std::int64_t duration;
+};
+
+struct rated_cdr_s {
+    cdr_s cdr;
+    /// Matched code and its rate per minute; empty if no rate is in effect
+    code_string code;
+    rate_string rate;
+    /// Rate for the duration, billed per second; empty if not rated
+    rate_string cost;
+};
+
+struct pipeline_options_s {
+    /// Records passed between stages at once
+    size_t batch_size;
+    /// Batches each queue between stages can hold
+    size_t queue_batches;
+    /// Threads of every parallel stage; 0 is one per core
+    size_t threads;
+};
+
+constexpr pipeline_options_s DEFAULT_PIPELINE_OPTIONS = { 4096, 4, 0 };
+
+struct pipeline_stats_s {
+    std::uint64_t records;
+    std::uint64_t rated;
+    /// Records of unknown vendors or with no rate in effect
+    std::uint64_t unrated;
+    /// Lines that are not records
+    std::uint64_t rejected;
+};
+
+/**
+ * \brief Rates call detail records against a CodeDirectory in bulk.
+ *
+ * Batches of records go through stages connected by bounded queues:
+ * read -> parse -> LPM -> price -> write. Parse, LPM and price run on
+ * several threads each; reading and writing are sequential and the output
+ * keeps the input order. LPM is done per vendor with
+ * CodeDirectory::get_rates_at, so a record gets the rate in effect at the
+ * call start.
+ *
+ * Input lines are "number,vendor,start,duration"; output lines are
+ * "number,vendor,start,duration,code,rate,cost" with empty code, rate and
+ * cost for unrated records.
+ */
+class CdrPipeline {
+public:
+    explicit CdrPipeline(const CodeDirectory &directory,
+                         const pipeline_options_s &options = DEFAULT_PIPELINE_OPTIONS);
+
+    /// Rates every record of \p in to \p out; rethrows the first stage error
+    pipeline_stats_s run(std::istream &in, std::ostream &out) const;
+
+    /// Returns false if \p line is not a record
+    static bool parse(const std::string &line, cdr_s *cdr);
+    /// Cost of \p duration seconds at \p rate per minute, rounded up
+    static rate_string price(const rate_string &rate, std::int64_t duration);
+    /// Appends output line of \p rated to \p out
+    static void format(const rated_cdr_s &rated, std::string *out);
+
+private:
+    const CodeDirectory &_directory;
+    pipeline_options_s _options;
+};
+
+}
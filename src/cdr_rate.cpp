@@ -0,0 +1,115 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+
+#include "cdr_pipeline.h"
+#include "code_directory.h"
+
+using namespace std;
+namespace po = boost::program_options;
+using namespace code_directory;
+
+/// Loads lines "vendor,code,rate,effective_date,end_date"; empty end_date never ends
+static size_t load_rates(istream &in, CodeDirectory &directory) {
+    map<VendorId, boost::shared_ptr<VendorTree>> trees;
+    string line;
+    size_t count = 0, line_number = 0;
+    while (getline(in, line)) {
+        ++line_number;
+        if (line.empty()) {
+            continue;
+        }
+        vector<string> fields;
+        size_t begin = 0;
+        for (size_t end = line.find(','); end != string::npos; end = line.find(',', begin)) {
+            fields.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        fields.push_back(line.substr(begin));
+        try {
+            if (fields.size() != 5) {
+                throw invalid_argument("Expected 5 fields");
+            }
+            auto &tree = trees[str_to_vendor(fields[0])];
+            if (!tree) {
+                tree = boost::make_shared<VendorTree>();
+            }
+            time_t end_date = fields[4].empty() ? get_empty<time_t>() : stoll(fields[4]);
+            tree->add_rate(code_string{fields[1].c_str()}, rate_string{fields[2].c_str()},
+                           stoll(fields[3]), end_date);
+            ++count;
+        } catch (const exception &e) {
+            BOOST_LOG_TRIVIAL(warning) << "Skipping rate on line " << line_number << ": " << e.what();
+        }
+    }
+    for (auto &tree: trees) {
+        directory.set_vendor_tree(tree.first, tree.second);
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    string rates_file, input_file, output_file;
+    pipeline_options_s options = DEFAULT_PIPELINE_OPTIONS;
+    po::options_description desc("Rates call detail records \"number,vendor,start,duration\"");
+    desc.add_options()
+            ("help,h", "show help message")
+            ("rates,r", po::value<string>(&rates_file)->required(),
+             "Rates file, lines \"vendor,code,rate,effective_date,end_date\"")
+            ("input,i", po::value<string>(&input_file)->required(),
+             "Call detail records file")
+            ("output,o", po::value<string>(&output_file)->required(),
+             "Rated records file")
+            ("thread-count,t", po::value<size_t>(&options.threads)->default_value(0),
+             "Number of threads of each stage. 0 means Auto")
+            ("batch-size,b", po::value<size_t>(&options.batch_size)->default_value(options.batch_size),
+             "Records passed between stages at once");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            cout << desc;
+            return 0;
+        }
+        po::notify(vm);
+    } catch (const po::error &e) {
+        BOOST_LOG_TRIVIAL(error) << e.what();
+        cout << desc;
+        return -1;
+    }
+
+    ifstream rates(rates_file), input(input_file);
+    if (!rates || !input) {
+        BOOST_LOG_TRIVIAL(error) << "Can't open input files";
+        return -1;
+    }
+    ofstream output(output_file);
+    if (!output) {
+        BOOST_LOG_TRIVIAL(error) << "Can't open output file \"" << output_file << "\"";
+        return -1;
+    }
+
+    CodeDirectory directory;
+    auto rate_count = load_rates(rates, directory);
+    BOOST_LOG_TRIVIAL(info) << "Loaded " << rate_count << " rates";
+
+    auto start = chrono::steady_clock::now();
+    pipeline_stats_s stats;
+    try {
+        stats = CdrPipeline(directory, options).run(input, output);
+    } catch (const exception &e) {
+        BOOST_LOG_TRIVIAL(error) << "Rating failed: " << e.what();
+        return -1;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    BOOST_LOG_TRIVIAL(info) << stats.records << " records: " << stats.rated << " rated, "
+                            << stats.unrated << " unrated; " << stats.rejected << " lines rejected; "
+                            << stats.records / elapsed.count() << " records/s";
+    return 0;
+}
@@ -1,33 +1,728 @@
 #include "code_directory.h"
 
+#include <algorithm>
 #include <atomic>
+#include <ctime>
+#include <exception>
+#include <map>
+#include <mutex>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "tree_diff.h"
+#include "parallel.h"
+#include "query_arena.h"
+#include "trie_join.h"
 #include "visit_stats.h"
 
 namespace code_directory {
 
-CodeDirectory::CodeDirectory()
+namespace {
+
+/// Visitor for diff_trees collecting changed codes
+class ChangedCodes {
+public:
+    template<class Node>
+    void changed(const Node *, const Node *, const code_path_s &path) {
+        codes.push_back(path.code());
+    }
+    std::vector<code_string> codes;
+};
+
+/// Visitor for join_subtree collecting rates of one codename
+template<class Result>
+class CodenameRates {
+public:
+    CodenameRates(const codename_t &codename, Result &result, rate_summary_s &summary) :
+        _codename(codename),
+        _result(result),
+        _summary(summary)
+    {}
+    template<class Node>
+    void visit(const Node &node, const codename_t *found, const code_path_s &path) {
+        if (found != nullptr && *found == _codename) {
+            _result.emplace_back(path.code(), node.data().rate);
+            _summary.add(node.data().rate);
+        }
+    }
+private:
+    const codename_t &_codename;
+    Result &_result;
+    rate_summary_s &_summary;
+};
+
+}
+
+CodeDirectory::CodeDirectory(bool share_subtrees) :
+    _generation(0),
+    _vendors_generation(0),
+    _codename_generation(0),
+    _rates_cache(DEFAULT_CACHE_CAPACITY),
+    _vendors_cache(DEFAULT_CACHE_CAPACITY),
+    _parallel_threads(1),
+    _parallel_threshold(DEFAULT_PARALLEL_THRESHOLD),
+    _next_subscription(0),
+    _next_scheduled(0),
+    _activation_rebuilds(0),
+    _clock([]() { return time_t(std::time(nullptr)); }),
+    _stopping(false)
 {
+    if (share_subtrees) {
+        _store.reset(new SharedTrieStore);
+    }
+}
 
+CodeDirectory::~CodeDirectory() {
+    stop_scheduler();
 }
 
 void CodeDirectory::remove_vendor(VendorId vendor) {
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    _fingerprints.erase(vendor);
     auto v_row = _vendors.find(vendor);
     if (v_row == _vendors.end()) {
         return;
     }
     decltype(_vendors)::mapped_type empty_value;
-    boost::atomic_store(&v_row->second, empty_value);
+    auto before = boost::atomic_exchange(&v_row->second, empty_value);
+    _vendors_generation = ++_generation;
+
+    if (before && has_subscribers()) {
+        std::set<codename_t> codenames;
+        for (const auto &codename: before->summary->by_codename()) {
+            codenames.insert(codename.first);
+        }
+        deltas_t deltas;
+        add_deltas(vendor, before.get(), nullptr, codenames, deltas);
+        notify(deltas);
+    }
 }
 
 
 void CodeDirectory::set_vendor_tree(VendorId vendor, CodeDirectory::tree_pointer_t tree) {
-    boost::atomic_store(&_vendors[vendor], tree);
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    auto codenames = boost::atomic_load(&_codenames);
+    publish_state(vendor, prepare_state(tree, codenames), codenames);
+}
+
+CodeDirectory::state_pointer_t CodeDirectory::prepare_state(tree_pointer_t tree, const codename_pointer_t &codenames) {
+    if (!tree) {
+        return {};
+    }
+    SharedTrieStore::root_pointer_t shared;
+    if (_store) {
+        shared = _store->intern(*tree);
+        tree.reset();
+    }
+    return make_state(tree, shared, codenames, ++_generation);
+}
+
+CodeDirectory::state_pointer_t CodeDirectory::publish_state(VendorId vendor,
+                                                            const state_pointer_t &state,
+                                                            const codename_pointer_t &codenames) {
+    auto before = boost::atomic_exchange(&_vendors[vendor], state);
+    _vendors_generation = ++_generation;
+    _fingerprints.erase(vendor);
+
+    if (!has_subscribers() || !codenames) {
+        return before;
+    }
+    std::set<codename_t> affected;
+    if (before && state && before->summary->built_for(codenames)) {
+        for (const auto &code: changed_codes(*before, *state)) {
+            auto found = codenames->classify(code);
+            if (found.codename != nullptr) {
+                affected.insert(*found.codename);
+            }
+        }
+    } else {
+        for (const auto *side: { before.get(), state.get() }) {
+            if (side != nullptr) {
+                for (const auto &codename: side->summary->by_codename()) {
+                    affected.insert(codename.first);
+                }
+            }
+        }
+    }
+    deltas_t deltas;
+    add_deltas(vendor, before.get(), state.get(), affected, deltas);
+    notify(deltas);
+    return before;
+}
+
+size_t CodeDirectory::schedule_vendor_tree(VendorId vendor, tree_pointer_t tree, time_t activation) {
+    scheduled_s scheduled;
+    // Queued before the publishing lock is released, so set_codename_tree
+    // finds it and re-derives it if the codename tree changes
+    std::lock_guard<std::recursive_mutex> publish_lock(_publish_lock);
+    // Activation must not insert into _vendors, which readers use without locks
+    if (_vendors.find(vendor) == _vendors.end()) {
+        throw std::out_of_range("Vendor not found");
+    }
+    scheduled.vendor = vendor;
+    scheduled.codenames = boost::atomic_load(&_codenames);
+    scheduled.state = prepare_state(tree, scheduled.codenames);
+
+    std::lock_guard<std::mutex> lock(_schedule_lock);
+    auto id = _next_scheduled++;
+    _scheduled.emplace(std::make_pair(activation, id), std::move(scheduled));
+    _schedule_changed.notify_all();
+    return id;
+}
+
+bool CodeDirectory::cancel_scheduled(size_t id) {
+    std::lock_guard<std::mutex> lock(_schedule_lock);
+    for (auto it = _scheduled.begin(); it != _scheduled.end(); ++it) {
+        if (it->first.second == id) {
+            _scheduled.erase(it);
+            _schedule_changed.notify_all();
+            return true;
+        }
+    }
+    return false;
+}
+
+time_t CodeDirectory::next_activation() const {
+    std::lock_guard<std::mutex> lock(_schedule_lock);
+    return _scheduled.empty() ? get_empty<time_t>() : _scheduled.begin()->first.first;
+}
+
+size_t CodeDirectory::run_due() {
+    std::vector<scheduled_s> due;
+    {
+        std::lock_guard<std::mutex> lock(_schedule_lock);
+        auto now = _clock();
+        while (!_scheduled.empty() && _scheduled.begin()->first.first <= now) {
+            due.push_back(std::move(_scheduled.begin()->second));
+            _scheduled.erase(_scheduled.begin());
+        }
+    }
+    // Replaced trees are freed after all due trees are published
+    std::vector<state_pointer_t> replaced;
+    for (auto &scheduled: due) {
+        std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+        auto codenames = boost::atomic_load(&_codenames);
+        if (scheduled.state && scheduled.codenames != codenames) {
+            // Only if the codename tree changed after it was taken out of _scheduled
+            ++_activation_rebuilds;
+            const auto &state = *scheduled.state;
+            scheduled.state = make_state(state.tree, state.shared, codenames, state.generation);
+        }
+        // Vendors are never erased from _vendors, so this finds an existing row
+        replaced.push_back(publish_state(scheduled.vendor, scheduled.state, codenames));
+    }
+    return due.size();
 }
+
+void CodeDirectory::set_clock(clock_function_t clock) {
+    std::lock_guard<std::mutex> lock(_schedule_lock);
+    _clock = clock;
+    _schedule_changed.notify_all();
+}
+
+void CodeDirectory::start_scheduler() {
+    std::lock_guard<std::mutex> lock(_schedule_lock);
+    if (_scheduler.joinable()) {
+        return;
+    }
+    _stopping = false;
+    _scheduler = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(_schedule_lock);
+        while (!_stopping) {
+            if (_scheduled.empty()) {
+                _schedule_changed.wait(lock);
+                continue;
+            }
+            auto left = _scheduled.begin()->first.first - _clock();
+            if (left > 1) {
+                _schedule_changed.wait_for(lock, std::chrono::seconds(left - 1));
+                continue;
+            }
+            if (left > 0) {
+                _schedule_changed.wait_for(lock, SCHEDULER_TICK);
+                continue;
+            }
+            lock.unlock();
+            run_due();
+            lock.lock();
+        }
+    });
+}
+
+void CodeDirectory::stop_scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(_schedule_lock);
+        _stopping = true;
+        _schedule_changed.notify_all();
+    }
+    if (_scheduler.joinable()) {
+        _scheduler.join();
+    }
+}
+
+CodeDirectory::fingerprint_t CodeDirectory::fingerprint(const char *data, size_t size) {
+    fingerprint_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool CodeDirectory::reload_vendor_tree(VendorId vendor, fingerprint_t fingerprint, const tree_loader_t &load) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+        auto found = _fingerprints.find(vendor);
+        if (found != _fingerprints.end() && found->second == fingerprint) {
+            if (_reload) {
+                _reload->unchanged.push_back(vendor);
+            }
+            return false;
+        }
+    }
+    // Parsing may take long, others keep publishing meanwhile
+    auto tree = load();
+
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    auto codenames = boost::atomic_load(&_codenames);
+    publish_state(vendor, prepare_state(tree, codenames), codenames);
+    _fingerprints[vendor] = fingerprint;
+    if (_reload) {
+        _reload->changed.push_back(vendor);
+    }
+    return true;
+}
+
+bool CodeDirectory::reload_codename_tree(fingerprint_t fingerprint, const codename_loader_t &load) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+        if (_codename_fingerprint == fingerprint) {
+            return false;
+        }
+    }
+    auto tree = load();
+
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    set_codename_tree(tree);
+    _codename_fingerprint = fingerprint;
+    if (_reload) {
+        _reload->codenames_changed = true;
+    }
+    return true;
+}
+
+boost::optional<CodeDirectory::fingerprint_t> CodeDirectory::vendor_fingerprint(VendorId vendor) const {
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    auto found = _fingerprints.find(vendor);
+    if (found == _fingerprints.end()) {
+        return boost::none;
+    }
+    return found->second;
+}
+
+boost::optional<CodeDirectory::fingerprint_t> CodeDirectory::codename_fingerprint() const {
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    return _codename_fingerprint;
+}
+
+void CodeDirectory::begin_reload() {
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    _reload = reload_report_s();
+}
+
+CodeDirectory::reload_report_s CodeDirectory::end_reload() {
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    if (!_reload) {
+        throw std::logic_error("No reload cycle in progress");
+    }
+    reload_report_s report = std::move(*_reload);
+    _reload.reset();
+
+    for (auto *vendors: { &report.changed, &report.unchanged }) {
+        std::sort(vendors->begin(), vendors->end());
+        vendors->erase(std::unique(vendors->begin(), vendors->end()), vendors->end());
+    }
+    for (const auto &row: _vendors) {
+        if (boost::atomic_load(&row.second) &&
+            !std::binary_search(report.changed.begin(), report.changed.end(), row.first) &&
+            !std::binary_search(report.unchanged.begin(), report.unchanged.end(), row.first)) {
+            report.missing.push_back(row.first);
+        }
+    }
+    std::sort(report.missing.begin(), report.missing.end());
+    return report;
+}
+
 void CodeDirectory::set_codename_tree(codename_pointer_t tree) {
-    boost::atomic_store(&_codenames, tree);
+    std::lock_guard<std::recursive_mutex> lock(_publish_lock);
+    auto before_tree = boost::atomic_exchange(&_codenames, tree);
+    _codename_generation = ++_generation;
+    _codename_fingerprint.reset();
+
+    // Codes that changed codename move rates between their old and new codenames
+    std::set<codename_t> affected;
+    const bool notifying = has_subscribers();
+    if (notifying) {
+        ChangedCodes changed;
+        diff_trees(before_tree ? &before_tree->root() : nullptr, tree ? &tree->root() : nullptr, changed);
+        for (const auto &code: changed.codes) {
+            for (const auto *codenames: { before_tree.get(), tree.get() }) {
+                auto found = codenames != nullptr ? codenames->classify(code) : CodenameTree::classification_s{};
+                if (found.codename != nullptr) {
+                    affected.insert(*found.codename);
+                }
+            }
+        }
+    }
+
+    // Every vendor summary is split by codenames of the old tree
+    deltas_t deltas;
+    for (auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        if (state) {
+            auto after = make_state(state->tree, state->shared, tree, state->generation);
+            boost::atomic_store(&vendor.second, after);
+            if (notifying) {
+                add_deltas(vendor.first, state.get(), after.get(), affected, deltas);
+            }
+        }
+    }
+    if (notifying) {
+        notify(deltas);
+    }
+
+    // Scheduled states too, so activation only swaps a pointer. Derived
+    // without the schedule lock, which the scheduler thread takes to activate.
+    std::vector<std::pair<std::pair<time_t, size_t>, state_pointer_t>> pending;
+    {
+        std::lock_guard<std::mutex> schedule_lock(_schedule_lock);
+        for (const auto &scheduled: _scheduled) {
+            if (scheduled.second.state) {
+                pending.emplace_back(scheduled.first, scheduled.second.state);
+            }
+        }
+    }
+    for (auto &row: pending) {
+        const auto &state = *row.second;
+        row.second = make_state(state.tree, state.shared, tree, state.generation);
+    }
+    std::lock_guard<std::mutex> schedule_lock(_schedule_lock);
+    for (auto &row: pending) {
+        // Canceled or taken for activation meanwhile
+        auto found = _scheduled.find(row.first);
+        if (found != _scheduled.end()) {
+            found->second.state = row.second;
+            found->second.codenames = tree;
+        }
+    }
 }
 
+std::vector<code_string> CodeDirectory::changed_codes(const vendor_state_s &before, const vendor_state_s &after) {
+    ChangedCodes changed;
+    if (before.tree && after.tree) {
+        diff_trees(&before.tree->root(), &after.tree->root(), changed);
+    } else if (before.shared && after.shared) {
+        diff_trees(before.shared.get(), after.shared.get(), changed);
+    }
+    return changed.codes;
+}
+
+void CodeDirectory::add_deltas(VendorId vendor,
+                               const vendor_state_s *before,
+                               const vendor_state_s *after,
+                               const std::set<codename_t> &codenames,
+                               deltas_t &deltas) {
+    for (const auto &codename: codenames) {
+        const rate_summary_s *old_rates = before ? before->summary->for_codename(codename) : nullptr;
+        const rate_summary_s *new_rates = after ? after->summary->for_codename(codename) : nullptr;
+        codename_delta_s delta { codename, vendor, {}, {} };
+        if (old_rates != nullptr) {
+            delta.before = *old_rates;
+        }
+        if (new_rates != nullptr) {
+            delta.after = *new_rates;
+        }
+        if (delta.before.min != delta.after.min || delta.before.max != delta.after.max) {
+            deltas.push_back(delta);
+        }
+    }
+}
+
+size_t CodeDirectory::subscribe(change_callback_t callback) {
+    std::lock_guard<std::mutex> lock(_subscribers_lock);
+    _subscribers.emplace(_next_subscription, callback);
+    return _next_subscription++;
+}
+
+void CodeDirectory::unsubscribe(size_t subscription) {
+    std::lock_guard<std::mutex> lock(_subscribers_lock);
+    _subscribers.erase(subscription);
+}
+
+bool CodeDirectory::has_subscribers() const {
+    std::lock_guard<std::mutex> lock(_subscribers_lock);
+    return !_subscribers.empty();
+}
+
+void CodeDirectory::notify(deltas_t &deltas) const {
+    if (deltas.empty()) {
+        return;
+    }
+    std::sort(deltas.begin(), deltas.end(), [](const codename_delta_s &left, const codename_delta_s &right) {
+        return left.codename < right.codename ||
+               (left.codename == right.codename && left.vendor < right.vendor);
+    });
+    // Callbacks may subscribe or unsubscribe
+    std::vector<change_callback_t> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(_subscribers_lock);
+        for (const auto &subscriber: _subscribers) {
+            callbacks.push_back(subscriber.second);
+        }
+    }
+    for (const auto &callback: callbacks) {
+        callback(deltas);
+    }
+}
+
+CodeDirectory::state_pointer_t CodeDirectory::make_state(const tree_pointer_t &tree,
+                                                         const SharedTrieStore::root_pointer_t &shared,
+                                                         const codename_pointer_t &codenames,
+                                                         std::uint64_t generation) const {
+    auto state = boost::make_shared<vendor_state_s>();
+    state->tree = tree;
+    state->shared = shared;
+    state->generation = generation;
+    if (tree) {
+        state->summary = boost::make_shared<VendorSummary>(tree->root(), codenames);
+    } else {
+        state->summary = boost::make_shared<VendorSummary>(*shared, codenames);
+    }
+    return state;
+}
+
+
+template<class Result>
+void CodeDirectory::collect_rates(const vendor_state_s &state,
+                                  const CodenameTree &codenames,
+                                  const codename_t &codename,
+                                  Result &result,
+                                  rate_string *min_rate,
+                                  rate_string *max_rate,
+                                  std::pmr::memory_resource *scratch) const {
+    typedef VendorTree::node_t node_t;
+    typedef std::pmr::set<const node_t*> node_set;
+    typedef std::pmr::vector<const node_t*> node_vector;
+
+    rate_summary_s summary;
+    const auto &codes = codenames.codes_for_name(codename);
+    const size_t threads = _parallel_threads;
+    const size_t threshold = _parallel_threshold;
+    // Chunks of parallel stages allocate from scratch through this
+    SynchronizedResource shared_scratch(scratch);
+
+    // 3. For every code in all_rates, search for codename with maximum
+    //    prefix and take only those belonging to China Proper.
+    //    Rates found by each thread are appended in the order of nodes.
+    auto filter_parallel = [&](const node_vector &nodes) {
+        std::pmr::vector<pmr_rates_result_t> rows(threads, &shared_scratch);
+        std::pmr::vector<rate_summary_s> summaries(threads, scratch);
+        auto chunks = parallel_chunks(nodes.size(), threads, [&](size_t begin, size_t end, size_t chunk) {
+            for (size_t i = begin; i < end; ++i) {
+                auto code = nodes[i]->code();
+                if (codenames.is_code_for_name(code, codename)) {
+                    rows[chunk].emplace_back(code, nodes[i]->data().rate);
+                    summaries[chunk].add(nodes[i]->data().rate);
+                }
+            }
+        });
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            result.insert(result.end(), rows[chunk].begin(), rows[chunk].end());
+            summary.add(summaries[chunk]);
+        }
+    };
+
+    if (state.tree && threads > 1 && codes.size() >= threshold) {
+        const auto &v_tree = state.tree;
+
+        // 1. LPM of every code of the codename, split between threads
+        node_vector roots(codes.size(), scratch);
+        parallel_chunks(codes.size(), threads, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                roots[i] = v_tree->max_matching_node(codes[i]);
+            }
+        });
+        std::sort(roots.begin(), roots.end());
+        roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+        if (!roots.empty() && roots.front() == nullptr) {
+            roots.erase(roots.begin());
+        }
+        // Subtree of a root under another root is collected with that one
+        auto covered = [&roots](const node_t *node) {
+            for (auto parent = node->parent(); parent != nullptr; parent = parent->parent()) {
+                if (std::binary_search(roots.begin(), roots.end(), parent)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        roots.erase(std::remove_if(roots.begin(), roots.end(), covered), roots.end());
+
+        // 2. Rates under the remaining roots; their subtrees don't overlap
+        class RatesCollector {
+        public:
+            explicit RatesCollector(node_vector &_nodes) :
+                nodes(_nodes)
+            {}
+            bool visit(const node_t &node) {
+                if (!is_empty(node.data())) {
+                    nodes.push_back(&node);
+                }
+                return true;
+            }
+            node_vector &nodes;
+        };
+        std::pmr::vector<node_vector> collected(threads, &shared_scratch);
+        auto chunks = parallel_chunks(roots.size(), threads, [&](size_t begin, size_t end, size_t chunk) {
+            RatesCollector collector(collected[chunk]);
+            for (size_t i = begin; i < end; ++i) {
+                roots[i]->accept(collector);
+            }
+        });
+        node_vector all_rates(scratch);
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            const auto &nodes = collected[chunk];
+            all_rates.insert(all_rates.end(), nodes.begin(), nodes.end());
+        }
+        // Same order as the node set of the serial path
+        std::sort(all_rates.begin(), all_rates.end());
+
+        if (all_rates.size() >= threshold) {
+            filter_parallel(all_rates);
+        } else {
+            for (auto node: all_rates) {
+                if (codenames.is_code_for_name(node->code(), codename)) {
+                    result.emplace_back(node->code(), node->data().rate);
+                    summary.add(node->data().rate);
+                }
+            }
+        }
+    } else if (state.tree) {
+        const auto &v_tree = state.tree;
+        node_set roots(scratch);
+
+        // 1. for every code of China Proper, search for maximum prefix rate in vendorA
+        for (const auto &code: codes) {
+            auto node = v_tree->max_matching_node(code);
+            if (node != nullptr) {
+                roots.insert(node);
+            }
+        }
+
+        // 2. for every code in roots, find every rate starting with that code
+        node_set all_rates(scratch);
+
+        class RatesSearch {
+        public:
+            RatesSearch(node_set &_nodes) :
+                nodes(_nodes)
+            {
+
+            }
+            bool visit(const node_t &node) {
+                if (!is_empty(node.data())) {
+                    // Insert node in set if it has data
+                    auto inserted = nodes.insert(&node);
+                    // Stop traversing children nodes if node was already in a tree
+                    return inserted.second;
+                }
+                return true;
+            }
+            node_set &nodes;
+        } rates_search { all_rates };
+
+        for (auto &node: roots) {
+            if (all_rates.count(node) == 0) {
+                // add all non-empty children of node to the all_rates
+                node->accept(rates_search);
+            }
+        }
+
+        if (threads > 1 && all_rates.size() >= threshold) {
+            filter_parallel(node_vector(all_rates.begin(), all_rates.end(), scratch));
+        } else {
+            for (auto &node: all_rates) {
+                if (codenames.is_code_for_name(node->code(), codename)) {
+                    auto rate = node->data().rate;
+                    result.emplace_back(node->code(), rate);
+                    summary.add(rate);
+                }
+            }
+        }
+    } else {
+        // Shared nodes have no identity per code: walk every codename code
+        // that is not under another one, and classify rates on the way down
+        std::pmr::vector<const code_string *> sorted(scratch);
+        sorted.reserve(codes.size());
+        for (const auto &code: codes) {
+            sorted.push_back(&code);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const code_string *left, const code_string *right) {
+            return *left < *right;
+        });
+        auto starts_with = [](const code_string &code, const code_string &prefix) {
+            if (code.length() < prefix.length()) {
+                return false;
+            }
+            for (size_t i = 0; i < prefix.length(); ++i) {
+                if (code[i] != prefix[i]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        std::pmr::vector<const code_string *> starts(scratch);
+        for (const auto *code: sorted) {
+            if (starts.empty() || !starts_with(*code, *starts.back())) {
+                starts.push_back(code);
+            }
+        }
+        auto join = [&](const code_string &start, auto &search) {
+            auto node = SharedTrieStore::exactly_matching_node(*state.shared, start);
+            if (node != nullptr) {
+                join_subtree(*node, start, codenames.exactly_matching_node(start), nullptr, search);
+            }
+        };
+
+        if (threads > 1 && starts.size() >= threshold) {
+            // Subtrees of starts don't overlap; merged in the order of starts
+            std::pmr::vector<pmr_rates_result_t> rows(threads, &shared_scratch);
+            std::pmr::vector<rate_summary_s> summaries(threads, scratch);
+            auto chunks = parallel_chunks(starts.size(), threads, [&](size_t begin, size_t end, size_t chunk) {
+                CodenameRates<pmr_rates_result_t> search(codename, rows[chunk], summaries[chunk]);
+                for (size_t i = begin; i < end; ++i) {
+                    join(*starts[i], search);
+                }
+            });
+            for (size_t chunk = 0; chunk < chunks; ++chunk) {
+                result.insert(result.end(), rows[chunk].begin(), rows[chunk].end());
+                summary.add(summaries[chunk]);
+            }
+        } else {
+            CodenameRates<Result> search(codename, result, summary);
+            for (const auto *start: starts) {
+                join(*start, search);
+            }
+        }
+    }
+
+    if (min_rate != nullptr) {
+        *min_rate = summary.min;
+    }
+    if (max_rate != nullptr) {
+        *max_rate = summary.max;
+    }
+}
 
 CodeDirectory::rates_result_t CodeDirectory::get_rates(const std::string &vendor,
                                                        const std::string &code_name,
@@ -37,6 +732,31 @@ CodeDirectory::rates_result_t CodeDirectory::get_rates(const std::string &vendor
     return get_rates(vId, code_name, min_rate, max_rate);
 }
 
+CodeDirectory::classification_s CodeDirectory::classify(const code_string &number) const {
+    auto codenames = boost::atomic_load(&_codenames);
+    if (!codenames) {
+        return {};
+    }
+    auto found = codenames->classify(number);
+    if (found.codename == nullptr) {
+        return { {}, found.code };
+    }
+    return { *found.codename, found.code };
+}
+
+std::vector<CodeDirectory::classification_s> CodeDirectory::classify(const std::vector<code_string> &numbers) const {
+    auto codenames = boost::atomic_load(&_codenames);
+    if (!codenames) {
+        return std::vector<classification_s>(numbers.size());
+    }
+    std::vector<classification_s> ret;
+    ret.reserve(numbers.size());
+    for (const auto &found: codenames->classify(numbers)) {
+        ret.push_back({ found.codename != nullptr ? *found.codename : codename_t{}, found.code });
+    }
+    return ret;
+}
+
 std::vector<VendorId> CodeDirectory::list_vendors() const {
     std::vector<VendorId> ret;
     ret.reserve(_vendors.size());
@@ -46,102 +766,538 @@ std::vector<VendorId> CodeDirectory::list_vendors() const {
     return ret;
 }
 std::vector<std::string> CodeDirectory::list_codenames() const {
-    return _codenames->list_codenames();
+    auto codenames = boost::atomic_load(&_codenames);
+    return codenames ? codenames->list_codenames() : std::vector<std::string>();
+}
+
+CodeDirectory::codename_pointer_t CodeDirectory::published_codenames() const {
+    auto codenames = boost::atomic_load(&_codenames);
+    if (!codenames) {
+        throw std::out_of_range("Codename tree is not published");
+    }
+    return codenames;
+}
+
+bool CodeDirectory::may_have_rates(const vendor_state_s &state,
+                                   const codename_pointer_t &codenames,
+                                   size_t codename_id) {
+    return !state.summary->built_for(codenames) || state.summary->covers(codename_id);
+}
+
+template<class Result>
+void CodeDirectory::query_rates(VendorId vendor,
+                                const codename_t &codename,
+                                Result &result,
+                                rate_string *min_rate,
+                                rate_string *max_rate,
+                                std::pmr::memory_resource *scratch) const {
+    auto v_row = _vendors.find(vendor);
+    if (v_row == _vendors.end()) {
+        throw std::out_of_range("Vendor not found");
+    }
+    rate_string min, max;
+    auto state = boost::atomic_load(&(v_row->second));
+    // Generation before tree, see rates_key_s
+    const std::uint64_t codename_generation = _codename_generation;
+    // A removed vendor has no rates whatever the codename tree is
+    auto codenames = state ? published_codenames() : codename_pointer_t();
+    if (state && may_have_rates(*state, codenames, codenames->codename_id(codename))) {
+        const rates_key_s key { vendor, codename, state->generation, codename_generation };
+
+        auto cached = _rates_cache.find(key);
+        if (cached) {
+            result.assign(cached->rates.begin(), cached->rates.end());
+            min = cached->min;
+            max = cached->max;
+        } else {
+            collect_rates(*state, *codenames, codename, result, &min, &max, scratch);
+            if (_rates_cache.enabled()) {
+                auto computed = boost::make_shared<rates_value_s>();
+                computed->rates.assign(result.begin(), result.end());
+                computed->min = min;
+                computed->max = max;
+                _rates_cache.insert(key, computed);
+            }
+        }
+    }
+    if (min_rate != nullptr) {
+        *min_rate = min;
+    }
+    if (max_rate != nullptr) {
+        *max_rate = max;
+    }
 }
 
 CodeDirectory::rates_result_t CodeDirectory::get_rates(VendorId vendor,
                                                        const codename_t &codename,
                                                        rate_string *min_rate,
                                                        rate_string *max_rate) const {
-    typedef std::set<const VendorTree::node_t*> node_set;
+    rates_result_t result;
+    query_rates(vendor, codename, result, min_rate, max_rate, std::pmr::new_delete_resource());
+    return result;
+}
 
-    node_set roots;
+CodeDirectory::pmr_rates_result_t CodeDirectory::get_rates(VendorId vendor,
+                                                           const codename_t &codename,
+                                                           rate_string *min_rate,
+                                                           rate_string *max_rate,
+                                                           std::pmr::memory_resource *resource) const {
+    pmr_rates_result_t result(resource);
+    query_rates(vendor, codename, result, min_rate, max_rate, resource);
+    return result;
+}
+
+CodeDirectory::scan_page_s CodeDirectory::scan_rates(VendorId vendor,
+                                                     const code_string &prefix,
+                                                     size_t page_size,
+                                                     const std::string &continuation) const {
+    if (page_size == 0) {
+        throw std::invalid_argument("Page size is 0");
+    }
     auto v_row = _vendors.find(vendor);
     if (v_row == _vendors.end()) {
         throw std::out_of_range("Vendor not found");
     }
-    auto v_tree = boost::atomic_load(&(v_row->second));
-    if (!v_tree) {
-        min_rate->set_empty();
-        max_rate->set_empty();
-        return {};
+    auto state = boost::atomic_load(&(v_row->second));
+
+    // Token is "<generation>:<last code>"
+    code_string after;
+    if (!continuation.empty()) {
+        auto colon = continuation.find(':');
+        // 19 digits always fit std::stoull, so no out_of_range reads as not_found
+        if (colon == std::string::npos || colon == 0 || colon > 19 ||
+            continuation.find_first_not_of("0123456789") != colon) {
+            throw std::invalid_argument("Malformed continuation");
+        }
+        if (!state || std::stoull(continuation.substr(0, colon)) != state->generation) {
+            throw std::invalid_argument("Continuation is for another generation of the vendor tree");
+        }
+        after.set(continuation.substr(colon + 1));
     }
 
-    // 1. for every code of China Proper, search for maximum prefix rate in vendorA
-    auto codes = _codenames->codes_for_name(codename);
-    for (const auto &code: codes) {
-        auto node = v_tree->max_matching_node(code);
+    scan_page_s page;
+    if (!state) {
+        return page;
+    }
+    page.rates.reserve(page_size);
+    auto collect = [&page](const code_string &code, const Rate &rate) {
+        page.rates.emplace_back(code, rate.rate);
+    };
+    const code_string *start = continuation.empty() ? nullptr : &after;
+    bool more = state->tree ? state->tree->scan_prefix(prefix, start, page_size, collect)
+                            : scan_prefix(*state->shared, prefix, start, page_size, collect);
+    if (more) {
+        page.continuation = std::to_string(state->generation) + ":" + std::string(page.rates.back().code);
+    }
+    return page;
+}
+
+std::vector<CodeDirectory::rate_at_s> CodeDirectory::get_rates_at(VendorId vendor,
+                                                                  const std::vector<code_string> &numbers,
+                                                                  const std::vector<time_t> &times) const {
+    if (numbers.size() != times.size()) {
+        throw std::invalid_argument("Count of numbers and times differ");
+    }
+    auto v_row = _vendors.find(vendor);
+    if (v_row == _vendors.end()) {
+        throw std::out_of_range("Vendor not found");
+    }
+    auto state = boost::atomic_load(&(v_row->second));
+
+    std::vector<rate_at_s> result(numbers.size());
+    if (!state) {
+        return result;
+    }
+    if (state->tree) {
+        auto nodes = state->tree->max_matching_nodes(numbers);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            auto node = nodes[i];
+            while (node != nullptr && !node->data().is_in_effect(times[i])) {
+                node = node->parent();
+            }
+            if (node != nullptr) {
+                result[i].code = node->code();
+                result[i].rate = node->data().rate;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            result[i] = rate_at(*state, numbers[i], times[i]);
+        }
+    }
+    return result;
+}
+
+CodeDirectory::rate_at_s CodeDirectory::rate_at(const vendor_state_s &state,
+                                                const code_string &number,
+                                                time_t time) {
+    rate_at_s result;
+    if (state.tree) {
+        auto node = state.tree->max_matching_node(number);
+        while (node != nullptr && !node->data().is_in_effect(time)) {
+            node = node->parent();
+        }
         if (node != nullptr) {
-            roots.insert(node);
+            result.code = node->code();
+            result.rate = node->data().rate;
+        }
+        return result;
+    }
+    // Shared nodes have no parents: remember the last rate on the way down
+    const SharedTrieStore::node_t *node = state.shared.get();
+    size_t depth = 0, found = 0;
+    const Rate *rate = nullptr;
+    while (node != nullptr) {
+        if (node->data().is_in_effect(time)) {
+            rate = &node->data();
+            found = depth;
+        }
+        if (depth == number.length()) {
+            break;
+        }
+        node = node->get_child(number[depth++]);
+    }
+    if (rate != nullptr) {
+        result.code = number.substr(0, found);
+        result.rate = rate->rate;
+    }
+    return result;
+}
+
+CodeDirectory::routes_t CodeDirectory::get_routes(const code_string &number, time_t time, size_t count) const {
+    routes_t routes;
+    for (const auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        if (!state) {
+            continue;
+        }
+        auto found = rate_at(*state, number, time);
+        if (!found.rate.is_empty()) {
+            routes.push_back(route_s{ vendor.first, found.code, found.rate });
         }
     }
+    auto less = [](const route_s &left, const route_s &right) {
+        return std::make_pair(left.rate, left.vendor) < std::make_pair(right.rate, right.vendor);
+    };
+    if (routes.size() > count) {
+        std::partial_sort(routes.begin(), routes.begin() + count, routes.end(), less);
+        routes.resize(count);
+    } else {
+        std::sort(routes.begin(), routes.end(), less);
+    }
+    return routes;
+}
+
+template<class Result>
+void CodeDirectory::query_vendors(const codename_t &code_name,
+                                  Result &result,
+                                  std::pmr::memory_resource *scratch) const
+{
+    const vendors_key_s key { code_name, _vendors_generation, _codename_generation };
+    auto codenames = published_codenames();
+
+    auto cached = _vendors_cache.find(key);
+    if (cached) {
+        result.assign(cached->begin(), cached->end());
+        return;
+    }
+    compute_vendors(code_name, codenames, result, scratch);
+    if (_vendors_cache.enabled()) {
+        _vendors_cache.insert(key, boost::make_shared<vendors_result_t>(result.begin(), result.end()));
+    }
+}
+
+CodeDirectory::vendors_result_t CodeDirectory::get_vendors(const codename_t &code_name) const
+{
+    vendors_result_t result;
+    query_vendors(code_name, result, std::pmr::new_delete_resource());
+    return result;
+}
+
+CodeDirectory::pmr_vendors_result_t CodeDirectory::get_vendors(const codename_t &code_name,
+                                                               std::pmr::memory_resource *resource) const
+{
+    pmr_vendors_result_t result(resource);
+    query_vendors(code_name, result, resource);
+    return result;
+}
 
-    // 2. for every code in roots, find every rate starting with that code
-    node_set all_rates;
+std::vector<CodeDirectory::vendors_result_t>
+CodeDirectory::get_vendors_batch(const std::vector<codename_t> &code_names) const
+{
+    // Generations before trees, see rates_key_s
+    const std::uint64_t vendors_generation = _vendors_generation;
+    const std::uint64_t codename_generation = _codename_generation;
+    auto codenames = published_codenames();
 
-    class RatesSearch {
-    public:
-        RatesSearch(node_set &_nodes) :
-            nodes(_nodes)
-        {
+    std::vector<size_t> ids;
+    ids.reserve(code_names.size());
+    for (const auto &code_name: code_names) {
+        // Throws for unknown codename, same as get_vendors
+        ids.push_back(codenames->codename_id(code_name));
+    }
 
+    std::vector<vendors_result_t> results(code_names.size());
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < code_names.size(); ++i) {
+        auto cached = _vendors_cache.find({ code_names[i], vendors_generation, codename_generation });
+        if (cached) {
+            results[i].assign(cached->begin(), cached->end());
+        } else {
+            missing.push_back(i);
         }
-        bool visit(const VendorTree::node_t &node) {
-            if (!is_empty(node.data())) {
-                // Insert node in set if it has data
-                auto inserted = nodes.insert(&node);
-                // Stop traversing children nodes if node was already in a tree
-                return inserted.second;
+    }
+    if (missing.empty()) {
+        return results;
+    }
+
+    // Same vendor order as get_vendors
+    std::vector<std::pair<VendorId, state_pointer_t>> states;
+    states.reserve(_vendors.size());
+    for (const auto &vendor: _vendors) {
+        states.emplace_back(vendor.first, boost::atomic_load(&vendor.second));
+    }
+
+    // Rows of each chunk of vendors, merged in chunk order
+    const size_t threads = states.size() * missing.size() >= _parallel_threshold ? size_t(_parallel_threads) : 1;
+    std::vector<std::vector<vendors_result_t>> rows(threads, std::vector<vendors_result_t>(missing.size()));
+    auto chunks = parallel_chunks(states.size(), threads, [&](size_t begin, size_t end, size_t chunk) {
+        for (size_t v = begin; v < end; ++v) {
+            const auto &state = states[v].second;
+            if (!state) {
+                continue;
+            }
+            const VendorSummary *summary = state->summary.get();
+            std::unique_ptr<VendorSummary> fresh;
+            // Summary may lag behind a codename tree being published right now
+            if (!summary->built_for(codenames)) {
+                if (state->tree) {
+                    fresh.reset(new VendorSummary(state->tree->root(), codenames));
+                } else {
+                    fresh.reset(new VendorSummary(*state->shared, codenames));
+                }
+                summary = fresh.get();
+            }
+            for (size_t k = 0; k < missing.size(); ++k) {
+                if (!summary->covers(ids[missing[k]])) {
+                    continue;
+                }
+                auto found = summary->for_codename(code_names[missing[k]]);
+                if (found != nullptr) {
+                    rows[chunk][k].emplace_back(states[v].first, found->min, found->max);
+                }
             }
-            return true;
         }
-        node_set &nodes;
-    } rates_search { all_rates };
+    });
 
-    for (auto &node: roots) {
-        if (all_rates.count(node) == 0) {
-            // add all non-empty children of node to the all_rates
-            node->accept(rates_search);
+    for (size_t k = 0; k < missing.size(); ++k) {
+        auto &result = results[missing[k]];
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            result.insert(result.end(), rows[chunk][k].begin(), rows[chunk][k].end());
+        }
+        if (_vendors_cache.enabled()) {
+            _vendors_cache.insert({ code_names[missing[k]], vendors_generation, codename_generation },
+                                  boost::make_shared<vendors_result_t>(result));
         }
     }
-
-    // 3. For every code in all_rates, search for codename with maximum
-    //    prefix and take only those belonging to China Proper
-   rates_result_t result;
-   rate_string min;
-   rate_string max;
-   for (auto &node: all_rates) {
-       if (_codenames->is_code_for_name(node->code(), codename)) {
-           auto rate = node->data().rate;
-           result.emplace_back(node->code(), rate);
-           if (min.is_empty() || rate < min) {
-               min = rate;
-           }
-           if (max.is_empty() || max < rate) {
-               max = rate;
-           }
-       }
-   }
-   if (min_rate != nullptr) {
-       *min_rate = min;
-   }
-   if (max_rate != nullptr) {
-       *max_rate = max;
-   }
-   return result;
+    return results;
 }
 
-CodeDirectory::vendors_result_t CodeDirectory::get_vendors(const codename_t &code_name) const
+template<class Result>
+void CodeDirectory::compute_vendors(const codename_t &code_name,
+                                    const codename_pointer_t &codenames,
+                                    Result &result,
+                                    std::pmr::memory_resource *scratch) const
 {
-    CodeDirectory::vendors_result_t result;
+    // Throws for unknown codename, same as get_rates
+    const auto codename_id = codenames->codename_id(code_name);
+
+    pmr_rates_result_t rates(scratch);
     for (const auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        if (!state || !may_have_rates(*state, codenames, codename_id)) {
+            continue;
+        }
+        // Summary may lag behind a codename tree being published right now
+        if (state->summary->built_for(codenames)) {
+            auto summary = state->summary->for_codename(code_name);
+            if (summary != nullptr) {
+                result.emplace_back(vendor.first, summary->min, summary->max);
+            }
+            continue;
+        }
+
         rate_string min, max;
-        get_rates(vendor.first, code_name, &min, &max);
+        rates.clear();
+        collect_rates(*state, *codenames, code_name, rates, &min, &max, scratch);
         if (!min.is_empty() && !max.is_empty()) {
             result.emplace_back(vendor.first, min, max);
         }
     }
-    return result;
+}
+
+CodeDirectory::vendors_result_t CodeDirectory::get_cheapest_vendors(const codename_t &code_name,
+                                                                    size_t count,
+                                                                    aggregate_t order) const
+{
+    auto codenames = published_codenames();
+    const auto codename_id = codenames->codename_id(code_name);
+
+    auto key = [order](const vendors_result_s &vendor) {
+        return std::make_pair(order == aggregate_t::min ? vendor.min : vendor.max, vendor.vendor);
+    };
+    auto less = [&key](const vendors_result_s &left, const vendors_result_s &right) {
+        return key(left) < key(right);
+    };
+
+    // Max-heap of the best vendors found so far; its top is the worst of them
+    vendors_result_t best;
+    best.reserve(count + 1);
+    auto offer = [&](vendors_result_s &&vendor) {
+        if (best.size() == count && !less(vendor, best.front())) {
+            return;
+        }
+        best.push_back(std::move(vendor));
+        std::push_heap(best.begin(), best.end(), less);
+        if (best.size() > count) {
+            std::pop_heap(best.begin(), best.end(), less);
+            best.pop_back();
+        }
+    };
+    if (count == 0) {
+        return best;
+    }
+
+    // Vendors whose summary is stale for the codename tree
+    struct unsummarized_s {
+        rate_string lowest;
+        VendorId vendor;
+        state_pointer_t state;
+    };
+    std::vector<unsummarized_s> unsummarized;
+    for (const auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        if (!state || !may_have_rates(*state, codenames, codename_id)) {
+            continue;
+        }
+        if (state->summary->built_for(codenames)) {
+            auto rates = state->summary->for_codename(code_name);
+            if (rates != nullptr) {
+                offer(vendors_result_s(vendor.first, rates->min, rates->max));
+            }
+        } else if (!state->summary->overall().min.is_empty()) {
+            unsummarized.push_back({ state->summary->overall().min, vendor.first, state });
+        }
+    }
+
+    // Both min and max of a codename are at least the lowest rate of the tree
+    std::sort(unsummarized.begin(), unsummarized.end(),
+              [](const unsummarized_s &left, const unsummarized_s &right) {
+        return std::make_pair(left.lowest, left.vendor) < std::make_pair(right.lowest, right.vendor);
+    });
+    for (const auto &vendor: unsummarized) {
+        if (best.size() == count &&
+            !(std::make_pair(vendor.lowest, vendor.vendor) < key(best.front()))) {
+            break;
+        }
+        rate_string min, max;
+        pmr_rates_result_t rates(std::pmr::new_delete_resource());
+        collect_rates(*vendor.state, *codenames, code_name, rates, &min, &max, std::pmr::new_delete_resource());
+        if (!min.is_empty() && !max.is_empty()) {
+            offer(vendors_result_s(vendor.vendor, min, max));
+        }
+    }
+
+    std::sort_heap(best.begin(), best.end(), less);
+    return best;
+}
+
+namespace {
+
+/// Rates of one vendor split by codename, for export_rate_matrix
+class MatrixRows {
+public:
+    struct row_s {
+        CodeDirectory::rates_result_t rates;
+        rate_summary_s summary;
+    };
+
+    template<class Node>
+    void visit(const Node &node, const codename_t *codename, const code_path_s &path) {
+        if (codename == nullptr) {
+            return;
+        }
+        // Codes of one codename hold separate copies of its name
+        auto found = by_node.find(codename);
+        if (found == by_node.end()) {
+            found = by_node.emplace(codename, &rows[*codename]).first;
+        }
+        found->second->rates.emplace_back(path.code(), node.data().rate);
+        found->second->summary.add(node.data().rate);
+    }
+
+    std::map<codename_t, row_s> rows;
+    std::unordered_map<const codename_t *, row_s *> by_node;
+};
+
+}
+
+void CodeDirectory::export_rate_matrix(const matrix_sink_t &sink, size_t thread_count) const
+{
+    auto codenames = boost::atomic_load(&_codenames);
+    std::vector<std::pair<VendorId, state_pointer_t>> vendors;
+    for (const auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        // Vendors without rates of any codename have no rows
+        if (state && !(state->summary->built_for(codenames) && state->summary->coverage().none())) {
+            vendors.emplace_back(vendor.first, state);
+        }
+    }
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    thread_count = std::max<size_t>(1, std::min(thread_count, vendors.size()));
+
+    std::atomic<size_t> next_vendor(0);
+    std::mutex sink_lock;
+    std::exception_ptr error;
+    auto work = [&]() {
+        try {
+            for (size_t index = next_vendor++; index < vendors.size(); index = next_vendor++) {
+                const auto &state = *vendors[index].second;
+                MatrixRows rows;
+                if (state.tree) {
+                    join_trees(state.tree->root(), codenames.get(), rows);
+                } else {
+                    join_trees(*state.shared, codenames.get(), rows);
+                }
+
+                std::lock_guard<std::mutex> lock(sink_lock);
+                for (const auto &row: rows.rows) {
+                    sink(vendors[index].first, row.first, row.second.rates,
+                         row.second.summary.min, row.second.summary.max);
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(sink_lock);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next_vendor = vendors.size();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 void CodeDirectory::print_stats(bool print_all) const
@@ -150,18 +1306,63 @@ void CodeDirectory::print_stats(bool print_all) const
     StatsRates global;
 
     for (auto &vendor: _vendors) {
+        auto state = boost::atomic_load(&vendor.second);
+        if (!state || !state->tree) {
+            continue;
+        }
         if (print_all) {
             StatsRates local;
             VisitAggregator<VendorTree::tree_t::node_t, StatsRates, StatsRates> visitor{global, local};
-            vendor.second->accept(visitor);
+            state->tree->accept(visitor);
             cout << "\n\nStats for " << vendor.first << endl;
             cout << local.to_string();
         } else {
-            vendor.second->accept(global);
+            state->tree->accept(global);
         }
     }
     cout << "\n\nGlobal stats: " << endl;
     cout << global.to_string();
+
+    if (_store) {
+        auto shared = _store->stats();
+        cout << "\n\nShared subtrees: " << endl <<
+                "Logical nodes: " << shared.logical_nodes << endl <<
+                "Unique nodes: " << shared.unique_nodes << endl <<
+                "Bytes used: " << shared.bytes_used << endl <<
+                "Bytes saved: " << shared.bytes_saved << endl;
+    }
+}
+
+void CodeDirectory::set_cache_capacity(size_t entries)
+{
+    _rates_cache.set_capacity(entries);
+    _vendors_cache.set_capacity(entries);
+}
+
+void CodeDirectory::set_parallelism(size_t threads, size_t threshold) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    _parallel_threads = threads;
+    _parallel_threshold = std::max<size_t>(1, threshold);
+}
+
+cache_stats_s CodeDirectory::rates_cache_stats() const
+{
+    return _rates_cache.stats();
+}
+
+cache_stats_s CodeDirectory::vendors_cache_stats() const
+{
+    return _vendors_cache.stats();
+}
+
+SharedTrieStore::stats_s CodeDirectory::shared_store_stats() const
+{
+    if (_store) {
+        return _store->stats();
+    }
+    return SharedTrieStore::stats_s{ 0, 0, 0, 0 };
 }
 
 }
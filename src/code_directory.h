@@ -1,16 +1,38 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <mutex>
 #include <unordered_map>
 #include <set>
+#include <thread>
+#include <boost/optional.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
 
 #include "types.h"
 #include "vendor_tree.h"
 #include "codename_tree.h"
+#include "query_cache.h"
+#include "shared_trie_store.h"
+#include "vendor_summary.h"
 
 namespace code_directory {
 
+/// Default count of cached results of each query type
+constexpr size_t DEFAULT_CACHE_CAPACITY = 4096;
+
+/// Items in a stage of get_rates worth splitting between threads
+constexpr size_t DEFAULT_PARALLEL_THRESHOLD = 2048;
+
+/// How often the scheduler thread checks the clock close to an activation
+constexpr std::chrono::milliseconds SCHEDULER_TICK{10};
+
 class CodeDirectory {
 public:
     struct rates_result_s {
@@ -22,6 +44,7 @@ public:
         rate_string rate;
     };
     typedef std::vector<rates_result_s> rates_result_t;
+    typedef std::pmr::vector<rates_result_s> pmr_rates_result_t;
 
     struct vendors_result_s {
         vendors_result_s(VendorId _vendor,
@@ -36,18 +59,183 @@ public:
         rate_string max;
     };
     typedef std::vector<vendors_result_s> vendors_result_t;
+    typedef std::pmr::vector<vendors_result_s> pmr_vendors_result_t;
+
+    /// Rate of the longest prefix in effect at some time, see get_rates_at
+    struct rate_at_s {
+        /// Matched code; empty if no rate is in effect
+        code_string code;
+        rate_string rate;
+    };
+
+    /// Vendor that can terminate a number, see get_routes
+    struct route_s {
+        VendorId vendor;
+        code_string code;
+        rate_string rate;
+    };
+    typedef std::vector<route_s> routes_t;
+
+    /// One page of a prefix scan, see scan_rates
+    struct scan_page_s {
+        /// Codes with rates in code order
+        rates_result_t rates;
+        /// Token to get the next page with; empty if the scan is done
+        std::string continuation;
+    };
+
+    /// Codename a number belongs to, see classify
+    struct classification_s {
+        /// Empty if no codename matches
+        codename_t codename;
+        code_string code;
+    };
+
+    /// Aggregate of vendor rates to order vendors by
+    enum class aggregate_t {
+        min,
+        max
+    };
+
+    /// Change of rates of one vendor for one codename, see subscribe
+    struct codename_delta_s {
+        codename_t codename;
+        VendorId vendor;
+        /// Rates before and after the change; count is 0 if there were none
+        rate_summary_s before;
+        rate_summary_s after;
+    };
+    typedef std::vector<codename_delta_s> deltas_t;
+    typedef std::function<void(const deltas_t &deltas)> change_callback_t;
 
     // boost::shared_ptr provides atomic access to the data
     typedef boost::shared_ptr<const VendorTree> tree_pointer_t;
     typedef boost::shared_ptr<const CodenameTree> codename_pointer_t;
+    typedef boost::shared_ptr<const VendorSummary> summary_pointer_t;
+
+    /**
+     * \param share_subtrees Keep published vendor trees in a SharedTrieStore
+     *        instead of as separate trees. Identical subtrees of all vendors
+     *        are then stored once; query results are the same.
+     */
+    explicit CodeDirectory(bool share_subtrees = false);
+    ~CodeDirectory();
 
-    CodeDirectory();
+    /// True if constructed with share_subtrees
+    bool shares_subtrees() const {
+        return bool(_store);
+    }
 
+    /*
+     * Publishing methods are serialized between threads, so scheduled trees
+     * may be activated by the scheduler thread while others publish.
+     */
     void set_vendor_tree(VendorId vendor, tree_pointer_t tree);
     void set_codename_tree(codename_pointer_t tree);
 
     void remove_vendor(VendorId vendor);
 
+    /// Hash of the input a tree was loaded from, see reload_vendor_tree
+    typedef std::uint64_t fingerprint_t;
+    typedef std::function<tree_pointer_t()> tree_loader_t;
+    typedef std::function<codename_pointer_t()> codename_loader_t;
+
+    /// 64-bit FNV-1a of \p size bytes at \p data
+    static fingerprint_t fingerprint(const char *data, size_t size);
+    static fingerprint_t fingerprint(const std::string &input) {
+        return fingerprint(input.data(), input.size());
+    }
+
+    /**
+     * \brief Publishes the tree returned by \p load, unless the tree of
+     * \p vendor was reloaded from input with the same \p fingerprint.
+     *
+     * The fingerprint is of the raw input (a rate deck file, say), so an
+     * unchanged input costs one hash and neither parsing nor publishing:
+     * caches and generations stay as they are and subscribers get nothing.
+     * \p load is called without the publishing lock held. Publishing in any
+     * other way, including scheduled activation and remove_vendor, forgets
+     * the fingerprint of the vendor. A directory behind a DirectoryJournal
+     * is reloaded through the journal, which logs what is loaded.
+     *
+     * \return false if the load was skipped
+     */
+    bool reload_vendor_tree(VendorId vendor, fingerprint_t fingerprint, const tree_loader_t &load);
+    /// Same for the codename tree; set_codename_tree forgets the fingerprint
+    bool reload_codename_tree(fingerprint_t fingerprint, const codename_loader_t &load);
+
+    /// Fingerprint of the last reload of the vendor tree; empty if unknown
+    boost::optional<fingerprint_t> vendor_fingerprint(VendorId vendor) const;
+    boost::optional<fingerprint_t> codename_fingerprint() const;
+
+    /// What the reloads between begin_reload and end_reload did
+    struct reload_report_s {
+        /// Vendors whose trees were loaded and published
+        std::vector<VendorId> changed;
+        /// Vendors whose loads were skipped
+        std::vector<VendorId> unchanged;
+        /// Published vendors not reloaded at all, such as ones whose input is gone
+        std::vector<VendorId> missing;
+        bool codenames_changed = false;
+    };
+
+    /// Starts a reload cycle, dropping the report of an unfinished one
+    void begin_reload();
+    /**
+     * Ends the reload cycle; vendors in the report are sorted.
+     * Throws std::logic_error if no cycle was begun.
+     */
+    reload_report_s end_reload();
+
+    /// Current time in units of Rate::effective_date
+    typedef std::function<time_t()> clock_function_t;
+
+    /**
+     * \brief Publishes \p tree for \p vendor as set_vendor_tree does, once
+     * the clock reaches \p activation.
+     *
+     * Everything derived from the tree is computed now, so activation only
+     * swaps a pointer. If the codename tree changes before activation, the
+     * codename summary is recomputed by set_codename_tree. A null tree
+     * publishes no rates for the vendor. Trees due at the same time are
+     * activated in the order they were scheduled.
+     *
+     * Only vendors published already can be scheduled; throws
+     * std::out_of_range for others.
+     *
+     * \return Id for cancel_scheduled
+     */
+    size_t schedule_vendor_tree(VendorId vendor, tree_pointer_t tree, time_t activation);
+    /// False if the tree was activated or canceled already
+    bool cancel_scheduled(size_t id);
+    /// Time of the first scheduled tree; empty if nothing is scheduled
+    time_t next_activation() const;
+
+    /// Activates all trees due by the clock now; returns their count
+    size_t run_due();
+
+    /**
+     * Count of activated trees whose codename summary was recomputed at
+     * activation: only trees taken for activation while a codename tree
+     * was being published.
+     */
+    size_t activation_rebuilds() const {
+        return _activation_rebuilds;
+    }
+
+    /// Replaces the clock, which by default is seconds since the epoch
+    void set_clock(clock_function_t clock);
+
+    /**
+     * \brief Starts a thread calling run_due when trees are due.
+     *
+     * The thread expects the clock to count seconds: it sleeps until the
+     * second before the next activation and then checks the clock every
+     * SCHEDULER_TICK.
+     */
+    void start_scheduler();
+    void stop_scheduler();
+
     rates_result_t get_rates(VendorId vendor,
                              const codename_t &code_name,
                              rate_string *min_rate,
@@ -57,16 +245,331 @@ public:
                              rate_string *min_rate,
                              rate_string *max_rate) const;
 
+    /**
+     * \brief get_rates with the result and all temporaries of the query
+     * allocated from \p resource.
+     *
+     * With an arena such as QueryArena a request takes no memory from the
+     * global heap, except for results that go to the query cache.
+     */
+    pmr_rates_result_t get_rates(VendorId vendor,
+                                 const codename_t &code_name,
+                                 rate_string *min_rate,
+                                 rate_string *max_rate,
+                                 std::pmr::memory_resource *resource) const;
+
+    /**
+     * \brief Batch LPM of \p numbers in the tree of \p vendor as of \p times.
+     *
+     * For each number finds the longest prefix with a rate in effect at the
+     * time. If the rate of the longest prefix is not in effect yet or anymore,
+     * shorter prefixes are tried. Throws std::out_of_range for unknown vendor.
+     */
+    std::vector<rate_at_s> get_rates_at(VendorId vendor,
+                                        const std::vector<code_string> &numbers,
+                                        const std::vector<time_t> &times) const;
+
+    /**
+     * \brief Least cost routing of one number: \p count vendors with the
+     * lowest rate for \p number in effect at \p time.
+     *
+     * Rates are found as by get_rates_at. Result is ordered by rate, then by
+     * vendor; vendors without a rate for the number are skipped.
+     */
+    routes_t get_routes(const code_string &number, time_t time, size_t count) const;
+
+    /**
+     * \brief Rates of \p vendor for codes starting with \p prefix, in code
+     * order, at most \p page_size at a time.
+     *
+     * Pass continuation of a page to get the next one. The token holds the
+     * generation of the vendor tree and the last code returned, so a scan
+     * only reads the tree as it pages and never collects the whole subtree.
+     * Once a new tree is published for the vendor, tokens of the old one are
+     * rejected with std::invalid_argument and the scan has to start over, so
+     * a completed scan always comes from one tree.
+     * Throws std::out_of_range for unknown vendor.
+     */
+    scan_page_s scan_rates(VendorId vendor,
+                           const code_string &prefix,
+                           size_t page_size,
+                           const std::string &continuation = std::string()) const;
+
+    /**
+     * Codename of \p number and its code that matched, in one lookup.
+     * Nothing matches if no codename tree is published.
+     */
+    classification_s classify(const code_string &number) const;
+    /// Batch version of classify
+    std::vector<classification_s> classify(const std::vector<code_string> &numbers) const;
+
     std::vector<VendorId> list_vendors() const;
     std::vector<std::string> list_codenames() const;
 
     vendors_result_t get_vendors(const codename_t &code_name) const;
+    /// get_vendors with memory of the query from \p resource, see get_rates
+    pmr_vendors_result_t get_vendors(const codename_t &code_name, std::pmr::memory_resource *resource) const;
+
+    /**
+     * \brief get_vendors of every codename in \p code_names, in the same order.
+     *
+     * Each vendor state is loaded once for the whole batch, and all vendors
+     * are split between threads as by set_parallelism. If the summary of a
+     * vendor lags behind the codename tree, one walk over the vendor tree
+     * together with the codename tree hands every rate to its codename, for
+     * all codenames of the batch at once.
+     * Throws std::out_of_range for unknown codename.
+     */
+    std::vector<vendors_result_t> get_vendors_batch(const std::vector<codename_t> &code_names) const;
+
+    /**
+     * \brief Returns \p count cheapest vendors for codename.
+     *
+     * Result is ordered by \p order aggregate ascending, then by vendor.
+     * Vendors whose lowest rate overall can't beat the current top are skipped
+     * without computing their rates for the codename.
+     */
+    vendors_result_t get_cheapest_vendors(const codename_t &code_name,
+                                          size_t count,
+                                          aggregate_t order = aggregate_t::min) const;
+
+    /**
+     * \brief Calls \p callback after every publish that changes min or max
+     * rate of some vendor for some codename.
+     *
+     * Deltas are ordered by codename, then vendor. The callback is called in
+     * the publishing thread, after the new tree is visible to queries.
+     * Affected codenames are found by diffing old and new trees, skipping
+     * subtrees that are the same node in both: with shared subtrees the work
+     * is proportional to the change.
+     *
+     * \return Id for unsubscribe
+     */
+    size_t subscribe(change_callback_t callback);
+    void unsubscribe(size_t subscription);
+
+    /// Receives rates of one vendor for one codename, see export_rate_matrix
+    typedef std::function<void(VendorId vendor,
+                               const codename_t &codename,
+                               const rates_result_t &rates,
+                               const rate_string &min_rate,
+                               const rate_string &max_rate)> matrix_sink_t;
+
+    /**
+     * \brief Streams get_rates results of every vendor for every codename to \p sink.
+     *
+     * Each vendor tree is walked once together with the codename tree, so
+     * rates are classified on the way down instead of by lookups per pair.
+     * Only one vendor's rates are held per thread at a time.
+     * Vendors are split between \p thread_count threads (0 is one per core).
+     * Calls to \p sink are serialized; results of a vendor come together,
+     * ordered by codename. Pairs without rates are skipped.
+     */
+    void export_rate_matrix(const matrix_sink_t &sink, size_t thread_count = 0) const;
 
     void print_stats(bool print_all = false) const;
 
+    /// Memory use of shared vendor trees; all zeros unless subtrees are shared
+    SharedTrieStore::stats_s shared_store_stats() const;
+
+    /**
+     * \brief Sets maximum count of cached results of each query type.
+     * Cached results are dropped. 0 disables caching.
+     */
+    void set_cache_capacity(size_t entries);
+
+    cache_stats_s rates_cache_stats() const;
+
+    /**
+     * \brief Lets a get_rates call split its work between \p threads
+     * threads (0 is one per core, 1 never splits).
+     *
+     * A stage is split when it has at least \p threshold items: codename
+     * codes to look up, or rates to classify. Results are merged in the
+     * order a single thread produces them. Threads come from the shared
+     * WorkerPool, and the calling thread works along with them.
+     *
+     * By default calls never split: a server running queries on many
+     * threads gains nothing from it.
+     */
+    void set_parallelism(size_t threads, size_t threshold = DEFAULT_PARALLEL_THRESHOLD);
+    cache_stats_s vendors_cache_stats() const;
+
 private:
-    std::unordered_map<VendorId, tree_pointer_t> _vendors;
+    /**
+     * Published state of one vendor. It is immutable and replaced as a whole,
+     * so a reader always sees a tree together with its own summary.
+     */
+    struct vendor_state_s {
+        /// Vendor tree, unless it is kept in the shared store
+        tree_pointer_t tree;
+        SharedTrieStore::root_pointer_t shared;
+        /// Per-codename aggregates, computed on publish
+        summary_pointer_t summary;
+        /// Changes every time a tree is published for the vendor
+        std::uint64_t generation;
+    };
+    typedef boost::shared_ptr<const vendor_state_s> state_pointer_t;
+
+    /// State of \p tree ready to publish, kept in the shared store if subtrees are shared
+    state_pointer_t prepare_state(tree_pointer_t tree, const codename_pointer_t &codenames);
+    /// Swaps \p state in and notifies subscribers; returns the replaced state
+    state_pointer_t publish_state(VendorId vendor, const state_pointer_t &state, const codename_pointer_t &codenames);
+
+    state_pointer_t make_state(const tree_pointer_t &tree,
+                               const SharedTrieStore::root_pointer_t &shared,
+                               const codename_pointer_t &codenames,
+                               std::uint64_t generation) const;
+
+    /*
+     * Cached results are keyed by generations of the trees they were computed
+     * from. Publishing a tree changes its generation, so only the results that
+     * depend on it stop matching. Writers publish a tree before its generation
+     * and readers load a generation before its tree: at worst a result of a
+     * newer tree is stored under an older generation nobody asks for anymore.
+     */
+    struct rates_key_s {
+        bool operator==(const rates_key_s &other) const {
+            return vendor == other.vendor && codename == other.codename &&
+                   vendor_generation == other.vendor_generation &&
+                   codename_generation == other.codename_generation;
+        }
+        VendorId vendor;
+        codename_t codename;
+        std::uint64_t vendor_generation;
+        std::uint64_t codename_generation;
+    };
+    struct rates_key_hash_s {
+        size_t operator()(const rates_key_s &key) const {
+            return std::hash<codename_t>{}(key.codename) ^
+                   (std::hash<std::uint64_t>{}(key.vendor_generation) * 31) ^
+                   (std::hash<std::uint64_t>{}(key.codename_generation) * 17);
+        }
+    };
+    struct rates_value_s {
+        rates_result_t rates;
+        rate_string min;
+        rate_string max;
+    };
+    struct vendors_key_s {
+        bool operator==(const vendors_key_s &other) const {
+            return codename == other.codename &&
+                   vendors_generation == other.vendors_generation &&
+                   codename_generation == other.codename_generation;
+        }
+        codename_t codename;
+        /// get_vendors depends on every vendor
+        std::uint64_t vendors_generation;
+        std::uint64_t codename_generation;
+    };
+    struct vendors_key_hash_s {
+        size_t operator()(const vendors_key_s &key) const {
+            return std::hash<codename_t>{}(key.codename) ^
+                   (std::hash<std::uint64_t>{}(key.vendors_generation) * 31) ^
+                   (std::hash<std::uint64_t>{}(key.codename_generation) * 17);
+        }
+    };
+
+    /// Longest prefix of \p number with a rate in effect at \p time; empty if none
+    static rate_at_s rate_at(const vendor_state_s &state, const code_string &number, time_t time);
+
+    /*
+     * Queries behind get_rates and get_vendors, into a result with any
+     * allocator. Temporaries are allocated from \p scratch.
+     */
+    template<class Result>
+    void query_rates(VendorId vendor,
+                     const codename_t &codename,
+                     Result &result,
+                     rate_string *min_rate,
+                     rate_string *max_rate,
+                     std::pmr::memory_resource *scratch) const;
+    template<class Result>
+    void query_vendors(const codename_t &code_name, Result &result, std::pmr::memory_resource *scratch) const;
+
+    template<class Result>
+    void compute_vendors(const codename_t &code_name,
+                         const codename_pointer_t &codenames,
+                         Result &result,
+                         std::pmr::memory_resource *scratch) const;
+
+    /// Codes whose rates differ between vendor trees of two states
+    static std::vector<code_string> changed_codes(const vendor_state_s &before, const vendor_state_s &after);
+
+    /// Deltas of \p vendor for \p codenames between two states; either may be null
+    static void add_deltas(VendorId vendor,
+                           const vendor_state_s *before,
+                           const vendor_state_s *after,
+                           const std::set<codename_t> &codenames,
+                           deltas_t &deltas);
+    bool has_subscribers() const;
+    void notify(deltas_t &deltas) const;
+
+    /// Published codename tree; throws std::out_of_range as for an unknown codename if none
+    codename_pointer_t published_codenames() const;
+
+    /// False only if the summary of \p state shows no rates for the codename
+    static bool may_have_rates(const vendor_state_s &state,
+                               const codename_pointer_t &codenames,
+                               size_t codename_id);
+
+    /**
+     * get_rates for a loaded vendor state; temporaries are allocated from \p scratch.
+     * Stages with at least _parallel_threshold items are split between
+     * _parallel_threads threads of the shared WorkerPool; those allocate
+     * from \p scratch under a lock.
+     */
+    template<class Result>
+    void collect_rates(const vendor_state_s &state,
+                       const CodenameTree &codenames,
+                       const codename_t &codename,
+                       Result &result,
+                       rate_string *min_rate,
+                       rate_string *max_rate,
+                       std::pmr::memory_resource *scratch) const;
+
+    /// Must outlive shared roots in _vendors
+    std::unique_ptr<SharedTrieStore> _store;
+    std::unordered_map<VendorId, state_pointer_t> _vendors;
     codename_pointer_t _codenames;
+
+    /// Source of all generation numbers
+    std::atomic<std::uint64_t> _generation;
+    std::atomic<std::uint64_t> _vendors_generation;
+    std::atomic<std::uint64_t> _codename_generation;
+    mutable QueryCache<rates_key_s, rates_value_s, rates_key_hash_s> _rates_cache;
+    mutable QueryCache<vendors_key_s, vendors_result_t, vendors_key_hash_s> _vendors_cache;
+
+    std::atomic<size_t> _parallel_threads;
+    std::atomic<size_t> _parallel_threshold;
+
+    mutable std::mutex _subscribers_lock;
+    std::map<size_t, change_callback_t> _subscribers;
+    size_t _next_subscription;
+
+    mutable std::recursive_mutex _publish_lock;
+    /// Input fingerprints of published trees, see reload_vendor_tree
+    std::unordered_map<VendorId, fingerprint_t> _fingerprints;
+    boost::optional<fingerprint_t> _codename_fingerprint;
+    /// Report of the reload cycle in progress, if any
+    boost::optional<reload_report_s> _reload;
+
+    struct scheduled_s {
+        VendorId vendor;
+        state_pointer_t state;
+        /// Codename tree the state summary was built for
+        codename_pointer_t codenames;
+    };
+    /// Guards the schedule, the clock and the scheduler thread state
+    mutable std::mutex _schedule_lock;
+    std::condition_variable _schedule_changed;
+    /// Keyed by activation time, then id
+    std::map<std::pair<time_t, size_t>, scheduled_s> _scheduled;
+    size_t _next_scheduled;
+    std::atomic<size_t> _activation_rebuilds;
+    clock_function_t _clock;
+    std::thread _scheduler;
+    bool _stopping;
 };
 
 inline bool operator==(const CodeDirectory::rates_result_s &left,
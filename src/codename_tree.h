@@ -10,8 +10,17 @@ namespace code_directory {
 class CodenameTree {
 public:
     typedef PrefixTree<codename_t> tree_t;
+    typedef tree_t::node_t node_t;
     typedef std::vector<code_string> code_list_t;
 
+    /// Codename a number belongs to, see classify
+    struct classification_s {
+        /// Codename in the tree or nullptr if no codename matches
+        const codename_t *codename;
+        /// Codename code that matched; empty if none
+        code_string code;
+    };
+
     CodenameTree()
     {
 
@@ -20,6 +29,21 @@ public:
     void add_code(const code_string &code, const codename_t &codename) {
         _tree.put_data(code, codename);
         _codes_list[codename].push_back(code);
+        _ids.emplace(codename, _ids.size());
+    }
+
+    /// Dense id of codename, from 0 to codename_count() in order of adding
+    size_t codename_id(const codename_t &codename) const {
+        auto found = _ids.find(codename);
+        if (found != _ids.end()) {
+            return found->second;
+        } else {
+            throw std::out_of_range(std::string("Can't find codename ") + codename);
+        }
+    }
+
+    size_t codename_count() const {
+        return _ids.size();
     }
 
     const code_list_t &codes_for_name(const codename_t &codename) const {
@@ -36,15 +60,60 @@ public:
         if (found == _codes_list.end() || found->second.size() == 0) {
             return false;
         }
+        auto node = max_matching_node(code);
+        if (node == nullptr) {
+            return false;
+        }
+        return node->data() == codename;
+    }
+
+    /// Node of the longest codename code that is a prefix of \p code, or nullptr
+    const node_t *max_matching_node(const code_string &code) const {
         size_t match;
         auto node = _tree.maximum_matching_node(code, &match);
         while (node != nullptr && is_empty(node->data())) {
             node = node->parent();
         }
-        if (node == nullptr) {
-            return false;
+        return node;
+    }
+
+    /// Codename of \p number: the one with the longest code that is its prefix
+    classification_s classify(const code_string &number) const {
+        return classification(max_matching_node(number));
+    }
+
+    /// classify for many numbers at once, with interleaved lookups
+    std::vector<classification_s> classify(const std::vector<code_string> &numbers) const {
+        auto nodes = max_matching_nodes(numbers);
+        std::vector<classification_s> ret;
+        ret.reserve(nodes.size());
+        for (auto node: nodes) {
+            ret.push_back(classification(node));
         }
-        return node->data() == codename;
+        return ret;
+    }
+
+    /// Node of codename tree for exactly \p code or nullptr
+    const node_t *exactly_matching_node(const code_string &code) const {
+        return _tree.exactly_matching_node(code);
+    }
+
+    /**
+     * \brief Finds codename nodes for many codes at once.
+     * Lookups are interleaved, see PrefixTree::maximum_matching_nodes.
+     *
+     * \return For every code, the node of its longest matching codename code,
+     *         or nullptr if no codename matches it.
+     */
+    std::vector<const node_t *> max_matching_nodes(const std::vector<code_string> &codes) const {
+        std::vector<const node_t *> ret(codes.size());
+        _tree.data_nodes_for_max_matches(codes.data(), codes.size(), ret.data());
+        for (auto &node: ret) {
+            if (is_empty(node->data())) {
+                node = nullptr;
+            }
+        }
+        return ret;
     }
 
     template<class Visitor>
@@ -52,6 +121,10 @@ public:
         _tree.accept(visitor);
     }
 
+    const node_t &root() const {
+        return _tree.root();
+    }
+
     std::vector<std::string> list_codenames() const {
         std::vector<std::string> ret;
         ret.reserve(_codes_list.size());
@@ -63,8 +136,16 @@ public:
 
 
 private:
+    static classification_s classification(const node_t *node) {
+        if (node == nullptr) {
+            return { nullptr, get_empty<code_string>() };
+        }
+        return { &node->data(), node->code() };
+    }
+
     tree_t _tree;
     std::unordered_map<codename_t, code_list_t> _codes_list;
+    std::unordered_map<codename_t, size_t> _ids;
 };
 
 }
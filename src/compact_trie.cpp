@@ -0,0 +1,71 @@
+#include "compact_trie.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include <boost/smart_ptr/make_shared.hpp>
+
+namespace code_directory {
+
+CompactVendorTrie::CompactVendorTrie(const VendorTree &tree) {
+    auto dictionary = boost::make_shared<RateDictionary>();
+    dictionary->add(tree);
+    dictionary->freeze();
+    _dictionary = dictionary;
+    build(tree);
+}
+
+CompactVendorTrie::CompactVendorTrie(const VendorTree &tree, boost::shared_ptr<const RateDictionary> dictionary) :
+    _dictionary(std::move(dictionary))
+{
+    build(tree);
+}
+
+void CompactVendorTrie::build(const VendorTree &tree) {
+    typedef VendorTree::node_t node_t;
+    // Nodes in BFS order; position in the queue is the node ID
+    std::vector<const node_t *> queue { &tree.root() };
+    _parents.push_back(npos);
+    _digits.push_back(0);
+    for (size_t id = 0; id < queue.size(); ++id) {
+        const node_t *node = queue[id];
+        if (queue.size() >= npos) {
+            throw std::length_error("Too many nodes for CompactVendorTrie");
+        }
+        hot_node_s hot;
+        hot.first_child = node_id_t(queue.size());
+        hot.child_mask = node->child_mask();
+        // Root data is never a match, as in VendorTree
+        hot.has_data = id != 0 && !is_empty(node->data());
+        _hot.push_back(hot);
+        _rate_ids.push_back(_dictionary->id(node->data()));
+
+        child_mask_t mask = node->child_mask();
+        while (mask != 0) {
+            size_t digit = __builtin_ctz(mask);
+            mask &= child_mask_t(mask - 1);
+            queue.push_back(node->get_child(digit));
+            _parents.push_back(node_id_t(id));
+            _digits.push_back(std::uint8_t(digit));
+        }
+    }
+}
+
+code_string CompactVendorTrie::code(node_id_t id) const {
+    std::string digits;
+    for (; id != 0; id = _parents[id]) {
+        digits.push_back(char('0' + _digits[id]));
+    }
+    std::reverse(digits.begin(), digits.end());
+    return code_string{digits.c_str()};
+}
+
+size_t CompactVendorTrie::memory_usage() const {
+    return hot_memory_usage() +
+           _rate_ids.size() * sizeof(RateDictionary::rate_id_t) +
+           _parents.size() * sizeof(node_id_t) +
+           _digits.size() * sizeof(std::uint8_t);
+}
+
+}
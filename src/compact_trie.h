@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+#include "rate.h"
+#include "rate_dictionary.h"
+#include "types.h"
+#include "vendor_tree.h"
+
+namespace code_directory {
+
+/**
+ * \brief Read-only copy of a VendorTree with hot and cold node data split.
+ *
+ * A Node<Rate> keeps its child pointers next to the payload, code and parent,
+ * so every level of a descent loads bytes that only the final match needs.
+ * Here a node is an ID and its fields live in parallel arrays. The hot array
+ * holds only what a descent reads: the child bitmap, the ID of the first child
+ * and whether the node has data. Children of a node have consecutive IDs, so
+ * child \p d is first_child plus the count of occupied slots below \p d.
+ * Nodes are numbered in BFS order, which keeps the top levels that every
+ * lookup visits in a few cache lines.
+ *
+ * Payloads, parents and digits are cold arrays, read only for the match.
+ * A payload is an id in a RateDictionary, which may be shared by the tries of
+ * all vendors; ids compare in rate order.
+ */
+class CompactVendorTrie {
+public:
+    typedef std::uint32_t node_id_t;
+    static constexpr node_id_t npos = std::numeric_limits<node_id_t>::max();
+
+    /// Everything a descent reads; 8 bytes per node
+    struct hot_node_s {
+        node_id_t first_child;
+        child_mask_t child_mask;
+        std::uint16_t has_data;
+    };
+
+    CompactVendorTrie() = default;
+    /// Builds a dictionary of the rates of \p tree
+    explicit CompactVendorTrie(const VendorTree &tree);
+    /// Uses frozen \p dictionary, which must have all rates of \p tree
+    CompactVendorTrie(const VendorTree &tree, boost::shared_ptr<const RateDictionary> dictionary);
+
+    /// Count of nodes, including empty ones
+    size_t size() const {
+        return _hot.size();
+    }
+
+    const hot_node_s &hot(node_id_t id) const {
+        return _hot[id];
+    }
+    const Rate &data(node_id_t id) const {
+        return _dictionary->rate(_rate_ids[id]);
+    }
+    /// Id of the rate of a node in dictionary, RateDictionary::empty_id if none
+    RateDictionary::rate_id_t rate_id(node_id_t id) const {
+        return _rate_ids[id];
+    }
+    const RateDictionary &dictionary() const {
+        return *_dictionary;
+    }
+    node_id_t parent(node_id_t id) const {
+        return _parents[id];
+    }
+    /// Rebuilt from the digits on the way to the root
+    code_string code(node_id_t id) const;
+
+    /// ID of the longest code with data that is a prefix of \p code or npos
+    node_id_t max_match(const code_string &code) const {
+        node_id_t found = npos;
+        if (_hot.empty()) {
+            return found;
+        }
+        node_id_t id = 0;
+        for (size_t i = 0; i < code.length(); ++i) {
+            const hot_node_s &node = _hot[id];
+            const unsigned digit = code[i];
+            const unsigned mask = node.child_mask;
+            if ((mask & (1u << digit)) == 0) {
+                break;
+            }
+            id = node.first_child + __builtin_popcount(mask & ((1u << digit) - 1));
+            if (_hot[id].has_data) {
+                found = id;
+            }
+        }
+        return found;
+    }
+
+    /// Same as VendorTree::get_maximum_prefix_rate
+    rate_string get_maximum_prefix_rate(const code_string &code) const {
+        auto found = max_match(code);
+        return found == npos ? rate_string{} : data(found).rate;
+    }
+
+    /// Memory used by the hot array only
+    size_t hot_memory_usage() const {
+        return _hot.size() * sizeof(hot_node_s);
+    }
+    /// Memory used by all arrays, without the dictionary
+    size_t memory_usage() const;
+
+private:
+    void build(const VendorTree &tree);
+
+    std::vector<hot_node_s> _hot;
+
+    boost::shared_ptr<const RateDictionary> _dictionary;
+    std::vector<RateDictionary::rate_id_t> _rate_ids;
+    std::vector<node_id_t> _parents;
+    /// Last digit of the code of each node
+    std::vector<std::uint8_t> _digits;
+};
+
+}
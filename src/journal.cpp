@@ -0,0 +1,701 @@
+#include "journal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <boost/crc.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+
+#include "byte_codec.h"
+#include "tree_diff.h"
+
+namespace code_directory {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+enum class record_t : std::uint8_t {
+    vendor_tree = 1,
+    remove_vendor,
+    codename_tree,
+    checkpoint_begin,
+    checkpoint_end
+};
+
+/// Body size and CRC-32 of the body
+constexpr size_t RECORD_HEADER_SIZE = 8;
+/// Sequence number and type at the start of the body
+constexpr size_t BODY_HEADER_SIZE = 9;
+
+std::system_error journal_error(const std::string &what) {
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+class Writer : public ByteWriter {
+public:
+    explicit Writer(std::string *out) :
+        ByteWriter(out)
+    {}
+
+    void code(const char *digits, size_t length) {
+        integer(std::uint8_t(length));
+        _out->append(digits, length);
+    }
+
+    void rate(const Rate &value) {
+        integer(value.rate.value);
+        if (!value.is_empty()) {
+            integer(std::int64_t(value.effective_date));
+            integer(std::int64_t(value.end_date));
+        }
+    }
+};
+
+class Reader : public ByteReader {
+public:
+    Reader(const char *data, size_t size) :
+        ByteReader(data, size, "Record is truncated", "Extra bytes in record")
+    {}
+
+    code_string code() {
+        size_t length = integer<std::uint8_t>();
+        need(length);
+        code_string value;
+        value.set(std::string(_data, length));
+        skip(length);
+        return value;
+    }
+
+    Rate rate() {
+        rate_string value;
+        value.value = integer<std::uint64_t>();
+        if (value.is_empty()) {
+            return Rate(value, 0, 0);
+        }
+        auto effective_date = time_t(integer<std::int64_t>());
+        auto end_date = time_t(integer<std::int64_t>());
+        return Rate(value, effective_date, end_date);
+    }
+};
+
+void encode_record(std::uint64_t sequence, record_t type, const std::string &payload, std::string *out) {
+    std::string body;
+    body.reserve(BODY_HEADER_SIZE + payload.size());
+    Writer writer(&body);
+    writer.integer(sequence);
+    writer.integer(std::uint8_t(type));
+    body.append(payload);
+
+    boost::crc_32_type crc;
+    crc.process_bytes(body.data(), body.size());
+    Writer header(out);
+    header.integer(std::uint32_t(body.size()));
+    header.integer(std::uint32_t(crc.checksum()));
+    out->append(body);
+}
+
+struct record_s {
+    std::uint64_t sequence;
+    record_t type;
+    const char *payload;
+    size_t size;
+};
+
+/// Reads the record at \p offset; false if it is torn or corrupt
+bool parse_record(const std::string &data, size_t offset, record_s *record, size_t *next) {
+    if (data.size() - offset < RECORD_HEADER_SIZE) {
+        return false;
+    }
+    Reader header(data.data() + offset, RECORD_HEADER_SIZE);
+    const size_t size = header.integer<std::uint32_t>();
+    const std::uint32_t checksum = header.integer<std::uint32_t>();
+    if (size < BODY_HEADER_SIZE || size > data.size() - offset - RECORD_HEADER_SIZE) {
+        return false;
+    }
+    const char *body = data.data() + offset + RECORD_HEADER_SIZE;
+    boost::crc_32_type crc;
+    crc.process_bytes(body, size);
+    if (crc.checksum() != checksum) {
+        return false;
+    }
+    Reader reader(body, BODY_HEADER_SIZE);
+    record->sequence = reader.integer<std::uint64_t>();
+    record->type = record_t(reader.integer<std::uint8_t>());
+    record->payload = body + BODY_HEADER_SIZE;
+    record->size = size - BODY_HEADER_SIZE;
+    *next = offset + RECORD_HEADER_SIZE + size;
+    return true;
+}
+
+/**
+ * True if the unreadable record at \p offset is the torn end of a write:
+ * its size runs past the end of \p data, or no readable record follows it.
+ */
+bool torn_tail(const std::string &data, size_t offset) {
+    if (data.size() - offset < RECORD_HEADER_SIZE) {
+        return true;
+    }
+    Reader header(data.data() + offset, RECORD_HEADER_SIZE);
+    const size_t size = header.integer<std::uint32_t>();
+    if (size > data.size() - offset - RECORD_HEADER_SIZE) {
+        return true;
+    }
+    record_s record;
+    size_t next;
+    const size_t following = offset + RECORD_HEADER_SIZE + size;
+    return following == data.size() || !parse_record(data, following, &record, &next);
+}
+
+/// Changes from \p before to \p after; a null tree has no rates
+std::string encode_tree(VendorId vendor, const VendorTree *before, const VendorTree *after) {
+    class Changes {
+    public:
+        explicit Changes(std::string *out) :
+            writer(out),
+            count(0)
+        {}
+        void changed(const VendorTree::node_t *, const VendorTree::node_t *after, const code_path_s &path) {
+            writer.code(path.digits.data(), path.length);
+            writer.rate(after != nullptr ? after->data() : Rate(rate_string(), 0, 0));
+            ++count;
+        }
+        Writer writer;
+        size_t count;
+    };
+    std::string entries;
+    Changes changes(&entries);
+    diff_trees(before != nullptr ? &before->root() : nullptr,
+               after != nullptr ? &after->root() : nullptr,
+               changes);
+
+    std::string payload;
+    Writer writer(&payload);
+    writer.integer(std::int32_t(vendor));
+    writer.integer(std::uint32_t(changes.count));
+    payload.append(entries);
+    return payload;
+}
+
+/// Codenames in order of their ids, so ids are the same after replay
+std::string encode_codenames(const CodenameTree &tree) {
+    auto names = tree.list_codenames();
+    std::sort(names.begin(), names.end(), [&tree](const std::string &left, const std::string &right) {
+        return tree.codename_id(left) < tree.codename_id(right);
+    });
+    std::string payload;
+    Writer writer(&payload);
+    writer.integer(std::uint32_t(names.size()));
+    for (const auto &name: names) {
+        writer.string(name);
+        const auto &codes = tree.codes_for_name(name);
+        writer.integer(std::uint32_t(codes.size()));
+        for (const auto &code: codes) {
+            std::string digits = code;
+            writer.code(digits.data(), digits.size());
+        }
+    }
+    return payload;
+}
+
+/// State rebuilt from a checkpoint and the journal
+struct replay_s {
+    std::map<VendorId, boost::shared_ptr<VendorTree>> trees;
+    boost::shared_ptr<CodenameTree> codenames;
+};
+
+/// Applies \p record to \p state; false if it can't be decoded
+bool apply(const record_s &record, replay_s &state) {
+    Reader reader(record.payload, record.size);
+    try {
+        switch (record.type) {
+        case record_t::vendor_tree: {
+            auto vendor = VendorId(reader.integer<std::int32_t>());
+            size_t count = reader.integer<std::uint32_t>();
+            // Decoded fully before the tree is touched
+            std::vector<std::pair<code_string, Rate>> changes;
+            for (size_t i = 0; i < count; ++i) {
+                auto code = reader.code();
+                changes.emplace_back(code, reader.rate());
+            }
+            reader.finish();
+            auto &tree = state.trees[vendor];
+            if (!tree) {
+                tree = boost::make_shared<VendorTree>();
+            }
+            for (const auto &change: changes) {
+                tree->set_rate(change.first, change.second);
+            }
+            return true;
+        }
+        case record_t::remove_vendor: {
+            auto vendor = VendorId(reader.integer<std::int32_t>());
+            reader.finish();
+            state.trees.erase(vendor);
+            return true;
+        }
+        case record_t::codename_tree: {
+            auto codenames = boost::make_shared<CodenameTree>();
+            size_t names = reader.integer<std::uint32_t>();
+            for (size_t i = 0; i < names; ++i) {
+                auto name = reader.string();
+                size_t codes = reader.integer<std::uint32_t>();
+                for (size_t j = 0; j < codes; ++j) {
+                    codenames->add_code(reader.code(), name);
+                }
+            }
+            reader.finish();
+            state.codenames = codenames;
+            return true;
+        }
+        default:
+            return false;
+        }
+    } catch (const std::invalid_argument &) {
+        return false;
+    }
+}
+
+std::string file_path(const std::string &directory, const char *kind, std::uint64_t sequence) {
+    return directory + "/" + kind + "." + std::to_string(sequence);
+}
+
+/// Sequence number of file \p name of \p kind, or false if it is not one
+bool file_sequence(const std::string &name, const std::string &kind, std::uint64_t *sequence) {
+    if (name.size() <= kind.size() + 1 || name.compare(0, kind.size(), kind) != 0 || name[kind.size()] != '.') {
+        return false;
+    }
+    auto digits = name.substr(kind.size() + 1);
+    if (digits.find_first_not_of("0123456789") != std::string::npos || digits.size() > 19) {
+        return false;
+    }
+    *sequence = std::stoull(digits);
+    return true;
+}
+
+std::string read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw journal_error("Can't open " + path);
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void write_all(int fd, const char *data, size_t size) {
+    while (size != 0) {
+        auto written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw journal_error("Can't write journal");
+        }
+        data += written;
+        size -= size_t(written);
+    }
+}
+
+void sync_path(const std::string &path, int flags) {
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+        throw journal_error("Can't open " + path);
+    }
+    int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) {
+        throw journal_error("Can't sync " + path);
+    }
+}
+
+/// Makes creation, renaming and removal of files in \p directory durable
+void sync_directory(const std::string &directory) {
+    sync_path(directory, O_RDONLY | O_DIRECTORY);
+}
+
+/**
+ * Loads checkpoint \p sequence into \p state, or only checks its records if
+ * \p state is null; false if it is incomplete or corrupt
+ */
+bool load_checkpoint(const std::string &path, std::uint64_t sequence, replay_s *state) {
+    const std::string data = read_file(path);
+    record_s record;
+    size_t offset = 0, next = 0, count = 0;
+    if (!parse_record(data, offset, &record, &next) ||
+        record.type != record_t::checkpoint_begin || record.sequence != sequence) {
+        return false;
+    }
+    for (offset = next; parse_record(data, offset, &record, &next); offset = next) {
+        if (record.sequence != sequence) {
+            return false;
+        }
+        if (record.type == record_t::checkpoint_end) {
+            Reader reader(record.payload, record.size);
+            try {
+                return reader.integer<std::uint32_t>() == count && next == data.size();
+            } catch (const std::invalid_argument &) {
+                return false;
+            }
+        }
+        if (state != nullptr && !apply(record, *state)) {
+            return false;
+        }
+        ++count;
+    }
+    return false;
+}
+
+}
+
+DirectoryJournal::DirectoryJournal(CodeDirectory &directory,
+                                   const std::string &path,
+                                   const journal_options_s &options) :
+    _directory(directory),
+    _path(path),
+    _options(options),
+    _recovery{ 0, 0, 0 },
+    _sequence(0),
+    _checkpoint(0),
+    _since_checkpoint(0),
+    _appended(0),
+    _durable(0),
+    _flush_requested(false),
+    _stopping(false),
+    _fd(-1)
+{
+    if (directory.shares_subtrees()) {
+        throw std::invalid_argument("Journal can't be used with shared subtrees");
+    }
+    recover();
+    _appended = _durable = _sequence;
+    open_journal(_sequence + 1);
+    _writer = std::thread(&DirectoryJournal::write_loop, this);
+}
+
+DirectoryJournal::~DirectoryJournal() {
+    {
+        std::lock_guard<std::mutex> lock(_pending_lock);
+        _stopping = true;
+    }
+    _wake.notify_all();
+    _writer.join();
+    ::close(_fd);
+}
+
+void DirectoryJournal::recover() {
+    std::error_code error;
+    fs::create_directories(_path, error);
+    if (error) {
+        throw std::system_error(error, "Can't create " + _path);
+    }
+    std::vector<std::uint64_t> checkpoints, journals;
+    for (const auto &entry: fs::directory_iterator(_path)) {
+        const auto name = entry.path().filename().string();
+        std::uint64_t sequence;
+        if (file_sequence(name, "checkpoint", &sequence)) {
+            checkpoints.push_back(sequence);
+        } else if (file_sequence(name, "journal", &sequence)) {
+            journals.push_back(sequence);
+        } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            // Checkpoint that was not finished
+            fs::remove(entry.path());
+        }
+    }
+
+    // Latest complete checkpoint
+    replay_s state;
+    std::sort(checkpoints.rbegin(), checkpoints.rend());
+    for (auto sequence: checkpoints) {
+        replay_s loaded;
+        if (load_checkpoint(file_path(_path, "checkpoint", sequence), sequence, &loaded)) {
+            state = std::move(loaded);
+            _sequence = _recovery.checkpoint = sequence;
+            break;
+        }
+    }
+
+    _checkpoint = _recovery.checkpoint;
+
+    // Records after it. Only the end of the last journal may be torn, by a
+    // crash during a write; anything else is damage that truncating would
+    // make permanent, so files are left as they are.
+    std::sort(journals.begin(), journals.end());
+    for (auto first: journals) {
+        const auto path = file_path(_path, "journal", first);
+        const bool last = first == journals.back();
+        const std::string data = read_file(path);
+        record_s record;
+        size_t offset = 0, next = 0;
+        while (offset < data.size()) {
+            if (!parse_record(data, offset, &record, &next)) {
+                if (!last || !torn_tail(data, offset)) {
+                    throw std::runtime_error("Corrupt record in " + path + " at " + std::to_string(offset));
+                }
+                _recovery.truncated_bytes = data.size() - offset;
+                if (::truncate(path.c_str(), off_t(offset)) != 0) {
+                    throw journal_error("Can't truncate " + path);
+                }
+                sync_path(path, O_WRONLY);
+                break;
+            }
+            if (record.sequence > _sequence) {
+                if (record.sequence != _sequence + 1) {
+                    throw std::runtime_error("Records " + std::to_string(_sequence + 1) + " to " +
+                                             std::to_string(record.sequence - 1) + " are missing in " + _path);
+                }
+                if (!apply(record, state)) {
+                    throw std::runtime_error("Can't decode record " + std::to_string(record.sequence) +
+                                             " in " + path);
+                }
+                ++_sequence;
+                ++_recovery.replayed;
+            }
+            offset = next;
+        }
+    }
+
+    if (state.codenames) {
+        _directory.set_codename_tree(state.codenames);
+        _codenames = state.codenames;
+    }
+    for (const auto &tree: state.trees) {
+        _directory.set_vendor_tree(tree.first, tree.second);
+        _trees[tree.first] = tree.second;
+    }
+}
+
+void DirectoryJournal::open_journal(std::uint64_t first) {
+    const auto path = file_path(_path, "journal", first);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw journal_error("Can't open " + path);
+    }
+    sync_directory(_path);
+    int old;
+    {
+        std::lock_guard<std::mutex> lock(_pending_lock);
+        old = _fd;
+        _fd = fd;
+    }
+    if (old >= 0) {
+        ::close(old);
+    }
+}
+
+void DirectoryJournal::set_vendor_tree(VendorId vendor, CodeDirectory::tree_pointer_t tree) {
+    std::lock_guard<std::mutex> lock(_lock);
+    auto &before = _trees[vendor];
+    append(std::uint8_t(record_t::vendor_tree), encode_tree(vendor, before.get(), tree.get()));
+    _directory.set_vendor_tree(vendor, tree);
+    before = tree;
+    after_append();
+}
+
+void DirectoryJournal::set_codename_tree(CodeDirectory::codename_pointer_t tree) {
+    std::lock_guard<std::mutex> lock(_lock);
+    append(std::uint8_t(record_t::codename_tree), encode_codenames(*tree));
+    _directory.set_codename_tree(tree);
+    _codenames = tree;
+    after_append();
+}
+
+bool DirectoryJournal::reload_vendor_tree(VendorId vendor,
+                                          CodeDirectory::fingerprint_t fingerprint,
+                                          const CodeDirectory::tree_loader_t &load) {
+    std::lock_guard<std::mutex> lock(_lock);
+    // Logged when loaded, right before the directory publishes the tree
+    const bool loaded = _directory.reload_vendor_tree(vendor, fingerprint, [&]() {
+        auto tree = load();
+        auto &before = _trees[vendor];
+        append(std::uint8_t(record_t::vendor_tree), encode_tree(vendor, before.get(), tree.get()));
+        before = tree;
+        return tree;
+    });
+    if (loaded) {
+        after_append();
+    }
+    return loaded;
+}
+
+bool DirectoryJournal::reload_codename_tree(CodeDirectory::fingerprint_t fingerprint,
+                                            const CodeDirectory::codename_loader_t &load) {
+    std::lock_guard<std::mutex> lock(_lock);
+    const bool loaded = _directory.reload_codename_tree(fingerprint, [&]() {
+        auto tree = load();
+        append(std::uint8_t(record_t::codename_tree), encode_codenames(*tree));
+        _codenames = tree;
+        return tree;
+    });
+    if (loaded) {
+        after_append();
+    }
+    return loaded;
+}
+
+void DirectoryJournal::remove_vendor(VendorId vendor) {
+    std::lock_guard<std::mutex> lock(_lock);
+    std::string payload;
+    Writer(&payload).integer(std::int32_t(vendor));
+    append(std::uint8_t(record_t::remove_vendor), payload);
+    _directory.remove_vendor(vendor);
+    _trees.erase(vendor);
+    after_append();
+}
+
+void DirectoryJournal::append(std::uint8_t type, const std::string &payload) {
+    std::string record;
+    encode_record(_sequence + 1, record_t(type), payload, &record);
+    {
+        std::lock_guard<std::mutex> lock(_pending_lock);
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+        if (_pending.empty()) {
+            _pending_since = std::chrono::steady_clock::now();
+        }
+        _pending.append(record);
+        _appended = ++_sequence;
+    }
+    _wake.notify_all();
+}
+
+void DirectoryJournal::after_append() {
+    if (_options.checkpoint_records != 0 && ++_since_checkpoint >= _options.checkpoint_records) {
+        checkpoint_locked();
+    }
+}
+
+void DirectoryJournal::flush() {
+    std::unique_lock<std::mutex> lock(_pending_lock);
+    const auto target = _appended;
+    if (_durable >= target) {
+        return;
+    }
+    _flush_requested = true;
+    _wake.notify_all();
+    _written.wait(lock, [this, target]() { return _durable >= target || _error; });
+    if (_durable < target) {
+        std::rethrow_exception(_error);
+    }
+}
+
+void DirectoryJournal::checkpoint() {
+    std::lock_guard<std::mutex> lock(_lock);
+    checkpoint_locked();
+}
+
+void DirectoryJournal::checkpoint_locked() {
+    flush();
+    const auto sequence = _sequence;
+    std::string data;
+    encode_record(sequence, record_t::checkpoint_begin, std::string(), &data);
+    std::uint32_t count = 0;
+    if (_codenames) {
+        encode_record(sequence, record_t::codename_tree, encode_codenames(*_codenames), &data);
+        ++count;
+    }
+    for (const auto &tree: _trees) {
+        encode_record(sequence, record_t::vendor_tree, encode_tree(tree.first, nullptr, tree.second.get()), &data);
+        ++count;
+    }
+    std::string end;
+    Writer(&end).integer(count);
+    encode_record(sequence, record_t::checkpoint_end, end, &data);
+
+    // Written aside and renamed, so a checkpoint file is always complete
+    const auto path = file_path(_path, "checkpoint", sequence);
+    const auto temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw journal_error("Can't open " + temporary);
+    }
+    try {
+        write_all(fd, data.data(), data.size());
+        if (::fsync(fd) != 0) {
+            throw journal_error("Can't sync " + temporary);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    if (!load_checkpoint(temporary, sequence, nullptr)) {
+        fs::remove(temporary);
+        throw std::runtime_error("Checkpoint " + std::to_string(sequence) + " does not read back");
+    }
+    if (::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw journal_error("Can't rename " + temporary);
+    }
+    open_journal(sequence + 1);
+
+    // The previous checkpoint and the journal after it are kept, so
+    // recovery has them if this checkpoint is damaged later
+    const auto previous = _checkpoint;
+    for (const auto &entry: fs::directory_iterator(_path)) {
+        const auto name = entry.path().filename().string();
+        std::uint64_t file;
+        if ((file_sequence(name, "checkpoint", &file) && file < sequence && file != previous) ||
+            (file_sequence(name, "journal", &file) && file <= previous)) {
+            fs::remove(entry.path());
+        }
+    }
+    sync_directory(_path);
+    _checkpoint = sequence;
+    _since_checkpoint = 0;
+}
+
+std::uint64_t DirectoryJournal::sequence() const {
+    std::lock_guard<std::mutex> lock(_pending_lock);
+    return _appended;
+}
+
+void DirectoryJournal::write_loop() {
+    std::unique_lock<std::mutex> lock(_pending_lock);
+    for (;;) {
+        _wake.wait(lock, [this]() { return _stopping || !_pending.empty(); });
+        if (_pending.empty()) {
+            break;
+        }
+        // Let more records join the group
+        _wake.wait_until(lock, _pending_since + _options.group_delay, [this]() {
+            return _stopping || _flush_requested || _pending.size() >= _options.group_bytes;
+        });
+        std::string group;
+        group.swap(_pending);
+        const auto last = _appended;
+        const int fd = _fd;
+        _flush_requested = false;
+        lock.unlock();
+
+        std::exception_ptr error;
+        try {
+            write_all(fd, group.data(), group.size());
+            if (::fdatasync(fd) != 0) {
+                throw journal_error("Can't sync journal");
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        if (error) {
+            if (!_error) {
+                _error = error;
+            }
+        } else {
+            _durable = last;
+        }
+        _written.notify_all();
+    }
+}
+
+}
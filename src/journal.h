@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "code_directory.h"
+#include "types.h"
+
+namespace code_directory {
+
+/// Bytes of pending records that are written without waiting for more
+constexpr size_t DEFAULT_JOURNAL_GROUP_BYTES = 1 << 20;
+/// Longest time a record waits for others to be written and synced with it
+constexpr std::chrono::milliseconds DEFAULT_JOURNAL_GROUP_DELAY(5);
+/// Records between automatic checkpoints
+constexpr size_t DEFAULT_CHECKPOINT_RECORDS = 10000;
+
+struct journal_options_s {
+    size_t group_bytes = DEFAULT_JOURNAL_GROUP_BYTES;
+    std::chrono::milliseconds group_delay = DEFAULT_JOURNAL_GROUP_DELAY;
+    /// 0 means checkpoints are only written by checkpoint()
+    size_t checkpoint_records = DEFAULT_CHECKPOINT_RECORDS;
+};
+
+/**
+ * \brief Publishes changes to a CodeDirectory and logs them to an
+ * append-only journal, so a restart replays only what changed.
+ *
+ * A vendor tree is logged as the difference from the previous tree of the
+ * vendor; removals and codename trees are logged as they are. Every
+ * checkpoint_records records, the whole state is written to a checkpoint
+ * file and read back. Files older than the previous checkpoint are then
+ * deleted, so a damaged checkpoint can be recovered from the one before it.
+ * The constructor loads the latest complete checkpoint into the directory
+ * and replays the journal after it.
+ *
+ * Records are written by a background thread in groups: a group is written
+ * and synced once group_bytes are pending or the first of them waited
+ * group_delay. Publishing does not wait for the disk; use flush to wait
+ * until everything published so far is durable. A crash loses at most the
+ * records of the last unsynced group.
+ *
+ * Each record carries its size, a CRC-32 and a sequence number. A torn
+ * record at the end of the last journal file is left by a crash during a
+ * write; the journal is truncated there. Any other unreadable record, or a
+ * gap in the sequence, fails recovery without changing the files.
+ *
+ * Files in the journal directory:
+ * - checkpoint.<N>: state after record N
+ * - journal.<N>: records from N on
+ */
+class DirectoryJournal {
+public:
+    /// What the constructor found in the journal directory
+    struct recovery_s {
+        /// Sequence number of the loaded checkpoint; 0 if none
+        std::uint64_t checkpoint;
+        /// Journal records applied after the checkpoint
+        size_t replayed;
+        /// Bytes of the torn record cut from the end of the journal
+        size_t truncated_bytes;
+    };
+
+    /**
+     * \param directory Directory to recover into and publish to; it should
+     *        be empty, and must only be changed through this journal. The
+     *        journal keeps every tree it logged, so a directory sharing
+     *        subtrees would save no memory; it throws std::invalid_argument.
+     * \param path Journal directory, created if missing
+     * Throws std::system_error on I/O errors, and std::runtime_error if the
+     * journal is damaged other than by a torn last write.
+     */
+    DirectoryJournal(CodeDirectory &directory,
+                     const std::string &path,
+                     const journal_options_s &options = journal_options_s());
+    /// Writes and syncs pending records
+    ~DirectoryJournal();
+
+    DirectoryJournal(const DirectoryJournal &) = delete;
+    DirectoryJournal &operator=(const DirectoryJournal &) = delete;
+
+    /// Same as CodeDirectory methods, and logged
+    void set_vendor_tree(VendorId vendor, CodeDirectory::tree_pointer_t tree);
+    void set_codename_tree(CodeDirectory::codename_pointer_t tree);
+    void remove_vendor(VendorId vendor);
+
+    /**
+     * Same as CodeDirectory methods; trees that are loaded are logged.
+     * Loads run under the journal lock, so other logged changes wait for
+     * them. Fingerprints are not logged: the first reload after a restart
+     * loads every input.
+     */
+    bool reload_vendor_tree(VendorId vendor,
+                            CodeDirectory::fingerprint_t fingerprint,
+                            const CodeDirectory::tree_loader_t &load);
+    bool reload_codename_tree(CodeDirectory::fingerprint_t fingerprint,
+                              const CodeDirectory::codename_loader_t &load);
+
+    /// Waits until all records published so far are on disk
+    void flush();
+
+    /// Writes the current state and deletes files that it makes obsolete
+    void checkpoint();
+
+    const recovery_s &recovery() const {
+        return _recovery;
+    }
+
+    /// Sequence number of the last record
+    std::uint64_t sequence() const;
+
+private:
+    /// Appends a record to the pending group; call with _lock held
+    void append(std::uint8_t type, const std::string &payload);
+    void after_append();
+    void checkpoint_locked();
+    void recover();
+    void open_journal(std::uint64_t first);
+    void write_loop();
+
+    CodeDirectory &_directory;
+    const std::string _path;
+    const journal_options_s _options;
+    recovery_s _recovery;
+
+    /// Serializes publishing, so records are in the order of publishing
+    std::mutex _lock;
+    /// Trees as logged, to log the next tree of a vendor as a difference
+    std::map<VendorId, CodeDirectory::tree_pointer_t> _trees;
+    CodeDirectory::codename_pointer_t _codenames;
+    std::uint64_t _sequence;
+    /// Sequence number of the latest complete checkpoint; 0 if none
+    std::uint64_t _checkpoint;
+    size_t _since_checkpoint;
+
+    /// Guards everything below, shared with the writer thread
+    mutable std::mutex _pending_lock;
+    std::condition_variable _wake;
+    std::condition_variable _written;
+    std::string _pending;
+    std::chrono::steady_clock::time_point _pending_since;
+    /// Last record in _pending and last record synced
+    std::uint64_t _appended;
+    std::uint64_t _durable;
+    bool _flush_requested;
+    bool _stopping;
+    std::exception_ptr _error;
+    int _fd;
+    std::thread _writer;
+};
+
+}
@@ -7,6 +7,8 @@
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
 
+#include "binary_server.h"
+#include "journal.h"
 #include "vendor_tree.h"
 #include "code_directory.h"
 
@@ -16,8 +18,8 @@ namespace po = boost::program_options;
 using namespace code_directory;
 
 int main(int argc, char *argv[]) {
-    int thread_count, line_count, port;
-    string conn_string, config_file, address;
+    int thread_count, line_count, port, binary_port;
+    string conn_string, config_file, address, binary_socket, journal_dir;
     po::options_description desc("Options");
     desc.add_options()
             ("help,h", "show help message")
@@ -32,7 +34,13 @@ int main(int argc, char *argv[]) {
             ("address", po::value<string>(&address)->default_value("http://127.0.0.1"),
              "Server host name or ip address")
             ("port", po::value<int>(&port)->default_value(8008),
-             "Port for listening socket");
+             "Port for listening socket")
+            ("binary-port", po::value<int>(&binary_port)->default_value(0),
+             "Port for binary protocol. 0 means not listening")
+            ("binary-socket", po::value<string>(&binary_socket),
+             "Unix socket path for binary protocol")
+            ("journal-dir", po::value<string>(&journal_dir),
+             "Directory of the update journal to recover from and log to");
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -61,6 +69,38 @@ int main(int argc, char *argv[]) {
     }
 
     CodeDirectory directory;
+    std::unique_ptr<DirectoryJournal> journal;
+    if (!journal_dir.empty()) {
+        journal.reset(new DirectoryJournal(directory, journal_dir));
+        BOOST_LOG_TRIVIAL(info) << "Recovered checkpoint " << journal->recovery().checkpoint
+                                << " and " << journal->recovery().replayed << " journal records";
+    }
+
+    if (binary_port != 0 || !binary_socket.empty()) {
+        if (directory.list_codenames().empty()) {
+            BOOST_LOG_TRIVIAL(warning) << "No codename tree is published, rate and vendor queries are answered as not found";
+        }
+        boost::asio::io_context io_context;
+        BinaryServer server(directory, io_context);
+        if (binary_port != 0) {
+            server.listen_tcp(boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), binary_port));
+        }
+        if (!binary_socket.empty()) {
+            server.listen_local(binary_socket);
+        }
+        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([&io_context](const boost::system::error_code &, int) {
+            io_context.stop();
+        });
+        if (thread_count <= 0) {
+            thread_count = std::max(1u, boost::thread::hardware_concurrency());
+        }
+        boost::thread_group threads;
+        for (int i = 0; i < thread_count; ++i) {
+            threads.create_thread([&io_context]() { io_context.run(); });
+        }
+        threads.join_all();
+    }
 
     return 0;
 }
@@ -0,0 +1,62 @@
+#include "parallel.h"
+
+#include <system_error>
+
+namespace code_directory {
+
+WorkerPool::WorkerPool(size_t threads) :
+    _stopping(false)
+{
+    _threads.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        try {
+            _threads.emplace_back([this]() { run(); });
+        } catch (const std::system_error &) {
+            // Callers do the work of missing threads
+            break;
+        }
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stopping = true;
+        _tasks.clear();
+    }
+    _wake.notify_all();
+    for (auto &thread: _threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _tasks.push_back(std::move(task));
+    }
+    _wake.notify_one();
+}
+
+void WorkerPool::run() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _wake.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+            if (_stopping) {
+                return;
+            }
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+WorkerPool &WorkerPool::shared() {
+    static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace code_directory {
+
+/**
+ * \brief Fixed set of threads running queued tasks, shared by all
+ * parallel_chunks calls.
+ *
+ * Threads are started once, so a parallel stage costs a queue push per
+ * helper instead of a thread start, and all queries together never run more
+ * helpers than the pool has threads.
+ */
+class WorkerPool {
+public:
+    /// Starts up to \p threads threads; fewer if the system refuses more
+    explicit WorkerPool(size_t threads);
+    /// Drops queued tasks and joins the threads
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    /// Count of threads running
+    size_t size() const {
+        return _threads.size();
+    }
+
+    void post(std::function<void()> task);
+
+    /// Pool of hardware_concurrency threads, started on first use
+    static WorkerPool &shared();
+
+private:
+    void run();
+
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::deque<std::function<void()>> _tasks;
+    bool _stopping;
+    std::vector<std::thread> _threads;
+};
+
+/**
+ * \brief Splits [0, count) into up to \p threads consecutive chunks and calls
+ * function(begin, end, chunk) for each.
+ *
+ * The calling thread takes chunks along with up to threads - 1 helpers from
+ * \p pool, so all chunks are done even if the pool is busy with other calls.
+ * Chunk numbers go up with begin, so results collected per chunk merge in
+ * the order of a serial loop. The first exception thrown is rethrown after
+ * all chunks are done.
+ * \return Count of chunks
+ */
+template<class Function>
+size_t parallel_chunks(size_t count, size_t threads, Function function,
+                       WorkerPool &pool = WorkerPool::shared()) {
+    const size_t chunks = std::max<size_t>(1, std::min(threads, count));
+    if (chunks == 1) {
+        function(0, count, 0);
+        return chunks;
+    }
+
+    // Helpers may take it from the queue after the call returned, so it is
+    // shared; they find no chunks left then and never call function.
+    struct job_s {
+        std::function<void(size_t)> run;
+        size_t chunks;
+        std::atomic<size_t> next;
+        std::mutex lock;
+        std::condition_variable finished;
+        size_t done;
+        std::exception_ptr error;
+    };
+    auto job = std::make_shared<job_s>();
+    job->run = [&function, count, chunks](size_t chunk) {
+        function(count * chunk / chunks, count * (chunk + 1) / chunks, chunk);
+    };
+    job->chunks = chunks;
+    job->next = 0;
+    job->done = 0;
+    auto work = [](const std::shared_ptr<job_s> &job) {
+        for (size_t chunk; (chunk = job->next++) < job->chunks;) {
+            std::exception_ptr error;
+            try {
+                job->run(chunk);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(job->lock);
+            if (error && !job->error) {
+                job->error = error;
+            }
+            if (++job->done == job->chunks) {
+                job->finished.notify_all();
+            }
+        }
+    };
+
+    const size_t helpers = std::min(chunks - 1, pool.size());
+    try {
+        for (size_t i = 0; i < helpers; ++i) {
+            pool.post([job, work]() { work(job); });
+        }
+    } catch (...) {
+        // Chunks not taken by helpers are done here
+    }
+    work(job);
+    std::unique_lock<std::mutex> lock(job->lock);
+    job->finished.wait(lock, [&job]() { return job->done == job->chunks; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+    return chunks;
+}
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "codename.h"
+#include "prefix_tree.h"
+#include "types.h"
+
+namespace code_directory {
+
+/**
+ * \brief Calls visitor(code, data) for up to \p limit codes with data that
+ * start with \p prefix, in code order.
+ *
+ * If \p after is not null the scan starts right after that code, which need
+ * not be in the tree, so a scan can be resumed from the last code it
+ * returned. Works for any node with child_mask, get_child and data, such as
+ * Node or SharedNode: codes are tracked on the way down, nodes need not
+ * store them. Data of the root is skipped, as by LPM.
+ *
+ * \return true if codes with data are left after the last one visited
+ */
+template<class TreeNode, class Visitor>
+bool scan_prefix(const TreeNode &root,
+                 const code_string &prefix,
+                 const code_string *after,
+                 size_t limit,
+                 Visitor visitor) {
+    struct entry_s {
+        const TreeNode *node;
+        std::uint8_t depth;
+        std::uint8_t digit;
+    };
+    std::array<entry_s, TRAVERSAL_STACK_SIZE> stack;
+    size_t top = 0;
+    // Digits of the code of the node on top, valid up to its depth
+    char digits[MAX_CODE_LENGTH];
+
+    // Pushes children with digit from \p first, the last first so the first is popped first
+    auto push_children = [&](const TreeNode *node, size_t depth, unsigned first) {
+        child_mask_t mask = child_mask_t(node->child_mask() & ~((1u << first) - 1));
+        if (top + __builtin_popcount(mask) > stack.size()) {
+            throw std::length_error("Tree is too deep to scan");
+        }
+        while (mask != 0) {
+            size_t index = 31 - __builtin_clz(mask);
+            mask &= child_mask_t(~(1u << index));
+            stack[top++] = entry_s{ node->get_child(index), std::uint8_t(depth + 1), std::uint8_t(index) };
+        }
+    };
+
+    if (after != nullptr &&
+        (after->length() < prefix.length() || !(after->substr(0, prefix.length()) == prefix))) {
+        throw std::invalid_argument("Scan position is not under the prefix");
+    }
+    const TreeNode *node = &root;
+    for (size_t i = 0; i < prefix.length(); ++i) {
+        digits[i] = char('0' + prefix[i]);
+        if ((node = node->get_child(prefix[i])) == nullptr) {
+            return false;
+        }
+    }
+    if (after == nullptr) {
+        const size_t depth = prefix.length();
+        stack[top++] = entry_s{ node, std::uint8_t(depth), std::uint8_t(depth > 0 ? prefix[depth - 1] : 0) };
+    } else {
+        // Codes after \p after: its subtree, then greater siblings on its
+        // path from the deepest up. Pushed in reverse of that order.
+        for (size_t depth = prefix.length(); node != nullptr; ++depth) {
+            if (depth == after->length()) {
+                push_children(node, depth, 0);
+                break;
+            }
+            const unsigned digit = (*after)[depth];
+            digits[depth] = char('0' + digit);
+            push_children(node, depth, digit + 1);
+            node = node->get_child(digit);
+        }
+    }
+
+    size_t count = 0;
+    while (top != 0) {
+        const entry_s entry = stack[--top];
+        if (entry.depth > 0) {
+            digits[entry.depth - 1] = char('0' + entry.digit);
+            if (!is_empty(entry.node->data())) {
+                if (count == limit) {
+                    return true;
+                }
+                visitor(code_string{std::string(digits, entry.depth).c_str()}, entry.node->data());
+                ++count;
+            }
+        }
+        push_children(entry.node, entry.depth, 0);
+    }
+    return false;
+}
+
+/**
+ * \brief Resumable scan of codes with data under a prefix, a page at a time.
+ *
+ * Keeps only the prefix and the last code returned, so memory does not
+ * depend on the size of the subtree. The tree must outlive the cursor and
+ * must not change while it is used.
+ */
+template<class TreeNode>
+class PrefixCursor {
+public:
+    PrefixCursor(const TreeNode &root, const code_string &prefix) :
+        _root(root),
+        _prefix(prefix),
+        _started(false),
+        _done(false)
+    {}
+
+    /**
+     * Calls visitor(code, data) for up to \p count next codes.
+     * \return false when there is nothing left
+     */
+    template<class Visitor>
+    bool next(size_t count, Visitor visitor) {
+        if (_done) {
+            return false;
+        }
+        bool more = scan_prefix(_root, _prefix, _started ? &_position : nullptr, count,
+                                [&](const code_string &code, const auto &data) {
+                                    _position = code;
+                                    _started = true;
+                                    visitor(code, data);
+                                });
+        _done = !more;
+        return more;
+    }
+
+    bool done() const {
+        return _done;
+    }
+
+    /// Last code returned; resume with scan_prefix from it
+    const code_string &position() const {
+        return _position;
+    }
+
+private:
+    const TreeNode &_root;
+    code_string _prefix;
+    code_string _position;
+    bool _started;
+    bool _done;
+};
+
+}
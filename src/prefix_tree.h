@@ -1,17 +1,47 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <cstdint>
 #include <exception>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <vector>
 #include "types.h"
 
 namespace code_directory {
 
+/// Hint the CPU to start loading \p address; no-op where unsupported.
+inline void prefetch(const void *address) {
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+/// Bitmap of occupied child slots: bit N is set if child N exists.
+typedef std::uint16_t child_mask_t;
+
+/**
+ * Maximum number of pending nodes during a subtree traversal.
+ * Every level below the starting node leaves at most 9 siblings on the stack,
+ * and a code is at most MAX_CODE_LENGTH digits deep.
+ */
+constexpr size_t TRAVERSAL_STACK_SIZE = 10 * (MAX_CODE_LENGTH + 1);
+
+/// Number of lookups that PrefixTree batch searches advance in lock-step
+constexpr size_t BATCH_LOOKUP_WIDTH = 16;
+
+constexpr size_t pow10(size_t power) {
+    return power == 0 ? 1 : 10 * pow10(power - 1);
+}
+
 /**
  * \brief Basic Node for tree
  * This node contains 10 pointers to its children and its parent.
- *
+ * Occupied child slots are tracked in a bitmap so traversals skip empty ones.
  */
 template <class Value>
 class Node {
@@ -26,14 +56,16 @@ public:
         _children{ {nullptr} },
         _data(data),
         _code(code),
-        _parent { nullptr }
+        _parent { nullptr },
+        _child_mask { 0 }
     {
     }
     Node(code_string &&code, Value &&data) :
         _children{ {nullptr} },
         _data(std::move(data)),
         _code(std::move(code)),
-        _parent { nullptr }
+        _parent { nullptr },
+        _child_mask { 0 }
     {
     }
 
@@ -49,6 +81,15 @@ public:
     void set_child(size_t index, self_ptr &&child) {
         _children[index] = std::move(child);
         _children[index]->_parent = this;
+        _child_mask |= child_mask_t(1u << index);
+    }
+
+    self_ptr release_child(size_t index) {
+        _child_mask &= child_mask_t(~(1u << index));
+        if (_children[index]) {
+            _children[index]->_parent = nullptr;
+        }
+        return std::move(_children[index]);
     }
 
 
@@ -56,6 +97,11 @@ public:
         return _children[index].get();
     }
 
+    /// Starts loading the slot of child \p index without waiting for it
+    void prefetch_child(size_t index) const {
+        prefetch(&_children[index]);
+    }
+
     Value &data() {
         return _data;
     }
@@ -70,15 +116,47 @@ public:
     const self_t *parent() const {
         return _parent;
     }
+    self_t *parent() {
+        return _parent;
+    }
 
+    child_mask_t child_mask() const {
+        return _child_mask;
+    }
+
+    size_t children_count() const {
+        return __builtin_popcount(_child_mask);
+    }
+
+    /**
+     * \brief Visits this node and its subtree in pre-order.
+     *
+     * Traversal is iterative with an explicit stack. Only occupied child slots
+     * are pushed and each of them is prefetched, so its memory is likely
+     * loaded by the time the node is popped.
+     * Children of a node are not visited if \p visitor returns false for it.
+     */
     template<class Visitor>
     void accept(Visitor &visitor) const {
-        if (!visitor.visit(*this)) {
-            return;
-        }
-        for (auto &child: _children) {
-            if (child != nullptr) {
-                child->accept(visitor);
+        std::array<const self_t *, TRAVERSAL_STACK_SIZE> stack;
+        size_t top = 0;
+        stack[top++] = this;
+        while (top != 0) {
+            const self_t *node = stack[--top];
+            if (!visitor.visit(*node)) {
+                continue;
+            }
+            child_mask_t mask = node->_child_mask;
+            if (top + __builtin_popcount(mask) > stack.size()) {
+                throw std::length_error("Tree is too deep to traverse");
+            }
+            // Push children from the last one so the first is popped first
+            while (mask != 0) {
+                size_t index = 31 - __builtin_clz(mask);
+                mask &= child_mask_t(~(1u << index));
+                const self_t *child = node->_children[index].get();
+                prefetch(child);
+                stack[top++] = child;
             }
         }
     }
@@ -90,6 +168,7 @@ protected:
     Value _data;
     code_string _code;
     self_t *_parent;
+    child_mask_t _child_mask;
 };
 
 /**
@@ -98,21 +177,32 @@ protected:
  * PrefixTree stores data as a tree and provides retrieve_maximum_prefix_node method
  * which searches for node that has maximum matching prefix for provided code.
  * PrefixTree can be used for concurrent searches and single-threaded inserts.
+ *
+ * If \p Stride is not 0, the tree also keeps a direct-indexed table with an
+ * entry for every combination of the first \p Stride digits. Searches for codes
+ * of at least \p Stride digits start from the table entry instead of walking
+ * the top levels from the root. The table has 10^Stride entries.
  */
-template <class Value, bool (*Empty)(const Value&) = is_empty>
+template <class Value, bool (*Empty)(const Value&) = is_empty, size_t Stride = 0>
 class PrefixTree {
 public:
-    typedef PrefixTree<Value, Empty> self_t;
+    typedef PrefixTree<Value, Empty, Stride> self_t;
     typedef Node<Value> node_t;
     typedef Value data_t;
     typedef std::function<bool (const Value&)> tester_t;
 
+    static constexpr size_t stride = Stride;
+
     PrefixTree(const Value& empty = Value{}) :
         _root_node(get_empty<code_string>(), empty),
         _empty(empty)
     {
+        if (Stride > 0) {
+            _stride_table.resize(pow10(Stride));
+            refresh_stride_table(get_empty<code_string>());
+        }
     }
-    PrefixTree(const PrefixTree<Value>&) = delete;
+    PrefixTree(const self_t&) = delete;
 
     /**
      * \brief Inserts or updates data in the tree.
@@ -128,6 +218,10 @@ public:
 
         size_t matching_len;
         node_t *cur_node = maximum_matching_node(code, &matching_len);
+        // Stride table depends only on nodes and data of the first Stride levels
+        const bool top_levels_changed = matching_len < Stride || code.length() <= Stride;
+        // Entries under the first node created or the updated node
+        const size_t changed_len = std::min(matching_len + 1, code.length());
         if (code.length() == matching_len) {
             // Node already exists, just update data in it if necessary
             if (tester_function(cur_node->data())) {
@@ -145,6 +239,9 @@ public:
             }
             cur_node->data() = data;
         }
+        if (Stride > 0 && top_levels_changed) {
+            refresh_stride_table(code.substr(0, changed_len));
+        }
     }
 
     node_t *maximum_matching_node(const code_string &code, size_t *match) {
@@ -165,8 +262,8 @@ public:
      * \return Non-null pointer to node that has maximum matching prefix.
      */
     const node_t *maximum_matching_node(const code_string &code, size_t *match) const {
-        size_t index = 0;
-        const node_t *cur = &_root_node, *next = nullptr;
+        size_t index;
+        const node_t *cur = search_start(code, &index), *next = nullptr;
         while ((code.length() > index) &&
                ((next = cur->get_child(code[index])) != nullptr) ) {
             ++index;
@@ -176,6 +273,64 @@ public:
         return cur;
     }
 
+    /**
+     * \brief Searches for the maximum matching prefix Nodes of many codes.
+     *
+     * Same as calling maximum_matching_node for every code, but up to
+     * BATCH_LOOKUP_WIDTH searches are advanced one level at a time together.
+     * Each round prefetches the next child slot of every search before any
+     * of them is dereferenced, so memory loads of independent searches overlap.
+     *
+     * \param[in] codes Codes to search for
+     * \param[in] count Number of codes
+     * \param[out] nodes Array of \p count found nodes
+     * \param[out] matches Optional. Array of \p count matched lengths
+     */
+    void maximum_matching_nodes(const code_string *codes,
+                                size_t count,
+                                const node_t **nodes,
+                                size_t *matches = nullptr) const {
+        for (size_t base = 0; base < count; base += BATCH_LOOKUP_WIDTH) {
+            const size_t width = std::min(BATCH_LOOKUP_WIDTH, count - base);
+            const code_string *group = codes + base;
+            const node_t **cur = nodes + base;
+            std::array<size_t, BATCH_LOOKUP_WIDTH> index;
+            std::array<bool, BATCH_LOOKUP_WIDTH> active;
+
+            for (size_t i = 0; i < width; ++i) {
+                cur[i] = search_start(group[i], &index[i]);
+                active[i] = group[i].length() > index[i];
+                if (active[i]) {
+                    cur[i]->prefetch_child(group[i][index[i]]);
+                }
+            }
+            bool any_active = true;
+            while (any_active) {
+                any_active = false;
+                for (size_t i = 0; i < width; ++i) {
+                    if (!active[i]) {
+                        continue;
+                    }
+                    const node_t *next = cur[i]->get_child(group[i][index[i]]);
+                    if (next == nullptr) {
+                        active[i] = false;
+                        continue;
+                    }
+                    cur[i] = next;
+                    if (++index[i] < group[i].length()) {
+                        next->prefetch_child(group[i][index[i]]);
+                        any_active = true;
+                    } else {
+                        active[i] = false;
+                    }
+                }
+            }
+            if (matches != nullptr) {
+                std::copy(index.begin(), index.begin() + width, matches + base);
+            }
+        }
+    }
+
     /**
      * @brief Search for exactly matching node
      * @param code Code to search for
@@ -199,13 +354,44 @@ public:
      * \return Reference to data of node that has maximum matching prefix
      */
     const Value &data_for_max_match(const code_string &code, size_t *match) const {
-        const node_t *node = maximum_matching_node(code, match);
-        const node_t *parent = node->parent();
-        while (Empty(node->data()) && parent != nullptr) {
-            node = parent;
-            parent = node->parent();
+        return data_node(code, maximum_matching_node(code, match))->data();
+    }
+
+    /**
+     * \brief Batch search for the nodes whose data data_for_max_match returns.
+     *
+     * \param[in] codes Codes to search for
+     * \param[in] count Number of codes
+     * \param[out] nodes Array of \p count nodes. Root is returned for codes
+     *             without data on their path
+     */
+    void data_nodes_for_max_matches(const code_string *codes,
+                                    size_t count,
+                                    const node_t **nodes) const {
+        maximum_matching_nodes(codes, count, nodes);
+        for (size_t i = 0; i < count; ++i) {
+            nodes[i] = data_node(codes[i], nodes[i]);
+        }
+    }
+
+    /**
+     * \brief Batch version of data_for_max_match.
+     *
+     * \param[in] codes Codes to search for
+     * \param[in] count Number of codes
+     * \param[out] data Array of \p count pointers to data of maximum matching prefix
+     */
+    void data_for_max_matches(const code_string *codes,
+                              size_t count,
+                              const Value **data) const {
+        std::array<const node_t *, BATCH_LOOKUP_WIDTH> nodes;
+        for (size_t base = 0; base < count; base += BATCH_LOOKUP_WIDTH) {
+            const size_t width = std::min(BATCH_LOOKUP_WIDTH, count - base);
+            data_nodes_for_max_matches(codes + base, width, nodes.data());
+            for (size_t i = 0; i < width; ++i) {
+                data[base + i] = &nodes[i]->data();
+            }
         }
-        return node->data();
     }
 
     template<class Visitor>
@@ -213,10 +399,92 @@ public:
         _root_node.accept(visitor);
     }
 
+    const node_t &root() const {
+        return _root_node;
+    }
+
+    /// Digits of \p code that a search skips by starting from the stride table
+    size_t stride_depth(const code_string &code) const {
+        size_t depth;
+        search_start(code, &depth);
+        return depth;
+    }
+
 #ifndef DEBUG
 private:
 #endif
+    /// Closest node to \p node, going up, that has data; root if none
+    static const node_t *data_holder(const node_t *node) {
+        const node_t *parent = node->parent();
+        while (Empty(node->data()) && parent != nullptr) {
+            node = parent;
+            parent = node->parent();
+        }
+        return node;
+    }
+
+    /**
+     * Same as data_holder for \p node found as maximum match of \p code,
+     * but stops at the stride table entry that has its answer precomputed.
+     */
+    const node_t *data_node(const code_string &code, const node_t *node) const {
+        if (Stride == 0 || code.length() < Stride) {
+            return data_holder(node);
+        }
+        const stride_entry_s &entry = _stride_table[stride_index(code, Stride)];
+        while (node != entry.node && Empty(node->data())) {
+            node = node->parent();
+        }
+        return node == entry.node ? entry.best : node;
+    }
+
+    /// Node to start search of \p code from, and count of digits it matched
+    const node_t *search_start(const code_string &code, size_t *index) const {
+        if (Stride > 0 && code.length() >= Stride) {
+            const stride_entry_s &entry = _stride_table[stride_index(code, Stride)];
+            *index = entry.depth;
+            return entry.node;
+        }
+        *index = 0;
+        return &_root_node;
+    }
+
+    static size_t stride_index(const code_string &code, size_t length) {
+        size_t index = 0;
+        for (size_t i = 0; i < length; ++i) {
+            index = index * 10 + code[i];
+        }
+        return index;
+    }
+
+    /// Recomputes all stride table entries which start with \p code
+    void refresh_stride_table(const code_string &code) {
+        const size_t prefix_length = std::min(code.length(), Stride);
+        const size_t span = pow10(Stride - prefix_length);
+        const size_t first = stride_index(code, prefix_length) * span;
+        for (size_t index = first; index < first + span; ++index) {
+            const node_t *cur = &_root_node, *next = nullptr;
+            size_t depth = 0;
+            while (depth < Stride &&
+                   (next = cur->get_child(index / pow10(Stride - depth - 1) % 10)) != nullptr) {
+                cur = next;
+                ++depth;
+            }
+            _stride_table[index] = stride_entry_s{ cur, data_holder(cur), depth };
+        }
+    }
+
+    struct stride_entry_s {
+        /// Deepest node on the path of entry digits
+        const node_t *node;
+        /// Result of data_holder for node
+        const node_t *best;
+        /// Count of digits matched by node
+        size_t depth;
+    };
+
     node_t _root_node;
     Value _empty;
+    std::vector<stride_entry_s> _stride_table;
 };
 }
@@ -0,0 +1,49 @@
+#include "query_arena.h"
+
+namespace code_directory {
+
+void *QueryArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+    allocated += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void QueryArena::Upstream::do_deallocate(void *pointer, size_t bytes, size_t alignment) {
+    std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+}
+
+QueryArena::QueryArena(size_t initial_size) :
+    _size(initial_size != 0 ? initial_size : DEFAULT_ARENA_SIZE),
+    _overflows(0)
+{
+    make_resource();
+}
+
+void QueryArena::make_resource() {
+    _resource.reset();
+    _buffer.reset(new char[_size]);
+    _resource.reset(new std::pmr::monotonic_buffer_resource(_buffer.get(), _size, &_upstream));
+}
+
+void QueryArena::reset() {
+    if (_upstream.allocated == 0) {
+        // Back to the start of the buffer
+        _resource->release();
+        return;
+    }
+    ++_overflows;
+    size_t needed = _size + _upstream.allocated;
+    while (_size < needed) {
+        _size *= 2;
+    }
+    // Frees heap chunks through _upstream
+    _resource.reset();
+    _upstream.allocated = 0;
+    make_resource();
+}
+
+QueryArena &QueryArena::local() {
+    thread_local QueryArena arena;
+    return arena;
+}
+
+}
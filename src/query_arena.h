@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+
+namespace code_directory {
+
+/// Initial buffer of a QueryArena
+constexpr size_t DEFAULT_ARENA_SIZE = 64 << 10;
+
+/**
+ * \brief Reusable scratch memory for the queries of one thread.
+ *
+ * Memory is handed out from a buffer by bumping a pointer and is freed all at
+ * once by reset, so a request allocates nothing from the global heap once the
+ * buffer has grown to fit it. If a request runs past the buffer, the rest
+ * comes from the heap and the next reset grows the buffer to fit.
+ *
+ * Not thread-safe: use one arena per thread, see local.
+ */
+class QueryArena {
+public:
+    explicit QueryArena(size_t initial_size = DEFAULT_ARENA_SIZE);
+    QueryArena(const QueryArena &) = delete;
+
+    std::pmr::memory_resource *resource() {
+        return _resource.get();
+    }
+
+    /// Frees everything allocated; memory from the arena must not be used after
+    void reset();
+
+    size_t capacity() const {
+        return _size;
+    }
+    /// Count of times the buffer did not fit a request and the heap was used
+    std::uint64_t overflows() const {
+        return _overflows;
+    }
+
+    /// Arena of the calling thread
+    static QueryArena &local();
+
+private:
+    /// Heap memory past the buffer, counted to size the next buffer
+    class Upstream : public std::pmr::memory_resource {
+    public:
+        size_t allocated = 0;
+    private:
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    void make_resource();
+
+    size_t _size;
+    std::unique_ptr<char[]> _buffer;
+    Upstream _upstream;
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> _resource;
+    std::uint64_t _overflows;
+};
+
+/**
+ * \brief Forwards to another resource under a lock, so the threads of one
+ * parallel query can all allocate from its arena.
+ */
+class SynchronizedResource : public std::pmr::memory_resource {
+public:
+    explicit SynchronizedResource(std::pmr::memory_resource *upstream) :
+        _upstream(upstream)
+    {}
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _upstream->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *pointer, size_t bytes, size_t alignment) override {
+        std::lock_guard<std::mutex> lock(_lock);
+        _upstream->deallocate(pointer, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource *_upstream;
+    std::mutex _lock;
+};
+
+/// Resets an arena when a request is done
+class ArenaScope {
+public:
+    explicit ArenaScope(QueryArena &arena = QueryArena::local()) :
+        _arena(arena)
+    {}
+    ArenaScope(const ArenaScope &) = delete;
+    ~ArenaScope() {
+        _arena.reset();
+    }
+
+    std::pmr::memory_resource *resource() {
+        return _arena.resource();
+    }
+
+private:
+    QueryArena &_arena;
+};
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+namespace code_directory {
+
+/// Counters of a QueryCache
+struct cache_stats_s {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+    size_t size;
+};
+
+/**
+ * \brief Concurrent size-bounded LRU cache of query results.
+ *
+ * Entries are split between shards by key hash, each shard is an LRU list
+ * guarded by its own mutex. Values are shared and immutable, so a hit only
+ * holds the shard lock to find the entry and move it to the front.
+ *
+ * Keys are expected to include generations of everything the result depends
+ * on: a stale entry is never hit again and ages out of its shard.
+ */
+template<class Key, class Value, class Hash = std::hash<Key>>
+class QueryCache {
+public:
+    typedef boost::shared_ptr<const Value> value_pointer_t;
+
+    /// \param capacity Maximum number of entries, split evenly between shards; 0 disables the cache
+    QueryCache(size_t capacity = 0) :
+        _hits(0),
+        _misses(0),
+        _evictions(0)
+    {
+        set_capacity(capacity);
+    }
+    QueryCache(const QueryCache &) = delete;
+
+    /// Changes capacity; drops all entries
+    void set_capacity(size_t capacity) {
+        _enabled = capacity != 0;
+        for (auto &shard: _shards) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            shard.capacity = (capacity + SHARDS - 1) / SHARDS;
+            shard.entries.clear();
+            shard.index.clear();
+        }
+    }
+
+    /// Cached value or null pointer
+    value_pointer_t find(const Key &key) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) {
+            ++_misses;
+            return {};
+        }
+        ++_hits;
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        return found->second->second;
+    }
+
+    void insert(const Key &key, value_pointer_t value) {
+        auto &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        if (shard.capacity == 0) {
+            return;
+        }
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            found->second->second = value;
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            return;
+        }
+        if (shard.index.size() >= shard.capacity) {
+            shard.index.erase(shard.entries.back().first);
+            shard.entries.pop_back();
+            ++_evictions;
+        }
+        shard.entries.emplace_front(key, value);
+        shard.index.emplace(key, shard.entries.begin());
+    }
+
+    /// False if capacity is 0 and insert does nothing
+    bool enabled() const {
+        return _enabled;
+    }
+
+    cache_stats_s stats() const {
+        cache_stats_s ret { _hits, _misses, _evictions, 0 };
+        for (auto &shard: _shards) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            ret.size += shard.index.size();
+        }
+        return ret;
+    }
+
+private:
+    static constexpr size_t SHARDS = 16;
+
+    struct shard_s {
+        typedef std::list<std::pair<Key, value_pointer_t>> entries_t;
+        mutable std::mutex lock;
+        size_t capacity;
+        /// Most recently used first
+        entries_t entries;
+        std::unordered_map<Key, typename entries_t::iterator, Hash> index;
+    };
+
+    shard_s &shard_for(const Key &key) {
+        return _shards[Hash{}(key) % SHARDS];
+    }
+
+    std::array<shard_s, SHARDS> _shards;
+    std::atomic<bool> _enabled;
+    std::atomic<std::uint64_t> _hits;
+    std::atomic<std::uint64_t> _misses;
+    std::atomic<std::uint64_t> _evictions;
+};
+
+}
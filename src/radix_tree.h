@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include "prefix_tree.h"
+#include "types.h"
+
+namespace code_directory {
+
+/**
+ * \brief Path-compressed variant of PrefixTree.
+ *
+ * Chains of single-child nodes without data are collapsed into one edge:
+ * a child may sit several digits below its parent, and the digits in between
+ * are the part of child's code that follows parent's code.
+ * Nodes are the same Node<Value> as in PrefixTree, so visitors work with both.
+ *
+ * Long sparse codes (e.g. single mobile ranges under a country code) take one
+ * node instead of one node per digit. Lookup results are the same as for
+ * PrefixTree; see maximum_matching_node for the one difference in meaning.
+ */
+template <class Value, bool (*Empty)(const Value&) = is_empty>
+class RadixTree {
+public:
+    typedef RadixTree<Value, Empty> self_t;
+    typedef Node<Value> node_t;
+    typedef Value data_t;
+    typedef std::function<bool (const Value&)> tester_t;
+
+    RadixTree(const Value& empty = Value{}) :
+        _root_node(get_empty<code_string>(), empty),
+        _empty(empty)
+    {
+    }
+    RadixTree(const self_t&) = delete;
+
+    /**
+     * \brief Inserts or updates data in the tree.
+     * Splits a compressed edge if \p code ends or diverges inside it.
+     *
+     * \param code Code which data belongs to
+     * \param value Data to be inserted
+     * \param tester_function Called with old data of an existing position;
+     *        data is updated only if it returns true
+     */
+    void put_data(const code_string &code,
+                  const Value &data,
+                  tester_t tester_function = [](const Value&){return true;}) {
+
+        size_t matching_len;
+        node_t *cur_node = maximum_matching_node(code, &matching_len);
+        if (cur_node->code().length() == matching_len) {
+            if (code.length() == matching_len) {
+                // Node already exists, just update data in it if necessary
+                if (tester_function(cur_node->data())) {
+                    cur_node->data() = data;
+                }
+            } else {
+                // Rest of the code becomes a single new edge
+                cur_node->set_child(code[matching_len], make_node(code, data));
+            }
+            return;
+        }
+
+        // Search stopped inside the edge leading to cur_node: split that edge
+        node_t *parent = cur_node->parent();
+        size_t slot = code[parent->code().length()];
+        auto tail = parent->release_child(slot);
+        auto split = make_node(code.substr(0, matching_len), _empty);
+        node_t *split_node = split.get();
+        split->set_child(tail->code()[matching_len], std::move(tail));
+        parent->set_child(slot, std::move(split));
+
+        if (code.length() == matching_len) {
+            // PrefixTree would have had an empty node at this position
+            if (tester_function(_empty)) {
+                split_node->data() = data;
+            }
+        } else {
+            split_node->set_child(code[matching_len], make_node(code, data));
+        }
+    }
+
+    node_t *maximum_matching_node(const code_string &code, size_t *match) {
+        return const_cast<node_t *>(static_cast<const self_t*>(this)->maximum_matching_node(code, match));
+    }
+
+    /**
+     * \brief Searches for the maximum matching prefix Node in the tree.
+     *
+     * If \p match is less than the length of returned node's code, the search
+     * stopped inside the compressed edge leading to that node. The subtree of
+     * that node then holds exactly the codes that PrefixTree would hold below
+     * its node for the matched position.
+     *
+     * \param[in] code Code to search for
+     * \param[out] match Count of symbols successfully matched. 0 means no symbols matched
+     * \return Non-null pointer to node that has maximum matching prefix.
+     */
+    const node_t *maximum_matching_node(const code_string &code, size_t *match) const {
+        size_t index = 0;
+        const node_t *cur = &_root_node, *next = nullptr;
+        while ((code.length() > index) &&
+               ((next = cur->get_child(code[index])) != nullptr) ) {
+            // The child slot has already matched the first digit of the edge
+            const code_string &edge = next->code();
+            size_t end = std::min(edge.length(), code.length());
+            ++index;
+            while (index < end && edge[index] == code[index]) {
+                ++index;
+            }
+            cur = next;
+            if (index < edge.length()) {
+                break;
+            }
+        }
+        *match = index;
+        return cur;
+    }
+
+    /**
+     * @brief Search for exactly matching node
+     * @param code Code to search for
+     * @return Pointer to found node or nullptr if search is unsuccessfull.
+     *         Positions inside a compressed edge have no node and never hold data.
+     */
+    const node_t *exactly_matching_node(const code_string &code) const {
+        size_t index = 0;
+        auto ret = maximum_matching_node(code, &index);
+        if (code.length() == index && ret->code().length() == index) {
+            return ret;
+        } else {
+            return nullptr;
+        }
+    }
+
+    /**
+     * \brief Searches for the data of maximum matching prefix Node in the tree.
+     *
+     * \param[in] code Code to search for
+     * \param[out] match Count of symbols successfully matched. 0 means no symbols matched
+     * \return Reference to data of node that has maximum matching prefix
+     */
+    const Value &data_for_max_match(const code_string &code, size_t *match) const {
+        const node_t *node = maximum_matching_node(code, match);
+        if (*match < node->code().length()) {
+            // Matched part of an edge; its node is not a prefix of the code
+            node = node->parent();
+        }
+        const node_t *parent = node->parent();
+        while (Empty(node->data()) && parent != nullptr) {
+            node = parent;
+            parent = node->parent();
+        }
+        return node->data();
+    }
+
+    template<class Visitor>
+    void accept(Visitor &visitor) const {
+        _root_node.accept(visitor);
+    }
+
+#ifndef DEBUG
+private:
+#endif
+    typename node_t::self_ptr make_node(const code_string &code, const Value &data) const {
+        return typename node_t::self_ptr{new node_t(code, data)};
+    }
+
+    node_t _root_node;
+    Value _empty;
+};
+}
@@ -172,5 +172,19 @@ struct Rate{
     bool is_empty() const {
         return rate.is_empty();
     }
+    /// Rate applies from effective_date up to, not including, end_date
+    bool is_in_effect(time_t time) const {
+        return !is_empty() && effective_date <= time && time < end_date;
+    }
 };
+
+inline bool same_data(const Rate &left, const Rate &right) {
+    // Dates of empty rates are not set
+    if (left.is_empty() || right.is_empty()) {
+        return left.is_empty() && right.is_empty();
+    }
+    return left.rate == right.rate &&
+           left.effective_date == right.effective_date &&
+           left.end_date == right.end_date;
+}
 }
@@ -0,0 +1,69 @@
+#include "rate_dictionary.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <tuple>
+
+namespace code_directory {
+
+namespace {
+
+bool rate_less(const Rate &left, const Rate &right) {
+    return std::make_tuple(left.rate.value, left.effective_date, left.end_date) <
+           std::make_tuple(right.rate.value, right.effective_date, right.end_date);
+}
+
+}
+
+void RateDictionary::add(const Rate &rate) {
+    if (_frozen) {
+        throw std::logic_error("RateDictionary is frozen");
+    }
+    if (!rate.is_empty()) {
+        _rates.push_back(rate);
+    }
+}
+
+void RateDictionary::add(const VendorTree &tree) {
+    class Collect {
+    public:
+        Collect(RateDictionary &_dictionary) :
+            dictionary(_dictionary)
+        {}
+        bool visit(const VendorTree::node_t &node) {
+            dictionary.add(node.data());
+            return true;
+        }
+        RateDictionary &dictionary;
+    } collect { *this };
+    tree.accept(collect);
+}
+
+void RateDictionary::freeze() {
+    if (_frozen) {
+        return;
+    }
+    std::sort(_rates.begin(), _rates.end(), rate_less);
+    _rates.erase(std::unique(_rates.begin(), _rates.end(), same_data), _rates.end());
+    _rates.shrink_to_fit();
+    if (_rates.size() >= empty_id) {
+        throw std::length_error("Too many rates for RateDictionary");
+    }
+    _frozen = true;
+}
+
+RateDictionary::rate_id_t RateDictionary::id(const Rate &rate) const {
+    if (rate.is_empty()) {
+        return empty_id;
+    }
+    if (!_frozen) {
+        throw std::logic_error("RateDictionary is not frozen");
+    }
+    auto found = std::lower_bound(_rates.begin(), _rates.end(), rate, rate_less);
+    if (found == _rates.end() || !same_data(*found, rate)) {
+        throw std::out_of_range("Rate is not in RateDictionary");
+    }
+    return rate_id_t(found - _rates.begin());
+}
+
+}
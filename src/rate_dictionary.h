@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "rate.h"
+#include "vendor_tree.h"
+
+namespace code_directory {
+
+/**
+ * \brief Shared table of distinct (rate, effective_date, end_date) tuples.
+ *
+ * Decks of all vendors together use a few thousand distinct rates, so
+ * payloads can be stored as a 4-byte index into this table instead of a
+ * 24-byte Rate. Rates are added first, then freeze sorts the table and
+ * assigns ids.
+ *
+ * The table is sorted by rate, then by dates, so ids keep rate order:
+ * rate(a).rate < rate(b).rate implies a < b, and the minimal id of a set
+ * has its minimal rate. empty_id is above all ids, as an empty rate_string
+ * is above all rates. Min and max can be found over ids without decoding.
+ */
+class RateDictionary {
+public:
+    typedef std::uint32_t rate_id_t;
+    static constexpr rate_id_t empty_id = std::numeric_limits<rate_id_t>::max();
+
+    RateDictionary() :
+        _frozen(false)
+    {}
+
+    /// Adds a rate before freeze; empty rates are not stored
+    void add(const Rate &rate);
+    /// Adds all rates of \p tree
+    void add(const VendorTree &tree);
+    /// Sorts the table and drops duplicates; nothing can be added after
+    void freeze();
+
+    bool frozen() const {
+        return _frozen;
+    }
+    /// Count of distinct rates
+    size_t size() const {
+        return _rates.size();
+    }
+
+    /// Id of \p rate or empty_id for an empty one. Throws std::out_of_range if not in table.
+    rate_id_t id(const Rate &rate) const;
+
+    const Rate &rate(rate_id_t id) const {
+        return id == empty_id ? _empty : _rates[id];
+    }
+
+    size_t memory_usage() const {
+        return _rates.capacity() * sizeof(Rate);
+    }
+
+private:
+    std::vector<Rate> _rates;
+    bool _frozen;
+    Rate _empty;
+};
+
+}
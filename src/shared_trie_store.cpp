@@ -0,0 +1,139 @@
+#include "shared_trie_store.h"
+
+namespace code_directory {
+
+namespace {
+
+std::uint64_t mix(std::uint64_t hash, std::uint64_t value) {
+    // FNV-1a step over whole words
+    return (hash ^ value) * 1099511628211ull;
+}
+
+}
+
+SharedTrieStore::SharedTrieStore() :
+    _logical_nodes(0),
+    _child_links(0)
+{
+}
+
+SharedTrieStore::~SharedTrieStore() {
+    for (auto &node: _nodes) {
+        delete node.second;
+    }
+}
+
+SharedTrieStore::root_pointer_t SharedTrieStore::intern(const VendorTree &tree) {
+    std::lock_guard<std::mutex> lock(_lock);
+    size_t count = 0;
+    const node_t *root = intern_node(tree.root(), &count);
+    _logical_nodes += count;
+    return root_pointer_t(root, [this, count](const node_t *node) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _logical_nodes -= count;
+        release(node);
+    });
+}
+
+const SharedTrieStore::node_t *SharedTrieStore::intern_node(const VendorTree::node_t &node,
+                                                            size_t *count) {
+    ++*count;
+    std::unique_ptr<node_t> candidate{new node_t};
+    candidate->_child_mask = node.child_mask();
+    candidate->_references = 1;
+    candidate->_children.reserve(node.children_count());
+
+    std::uint64_t hash = 14695981039346656037ull;
+    if (!node.data().is_empty()) {
+        candidate->_data = node.data();
+        hash = mix(hash, node.data().rate.value);
+        hash = mix(hash, node.data().effective_date);
+        hash = mix(hash, node.data().end_date);
+    }
+    hash = mix(hash, node.child_mask());
+    for (size_t index = 0; index < 10; ++index) {
+        auto child = node.get_child(index);
+        if (child != nullptr) {
+            auto shared = intern_node(*child, count);
+            candidate->_children.push_back(shared);
+            hash = mix(hash, reinterpret_cast<std::uintptr_t>(shared));
+        }
+    }
+    candidate->_hash = hash;
+
+    auto range = _nodes.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        node_t *existing = it->second;
+        if (existing->_child_mask == candidate->_child_mask &&
+            existing->_children == candidate->_children &&
+            same_data(existing->_data, candidate->_data)) {
+            ++existing->_references;
+            // Existing node already references the same children
+            for (auto child: candidate->_children) {
+                release(child);
+            }
+            return existing;
+        }
+    }
+    _child_links += candidate->_children.size();
+    node_t *inserted = candidate.release();
+    _nodes.emplace(hash, inserted);
+    return inserted;
+}
+
+void SharedTrieStore::release(const node_t *node) {
+    node_t *owned = const_cast<node_t *>(node);
+    if (--owned->_references != 0) {
+        return;
+    }
+    auto range = _nodes.equal_range(owned->_hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == owned) {
+            _nodes.erase(it);
+            break;
+        }
+    }
+    _child_links -= owned->_children.size();
+    for (auto child: owned->_children) {
+        release(child);
+    }
+    delete owned;
+}
+
+SharedTrieStore::stats_s SharedTrieStore::stats() const {
+    std::lock_guard<std::mutex> lock(_lock);
+    stats_s ret;
+    ret.logical_nodes = _logical_nodes;
+    ret.unique_nodes = _nodes.size();
+    ret.bytes_used = _nodes.size() * (sizeof(node_t) + sizeof(decltype(_nodes)::value_type)) +
+                     _child_links * sizeof(const node_t *);
+    size_t separate = _logical_nodes * sizeof(VendorTree::node_t);
+    ret.bytes_saved = separate > ret.bytes_used ? separate - ret.bytes_used : 0;
+    return ret;
+}
+
+rate_string SharedTrieStore::get_maximum_prefix_rate(const node_t &root, const code_string &code) {
+    const node_t *cur = &root;
+    rate_string ret = root.data().rate;
+    for (size_t index = 0; index < code.length(); ++index) {
+        cur = cur->get_child(code[index]);
+        if (cur == nullptr) {
+            break;
+        }
+        if (!cur->data().is_empty()) {
+            ret = cur->data().rate;
+        }
+    }
+    return ret;
+}
+
+const SharedTrieStore::node_t *SharedTrieStore::exactly_matching_node(const node_t &root,
+                                                                      const code_string &code) {
+    const node_t *cur = &root;
+    for (size_t index = 0; index < code.length() && cur != nullptr; ++index) {
+        cur = cur->get_child(code[index]);
+    }
+    return cur;
+}
+
+}
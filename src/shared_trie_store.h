@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+#include "prefix_tree.h"
+#include "rate.h"
+#include "types.h"
+#include "vendor_tree.h"
+
+namespace code_directory {
+
+/**
+ * \brief Node of SharedTrieStore.
+ *
+ * Unlike Node it has no code and no parent, so one node can be reached from
+ * many places: the same subtree under different codes or in different
+ * vendor trees is stored once. Only occupied child slots are stored.
+ */
+class SharedNode {
+public:
+    SharedNode(const SharedNode &) = delete;
+
+    const Rate &data() const {
+        return _data;
+    }
+
+    child_mask_t child_mask() const {
+        return _child_mask;
+    }
+
+    const SharedNode *get_child(size_t index) const {
+        if ((_child_mask & (1u << index)) == 0) {
+            return nullptr;
+        }
+        return _children[__builtin_popcount(_child_mask & ((1u << index) - 1))];
+    }
+
+private:
+    friend class SharedTrieStore;
+    SharedNode() = default;
+
+    Rate _data;
+    child_mask_t _child_mask;
+    /// Count of parents and roots referencing this node
+    std::uint32_t _references;
+    std::uint64_t _hash;
+    std::vector<const SharedNode *> _children;
+};
+
+/**
+ * \brief Hash-consed store of immutable vendor trees.
+ *
+ * Trees are interned bottom-up: a node is looked up by its data and its
+ * already interned children, and reused if an identical one exists.
+ * Structurally identical subtrees are therefore shared across all trees in
+ * the store, which turns them into one DAG.
+ *
+ * Interning and releasing are serialized by a mutex; interned nodes are
+ * immutable and can be read concurrently without locking.
+ * The store must outlive all roots it returned.
+ */
+class SharedTrieStore {
+public:
+    typedef SharedNode node_t;
+    /// Owning handle to an interned tree; releases its nodes when destroyed
+    typedef boost::shared_ptr<const node_t> root_pointer_t;
+
+    struct stats_s {
+        /// Nodes in all interned trees if they were stored separately
+        size_t logical_nodes;
+        /// Nodes actually stored
+        size_t unique_nodes;
+        size_t bytes_used;
+        /// Memory of separate VendorTree nodes minus bytes_used
+        size_t bytes_saved;
+    };
+
+    SharedTrieStore();
+    SharedTrieStore(const SharedTrieStore &) = delete;
+    ~SharedTrieStore();
+
+    root_pointer_t intern(const VendorTree &tree);
+
+    stats_s stats() const;
+
+    /// Same as VendorTree::get_maximum_prefix_rate for interned tree \p root
+    static rate_string get_maximum_prefix_rate(const node_t &root, const code_string &code);
+
+    /// Node for exactly \p code or nullptr
+    static const node_t *exactly_matching_node(const node_t &root, const code_string &code);
+
+private:
+    const node_t *intern_node(const VendorTree::node_t &node, size_t *count);
+    void release(const node_t *node);
+
+    mutable std::mutex _lock;
+    std::unordered_multimap<std::uint64_t, node_t *> _nodes;
+    size_t _logical_nodes;
+    size_t _child_links;
+};
+
+}
@@ -0,0 +1,599 @@
+#include "shm_directory.h"
+
+#include <atomic>
+#include <cerrno>
+#include <system_error>
+#include <type_traits>
+#include <boost/smart_ptr/make_shared.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "static_index.h"
+
+namespace code_directory {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Generation counter must be lock-free to live in shared memory");
+static_assert(std::is_trivially_copyable<rate_string>::value, "rate_string is copied to shared memory as is");
+
+struct shm_control_s {
+    std::uint64_t magic;
+    std::atomic<std::uint64_t> generation;
+};
+
+namespace {
+
+typedef StaticVendorIndex::key_t key_t;
+typedef std::uint32_t index_t;
+
+constexpr std::uint64_t CONTROL_MAGIC = 0x6c6f72746e6f6364;
+constexpr std::uint64_t SEGMENT_MAGIC = 0x746e656d67657364;
+constexpr index_t npos = std::numeric_limits<index_t>::max();
+constexpr key_t key_space = pow10(MAX_CODE_LENGTH);
+
+/*
+ * Segment layout: header_s, then arrays at offsets from the segment start.
+ * Vendors are sorted by id, codenames by name. Codes of the codename tree
+ * and rates of each vendor are in code order: by key, then by length.
+ */
+struct header_s {
+    std::uint64_t magic;
+    std::uint64_t generation;
+    std::uint64_t size;
+    std::uint64_t vendor_count, vendors;
+    std::uint64_t rate_count, rates;
+    std::uint64_t codename_count, codenames;
+    std::uint64_t code_count, codes;
+    /// Indexes of codes of each codename, ascending
+    std::uint64_t ref_count, refs;
+    std::uint64_t names_size, names;
+};
+
+struct vendor_s {
+    VendorId id;
+    /// Zero for a removed vendor
+    std::uint32_t present;
+    std::uint64_t rates_first;
+    std::uint64_t rates_count;
+};
+
+struct rate_s {
+    key_t key;
+    rate_string rate;
+    time_t effective_date;
+    time_t end_date;
+    std::uint8_t length;
+};
+
+struct codename_s {
+    std::uint64_t name_first;
+    std::uint32_t name_length;
+    index_t refs_first;
+    index_t refs_count;
+};
+
+struct code_s {
+    key_t key;
+    /// Longest shorter code that is a prefix, or npos
+    index_t parent;
+    index_t codename;
+    std::uint8_t length;
+};
+
+std::string segment_name(const std::string &name, std::uint64_t generation) {
+    return name + "." + std::to_string(generation);
+}
+
+std::system_error shm_error(const std::string &what) {
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+bool is_prefix(key_t key, size_t length, key_t code_key, size_t code_length) {
+    auto scale = pow10(MAX_CODE_LENGTH - length);
+    return length <= code_length && key / scale == code_key / scale;
+}
+
+template<class Entry>
+bool less_code(const Entry &entry, key_t key, size_t length) {
+    return entry.key < key || (entry.key == key && entry.length < length);
+}
+
+template<class T>
+std::uint64_t append(std::vector<char> &buffer, const std::vector<T> &items) {
+    buffer.resize((buffer.size() + 7) & ~size_t(7));
+    auto offset = buffer.size();
+    buffer.resize(offset + items.size() * sizeof(T));
+    if (!items.empty()) {
+        std::memcpy(&buffer[offset], items.data(), items.size() * sizeof(T));
+    }
+    return offset;
+}
+
+void check_name(const std::string &name) {
+    if (name.length() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos) {
+        throw std::invalid_argument("Shared memory name must be '/' followed by a file name");
+    }
+}
+
+}
+
+ShmDirectoryPublisher::ShmDirectoryPublisher(const std::string &name) :
+    _name(name),
+    _control(nullptr)
+{
+    check_name(name);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw shm_error("shm_open " + name);
+    }
+    struct stat status;
+    bool created = fstat(fd, &status) == 0 && status.st_size == 0;
+    if (created && ftruncate(fd, sizeof(shm_control_s)) != 0) {
+        auto error = shm_error("ftruncate " + name);
+        close(fd);
+        throw error;
+    }
+    void *memory = mmap(nullptr, sizeof(shm_control_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        throw shm_error("mmap " + name);
+    }
+    _control = static_cast<shm_control_s *>(memory);
+    if (created) {
+        _control->generation.store(0);
+        _control->magic = CONTROL_MAGIC;
+    } else if (_control->magic != CONTROL_MAGIC) {
+        munmap(_control, sizeof(shm_control_s));
+        throw std::runtime_error("Not a code directory: " + name);
+    }
+}
+
+ShmDirectoryPublisher::~ShmDirectoryPublisher() {
+    // Latest generation stays published for workers and the next loader
+    munmap(_control, sizeof(shm_control_s));
+}
+
+void ShmDirectoryPublisher::set_vendor_tree(VendorId vendor, CodeDirectory::tree_pointer_t tree) {
+    _vendors[vendor] = tree;
+}
+
+void ShmDirectoryPublisher::set_codename_tree(CodeDirectory::codename_pointer_t tree) {
+    _codenames = tree;
+}
+
+void ShmDirectoryPublisher::remove_vendor(VendorId vendor) {
+    auto found = _vendors.find(vendor);
+    if (found != _vendors.end()) {
+        found->second.reset();
+    }
+}
+
+std::uint64_t ShmDirectoryPublisher::publish() {
+    const auto generation = _control->generation.load() + 1;
+
+    // Codes of the codename tree; pre-order visit yields code order
+    std::vector<code_s> codes;
+    std::vector<codename_t> code_names;
+    if (_codenames) {
+        class Collect {
+        public:
+            Collect(std::vector<code_s> &_codes, std::vector<codename_t> &_names) :
+                codes(_codes),
+                names(_names)
+            {}
+            bool visit(const CodenameTree::node_t &node) {
+                if (!is_empty(node.data())) {
+                    const auto &code = node.code();
+                    while (!open.empty() &&
+                           !is_prefix(codes[open.back()].key, codes[open.back()].length,
+                                      StaticVendorIndex::make_key(code), code.length())) {
+                        open.pop_back();
+                    }
+                    codes.push_back({ StaticVendorIndex::make_key(code),
+                                      open.empty() ? npos : open.back(),
+                                      npos,
+                                      std::uint8_t(code.length()) });
+                    names.push_back(node.data());
+                    open.push_back(codes.size() - 1);
+                }
+                return true;
+            }
+            std::vector<code_s> &codes;
+            std::vector<codename_t> &names;
+            std::vector<index_t> open;
+        } collect { codes, code_names };
+        _codenames->root().accept(collect);
+    }
+    auto find_code = [&codes](const code_string &code) {
+        auto key = StaticVendorIndex::make_key(code);
+        auto found = std::lower_bound(codes.begin(), codes.end(), code, [key](const code_s &entry, const code_string &code) {
+            return less_code(entry, key, code.length());
+        });
+        return index_t(found - codes.begin());
+    };
+
+    // Codenames as listed by the tree, even if all their codes were taken over
+    std::vector<codename_t> sorted_names;
+    if (_codenames) {
+        sorted_names = _codenames->list_codenames();
+    }
+    std::sort(sorted_names.begin(), sorted_names.end());
+    std::vector<codename_s> codenames;
+    std::vector<index_t> refs;
+    std::vector<char> names;
+    for (const auto &name: sorted_names) {
+        codename_s entry { names.size(), std::uint32_t(name.length()), index_t(refs.size()), 0 };
+        names.insert(names.end(), name.begin(), name.end());
+        auto first = refs.size();
+        for (const auto &code: _codenames->codes_for_name(name)) {
+            refs.push_back(find_code(code));
+        }
+        std::sort(refs.begin() + first, refs.end());
+        entry.refs_count = refs.size() - first;
+        codenames.push_back(entry);
+    }
+    for (index_t index = 0; index < codes.size(); ++index) {
+        auto found = std::lower_bound(sorted_names.begin(), sorted_names.end(), code_names[index]);
+        codes[index].codename = found - sorted_names.begin();
+    }
+
+    std::vector<vendor_s> vendors;
+    std::vector<rate_s> rates;
+    for (const auto &vendor: _vendors) {
+        vendor_s entry { vendor.first, vendor.second ? 1u : 0u, rates.size(), 0 };
+        if (vendor.second) {
+            class Collect {
+            public:
+                Collect(std::vector<rate_s> &_rates) :
+                    rates(_rates)
+                {}
+                bool visit(const VendorTree::node_t &node) {
+                    if (!is_empty(node.data())) {
+                        const auto &data = node.data();
+                        rates.push_back({ StaticVendorIndex::make_key(node.code()),
+                                          data.rate,
+                                          data.effective_date,
+                                          data.end_date,
+                                          std::uint8_t(node.code().length()) });
+                    }
+                    return true;
+                }
+                std::vector<rate_s> &rates;
+            } collect { rates };
+            vendor.second->accept(collect);
+        }
+        entry.rates_count = rates.size() - entry.rates_first;
+        vendors.push_back(entry);
+    }
+
+    header_s header;
+    std::vector<char> buffer(sizeof(header));
+    header.magic = SEGMENT_MAGIC;
+    header.generation = generation;
+    header.vendor_count = vendors.size();
+    header.vendors = append(buffer, vendors);
+    header.rate_count = rates.size();
+    header.rates = append(buffer, rates);
+    header.codename_count = codenames.size();
+    header.codenames = append(buffer, codenames);
+    header.code_count = codes.size();
+    header.codes = append(buffer, codes);
+    header.ref_count = refs.size();
+    header.refs = append(buffer, refs);
+    header.names_size = names.size();
+    header.names = append(buffer, names);
+    header.size = buffer.size();
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    // A leftover of a crashed loader is never the published generation
+    const auto segment = segment_name(_name, generation);
+    int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw shm_error("shm_open " + segment);
+    }
+    if (ftruncate(fd, buffer.size()) != 0) {
+        auto error = shm_error("ftruncate " + segment);
+        close(fd);
+        shm_unlink(segment.c_str());
+        throw error;
+    }
+    void *memory = mmap(nullptr, buffer.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        auto error = shm_error("mmap " + segment);
+        shm_unlink(segment.c_str());
+        throw error;
+    }
+    std::memcpy(memory, buffer.data(), buffer.size());
+    munmap(memory, buffer.size());
+
+    _control->generation.store(generation, std::memory_order_release);
+    // Workers that read the previous number may be opening it right now
+    if (generation > 2) {
+        shm_unlink(segment_name(_name, generation - 2).c_str());
+    }
+    return generation;
+}
+
+void ShmDirectoryPublisher::remove(const std::string &name) {
+    check_name(name);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return;
+    }
+    void *memory = mmap(nullptr, sizeof(shm_control_s), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory != MAP_FAILED) {
+        auto generation = static_cast<const shm_control_s *>(memory)->generation.load();
+        munmap(memory, sizeof(shm_control_s));
+        for (auto old = generation; old > 0 && old + 2 > generation; --old) {
+            shm_unlink(segment_name(name, old).c_str());
+        }
+    }
+    shm_unlink(name.c_str());
+}
+
+
+struct ShmDirectory::mapping_s {
+    mapping_s(std::uint64_t _generation, const char *_base, size_t _size) :
+        generation(_generation),
+        base(_base),
+        size(_size)
+    {}
+    ~mapping_s() {
+        if (base != nullptr) {
+            munmap(const_cast<char *>(base), size);
+        }
+    }
+
+    const header_s &header() const {
+        return *reinterpret_cast<const header_s *>(base);
+    }
+    template<class T>
+    const T *array(std::uint64_t offset) const {
+        return reinterpret_cast<const T *>(base + offset);
+    }
+    const vendor_s *vendors_begin() const {
+        return base ? array<vendor_s>(header().vendors) : nullptr;
+    }
+    const vendor_s *vendors_end() const {
+        return base ? vendors_begin() + header().vendor_count : nullptr;
+    }
+
+    /// Throws std::out_of_range like CodeDirectory
+    const vendor_s &vendor(VendorId id) const {
+        auto found = std::lower_bound(vendors_begin(), vendors_end(), id, [](const vendor_s &vendor, VendorId id) {
+            return vendor.id < id;
+        });
+        if (found == vendors_end() || found->id != id) {
+            throw std::out_of_range("Vendor not found");
+        }
+        return *found;
+    }
+
+    codename_t name(const codename_s &codename) const {
+        return codename_t(array<char>(header().names) + codename.name_first, codename.name_length);
+    }
+
+    /// Throws std::out_of_range like CodenameTree
+    index_t codename(const codename_t &name) const {
+        if (base != nullptr) {
+            auto begin = array<codename_s>(header().codenames);
+            auto end = begin + header().codename_count;
+            auto found = std::lower_bound(begin, end, name, [this](const codename_s &codename, const codename_t &name) {
+                return this->name(codename) < name;
+            });
+            if (found != end && this->name(*found) == name) {
+                return found - begin;
+            }
+        }
+        throw std::out_of_range(std::string("Can't find codename ") + name);
+    }
+
+    /// Codename of the longest codename code that is a prefix of the code
+    index_t classify(key_t key, size_t length) const {
+        auto begin = array<code_s>(header().codes);
+        auto end = begin + header().code_count;
+        // Longest prefix is the last code before this one or one of its parents
+        auto found = std::lower_bound(begin, end, length + 1, [key](const code_s &code, size_t length) {
+            return less_code(code, key, length);
+        });
+        index_t index = found == begin ? npos : index_t(found - begin - 1);
+        while (index != npos && !is_prefix(begin[index].key, begin[index].length, key, length)) {
+            index = begin[index].parent;
+        }
+        return index == npos ? npos : begin[index].codename;
+    }
+
+    /// Calls visitor(rate) for every rate of the vendor classified as the codename
+    template<class Visitor>
+    void for_each_rate(const vendor_s &vendor, index_t codename, Visitor visitor) const {
+        const auto &entry = array<codename_s>(header().codenames)[codename];
+        auto refs = array<index_t>(header().refs) + entry.refs_first;
+        auto codes = array<code_s>(header().codes);
+        auto rates_begin = array<rate_s>(header().rates) + vendor.rates_first;
+        auto rates_end = rates_begin + vendor.rates_count;
+
+        // Codes are ascending, so a code under the last taken one is covered
+        const code_s *covered = nullptr;
+        for (index_t i = 0; i < entry.refs_count; ++i) {
+            if (refs[i] >= header().code_count) {
+                continue;
+            }
+            const auto &code = codes[refs[i]];
+            if (covered != nullptr && is_prefix(covered->key, covered->length, code.key, code.length)) {
+                continue;
+            }
+            covered = &code;
+            auto rate = std::lower_bound(rates_begin, rates_end, code, [](const rate_s &rate, const code_s &code) {
+                return less_code(rate, code.key, code.length);
+            });
+            const auto last = code.key + pow10(MAX_CODE_LENGTH - code.length);
+            for (; rate != rates_end && rate->key < last; ++rate) {
+                if (classify(rate->key, rate->length) == codename) {
+                    visitor(*rate);
+                }
+            }
+        }
+    }
+
+    std::uint64_t generation;
+    const char *base;
+    size_t size;
+};
+
+ShmDirectory::ShmDirectory(const std::string &name) :
+    _name(name),
+    _control(nullptr)
+{
+    check_name(name);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw shm_error("shm_open " + name);
+    }
+    void *memory = mmap(nullptr, sizeof(shm_control_s), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        throw shm_error("mmap " + name);
+    }
+    _control = static_cast<const shm_control_s *>(memory);
+    if (_control->magic != CONTROL_MAGIC) {
+        munmap(memory, sizeof(shm_control_s));
+        throw std::runtime_error("Not a code directory: " + name);
+    }
+}
+
+ShmDirectory::~ShmDirectory() {
+    munmap(const_cast<shm_control_s *>(_control), sizeof(shm_control_s));
+}
+
+std::uint64_t ShmDirectory::generation() const {
+    return current()->generation;
+}
+
+ShmDirectory::mapping_pointer_t ShmDirectory::current() const {
+    auto generation = _control->generation.load(std::memory_order_acquire);
+    auto mapping = boost::atomic_load(&_mapping);
+    if (mapping && mapping->generation >= generation) {
+        return mapping;
+    }
+
+    std::lock_guard<std::mutex> lock(_attach_lock);
+    mapping = boost::atomic_load(&_mapping);
+    if (mapping && mapping->generation >= generation) {
+        return mapping;
+    }
+    while (generation != 0) {
+        const auto segment = segment_name(_name, generation);
+        int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            // Loader went two generations ahead and unlinked this one
+            auto latest = _control->generation.load(std::memory_order_acquire);
+            if (errno == ENOENT && latest != generation) {
+                generation = latest;
+                continue;
+            }
+            throw shm_error("shm_open " + segment);
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(header_s)) {
+            close(fd);
+            throw std::runtime_error("Broken code directory segment " + segment);
+        }
+        void *memory = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            throw shm_error("mmap " + segment);
+        }
+        mapping = boost::make_shared<mapping_s>(generation, static_cast<const char *>(memory), status.st_size);
+        if (mapping->header().magic != SEGMENT_MAGIC ||
+            mapping->header().generation != generation ||
+            mapping->header().size != mapping->size) {
+            throw std::runtime_error("Broken code directory segment " + segment);
+        }
+        break;
+    }
+    if (generation == 0) {
+        mapping = boost::make_shared<mapping_s>(0, nullptr, 0);
+    }
+    // Queries running on the previous mapping keep it until they finish
+    boost::atomic_store(&_mapping, mapping);
+    return mapping;
+}
+
+CodeDirectory::rates_result_t ShmDirectory::get_rates(VendorId vendor,
+                                                      const codename_t &code_name,
+                                                      rate_string *min_rate,
+                                                      rate_string *max_rate) const {
+    auto mapping = current();
+    const auto &entry = mapping->vendor(vendor);
+
+    CodeDirectory::rates_result_t result;
+    rate_summary_s summary;
+    if (entry.present) {
+        mapping->for_each_rate(entry, mapping->codename(code_name), [&](const rate_s &rate) {
+            auto digits = std::to_string(rate.key + key_space).substr(1, rate.length);
+            result.emplace_back(code_string{digits.c_str()}, rate.rate);
+            summary.add(rate.rate);
+        });
+    }
+    if (min_rate != nullptr) {
+        *min_rate = summary.min;
+    }
+    if (max_rate != nullptr) {
+        *max_rate = summary.max;
+    }
+    return result;
+}
+
+CodeDirectory::rates_result_t ShmDirectory::get_rates(const std::string &vendor,
+                                                      const std::string &code_name,
+                                                      rate_string *min_rate,
+                                                      rate_string *max_rate) const {
+    return get_rates(str_to_vendor(vendor), code_name, min_rate, max_rate);
+}
+
+std::vector<VendorId> ShmDirectory::list_vendors() const {
+    auto mapping = current();
+    std::vector<VendorId> ret;
+    for (auto vendor = mapping->vendors_begin(); vendor != mapping->vendors_end(); ++vendor) {
+        ret.push_back(vendor->id);
+    }
+    return ret;
+}
+
+std::vector<std::string> ShmDirectory::list_codenames() const {
+    auto mapping = current();
+    std::vector<std::string> ret;
+    if (mapping->base != nullptr) {
+        auto codenames = mapping->array<codename_s>(mapping->header().codenames);
+        for (size_t i = 0; i < mapping->header().codename_count; ++i) {
+            ret.push_back(mapping->name(codenames[i]));
+        }
+    }
+    return ret;
+}
+
+CodeDirectory::vendors_result_t ShmDirectory::get_vendors(const codename_t &code_name) const {
+    auto mapping = current();
+    // Throws for unknown codename, same as get_rates
+    auto codename = mapping->codename(code_name);
+
+    CodeDirectory::vendors_result_t result;
+    for (auto vendor = mapping->vendors_begin(); vendor != mapping->vendors_end(); ++vendor) {
+        if (!vendor->present) {
+            continue;
+        }
+        rate_summary_s summary;
+        mapping->for_each_rate(*vendor, codename, [&summary](const rate_s &rate) {
+            summary.add(rate.rate);
+        });
+        if (summary.count != 0) {
+            result.emplace_back(vendor->id, summary.min, summary.max);
+        }
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+#include "code_directory.h"
+#include "types.h"
+
+namespace code_directory {
+
+/*
+ * Directory in POSIX shared memory, for several worker processes on a host.
+ *
+ * Every generation of the directory is a separate segment "<name>.<N>" with
+ * flat position-independent arrays. Segment "<name>" holds an atomic number
+ * of the latest generation. A loader writes the whole next segment, then
+ * stores its number; workers see the new number and map the new segment.
+ * An old segment is unlinked two generations later: its memory stays valid
+ * while some worker still maps it and is freed by the kernel after the last
+ * munmap.
+ */
+
+/// Header segment with the latest generation number
+struct shm_control_s;
+
+/**
+ * \brief Loader side: collects trees and publishes them as generations.
+ *
+ * Not thread-safe; meant for a single loader process per name.
+ */
+class ShmDirectoryPublisher {
+public:
+    /**
+     * \param name Shared memory name, starting with '/'.
+     *        Generation numbering continues from a previous loader with the
+     *        same name, so attached workers never go back.
+     */
+    explicit ShmDirectoryPublisher(const std::string &name);
+    ~ShmDirectoryPublisher();
+
+    ShmDirectoryPublisher(const ShmDirectoryPublisher &) = delete;
+    ShmDirectoryPublisher &operator=(const ShmDirectoryPublisher &) = delete;
+
+    /// Changes are seen by workers after the next publish()
+    void set_vendor_tree(VendorId vendor, CodeDirectory::tree_pointer_t tree);
+    void set_codename_tree(CodeDirectory::codename_pointer_t tree);
+    void remove_vendor(VendorId vendor);
+
+    /// Writes current trees as a new generation; returns its number
+    std::uint64_t publish();
+
+    /// Unlinks every segment of \p name; attached workers keep their mappings
+    static void remove(const std::string &name);
+
+private:
+    std::string _name;
+    shm_control_s *_control;
+    std::map<VendorId, CodeDirectory::tree_pointer_t> _vendors;
+    CodeDirectory::codename_pointer_t _codenames;
+};
+
+/**
+ * \brief Worker side: read-only directory attached to shared memory.
+ *
+ * Every query checks the generation counter and switches to the latest
+ * generation first. Results are the same as of CodeDirectory with the same
+ * trees; vendors and codenames are listed in sorted order.
+ */
+class ShmDirectory {
+public:
+    /// Throws std::system_error if nothing was published under \p name
+    explicit ShmDirectory(const std::string &name);
+    ~ShmDirectory();
+
+    ShmDirectory(const ShmDirectory &) = delete;
+    ShmDirectory &operator=(const ShmDirectory &) = delete;
+
+    /// Generation used by the next query; 0 until the first publish
+    std::uint64_t generation() const;
+
+    CodeDirectory::rates_result_t get_rates(VendorId vendor,
+                                            const codename_t &code_name,
+                                            rate_string *min_rate,
+                                            rate_string *max_rate) const;
+    CodeDirectory::rates_result_t get_rates(const std::string &vendor,
+                                            const std::string &code_name,
+                                            rate_string *min_rate,
+                                            rate_string *max_rate) const;
+
+    std::vector<VendorId> list_vendors() const;
+    std::vector<std::string> list_codenames() const;
+
+    CodeDirectory::vendors_result_t get_vendors(const codename_t &code_name) const;
+
+private:
+    struct mapping_s;
+    typedef boost::shared_ptr<const mapping_s> mapping_pointer_t;
+
+    /// Mapping of the latest generation
+    mapping_pointer_t current() const;
+
+    std::string _name;
+    const shm_control_s *_control;
+    mutable std::mutex _attach_lock;
+    mutable mapping_pointer_t _mapping;
+};
+
+}
@@ -0,0 +1,149 @@
+#include "static_index.h"
+
+#include <algorithm>
+
+namespace code_directory {
+
+namespace {
+
+constexpr StaticVendorIndex::key_t key_space = pow10(MAX_CODE_LENGTH);
+
+/// Fills Eytzinger layout \p out (1-based) from sorted \p in
+template<class T>
+size_t eytzinger(const std::vector<T> &in, std::vector<T> &out, size_t i = 0, size_t k = 1) {
+    if (k <= in.size()) {
+        i = eytzinger(in, out, i, 2 * k);
+        out[k] = in[i++];
+        i = eytzinger(in, out, i, 2 * k + 1);
+    }
+    return i;
+}
+
+}
+
+StaticVendorIndex::key_t StaticVendorIndex::make_key(const code_string &code) {
+    key_t key = 0;
+    for (size_t i = 0; i < code.length(); ++i) {
+        key = key * 10 + code[i];
+    }
+    return key * pow10(MAX_CODE_LENGTH - code.length());
+}
+
+StaticVendorIndex::StaticVendorIndex(const VendorTree &tree) {
+    // Pre-order visit of the tree yields codes in code order
+    class Collect {
+    public:
+        Collect(StaticVendorIndex &_index) :
+            index(_index)
+        {}
+        bool visit(const VendorTree::node_t &node) {
+            if (!is_empty(node.data())) {
+                index._keys.push_back(make_key(node.code()));
+                index._lengths.push_back(node.code().length());
+                index._rates.push_back(node.data());
+            }
+            return true;
+        }
+        StaticVendorIndex &index;
+    } collect { *this };
+    tree.accept(collect);
+
+    // Sweep over nested code ranges with a stack of open ones
+    std::vector<key_t> starts;
+    std::vector<index_t> owners;
+    auto start_segment = [&](key_t start, index_t owner) {
+        if (!starts.empty() && starts.back() == start) {
+            owners.back() = owner;
+        } else {
+            starts.push_back(start);
+            owners.push_back(owner);
+        }
+    };
+    auto range_end = [this](index_t index) {
+        return _keys[index] + pow10(MAX_CODE_LENGTH - _lengths[index]);
+    };
+    std::vector<index_t> open;
+    auto close_until = [&](key_t key) {
+        while (!open.empty() && range_end(open.back()) <= key) {
+            auto end = range_end(open.back());
+            open.pop_back();
+            if (end < key_space) {
+                start_segment(end, open.empty() ? npos : open.back());
+            }
+        }
+    };
+    _parents.reserve(_keys.size());
+    for (index_t index = 0; index < _keys.size(); ++index) {
+        close_until(_keys[index]);
+        _parents.push_back(open.empty() ? npos : open.back());
+        open.push_back(index);
+        start_segment(_keys[index], index);
+    }
+    close_until(key_space);
+
+    // Boundary i is the start of segment i; key_space closes the last one
+    std::vector<key_t> boundaries(starts);
+    std::vector<index_t> owners_before;
+    owners_before.reserve(starts.size() + 1);
+    owners_before.push_back(npos);
+    owners_before.insert(owners_before.end(), owners.begin(), owners.end());
+    boundaries.push_back(key_space);
+
+    _boundaries.resize(boundaries.size() + 1);
+    _owners.resize(boundaries.size() + 1);
+    eytzinger(boundaries, _boundaries);
+    eytzinger(owners_before, _owners);
+}
+
+code_string StaticVendorIndex::code(index_t index) const {
+    auto digits = std::to_string(_keys[index] + key_space).substr(1, _lengths[index]);
+    return code_string{digits.c_str()};
+}
+
+StaticVendorIndex::index_t StaticVendorIndex::max_match(const code_string &code) const {
+    const key_t key = make_key(code);
+    // Find the first boundary above key; numbers below it belong to its owner
+    const size_t count = _boundaries.size() - 1;
+    size_t k = 1;
+    while (k <= count) {
+        prefetch(&_boundaries[std::min(16 * k, count)]);
+        k = 2 * k + (_boundaries[k] <= key);
+    }
+    k >>= __builtin_ffsll(~k);
+    index_t found = _owners[k];
+    // Longer codes may cover the padded key; only prefixes of code count
+    while (found != npos && _lengths[found] > code.length()) {
+        found = _parents[found];
+    }
+    return found;
+}
+
+std::pair<StaticVendorIndex::index_t, StaticVendorIndex::index_t>
+StaticVendorIndex::prefix_range(const code_string &prefix) const {
+    const key_t first = make_key(prefix);
+    const key_t last = first + pow10(MAX_CODE_LENGTH - prefix.length());
+    // Codes are ordered by key, then by length
+    index_t begin = 0, end = _keys.size();
+    while (begin < end) {
+        index_t middle = begin + (end - begin) / 2;
+        if (_keys[middle] < first ||
+            (_keys[middle] == first && _lengths[middle] < prefix.length())) {
+            begin = middle + 1;
+        } else {
+            end = middle;
+        }
+    }
+    auto stop = std::lower_bound(_keys.begin() + begin, _keys.end(), last);
+    return { begin, index_t(stop - _keys.begin()) };
+}
+
+size_t StaticVendorIndex::memory_usage() const {
+    return _keys.capacity() * sizeof(key_t) +
+           _lengths.capacity() * sizeof(std::uint8_t) +
+           _parents.capacity() * sizeof(index_t) +
+           _rates.capacity() * sizeof(Rate) +
+           _boundaries.capacity() * sizeof(key_t) +
+           _owners.capacity() * sizeof(index_t);
+}
+
+}
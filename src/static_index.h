@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "rate.h"
+#include "types.h"
+#include "vendor_tree.h"
+
+namespace code_directory {
+
+/**
+ * \brief Read-only LPM index compiled from a VendorTree.
+ *
+ * Every code is a range of MAX_CODE_LENGTH-digit numbers: the code followed
+ * by any digits. Codes with data are stored as packed keys sorted in code
+ * order, so codes starting with a prefix are one contiguous run.
+ * The ranges are also cut into segments, each owned by the longest code
+ * that covers it. Segment boundaries are kept in Eytzinger (BFS) order, so
+ * a longest prefix search is one branch-free descent over a small array
+ * instead of a walk over pointer-linked nodes.
+ *
+ * Only codes with data are stored; empty intermediate nodes are dropped.
+ */
+class StaticVendorIndex {
+public:
+    typedef std::uint64_t key_t;
+    typedef std::uint32_t index_t;
+    static constexpr index_t npos = std::numeric_limits<index_t>::max();
+
+    StaticVendorIndex() = default;
+    explicit StaticVendorIndex(const VendorTree &tree);
+
+    /// Count of codes with data
+    size_t size() const {
+        return _keys.size();
+    }
+
+    code_string code(index_t index) const;
+    const Rate &data(index_t index) const {
+        return _rates[index];
+    }
+
+    /// Index of the longest code with data that is a prefix of \p code or npos
+    index_t max_match(const code_string &code) const;
+
+    /// Same as VendorTree::get_maximum_prefix_rate
+    rate_string get_maximum_prefix_rate(const code_string &code) const {
+        auto found = max_match(code);
+        return found == npos ? rate_string{} : _rates[found].rate;
+    }
+
+    /// Range [first, last) of indexes of codes starting with \p prefix
+    std::pair<index_t, index_t> prefix_range(const code_string &prefix) const;
+
+    /// Calls visitor(code, rate) for every code starting with \p prefix, in code order
+    template<class Visitor>
+    void for_each_with_prefix(const code_string &prefix, Visitor visitor) const {
+        auto range = prefix_range(prefix);
+        for (auto index = range.first; index != range.second; ++index) {
+            visitor(code(index), _rates[index]);
+        }
+    }
+
+    /// Memory used by the index data
+    size_t memory_usage() const;
+
+    /// Code digits padded with zeros to MAX_CODE_LENGTH, as a number
+    static key_t make_key(const code_string &code);
+
+private:
+
+    /// Packed codes in code order: key is the code padded with zeros
+    std::vector<key_t> _keys;
+    std::vector<std::uint8_t> _lengths;
+    /// Index of the longest shorter code that is a prefix, or npos
+    std::vector<index_t> _parents;
+    std::vector<Rate> _rates;
+
+    /// Segment boundaries in Eytzinger order, 1-based
+    std::vector<key_t> _boundaries;
+    /// Longest code covering numbers just below each boundary, or npos
+    std::vector<index_t> _owners;
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <array>
+#include "prefix_tree.h"
+#include "trie_join.h"
+#include "types.h"
+
+namespace code_directory {
+
+template<class T>
+inline bool same_data(const T &left, const T &right) {
+    return left == right;
+}
+
+/**
+ * \brief Walks two versions of a tree in one pass and reports changed codes.
+ *
+ * Calls visitor.changed(before_node, after_node, path) for every code whose
+ * data differ between the versions; a node is nullptr if the code has no
+ * node in that version. A subtree reached through the same node in both
+ * versions is skipped: with SharedTrieStore trees, where every unchanged
+ * subtree is one node, work is proportional to the change.
+ *
+ * \p Node is any node type with data(), child_mask() and get_child().
+ * Either root may be nullptr for an empty tree.
+ */
+template<class Node, class Visitor>
+void diff_trees(const Node *before, const Node *after, Visitor &visitor) {
+    struct pending_s {
+        const Node *before;
+        const Node *after;
+        size_t depth;
+        char digit;
+    };
+    code_path_s path;
+    path.digits[0] = '\0';
+    path.length = 0;
+
+    std::array<pending_s, TRAVERSAL_STACK_SIZE> stack;
+    size_t top = 0;
+    stack[top++] = pending_s{ before, after, 0, '\0' };
+    while (top != 0) {
+        pending_s cur = stack[--top];
+        if (cur.before == cur.after) {
+            continue;
+        }
+        if (cur.depth > 0) {
+            path.digits[cur.depth - 1] = cur.digit;
+        }
+        path.digits[cur.depth] = '\0';
+        path.length = cur.depth;
+
+        bool had = cur.before != nullptr && !is_empty(cur.before->data());
+        bool has = cur.after != nullptr && !is_empty(cur.after->data());
+        if (had != has || (had && !same_data(cur.before->data(), cur.after->data()))) {
+            visitor.changed(had ? cur.before : nullptr, has ? cur.after : nullptr, path);
+        }
+
+        child_mask_t mask = (cur.before != nullptr ? cur.before->child_mask() : 0) |
+                            (cur.after != nullptr ? cur.after->child_mask() : 0);
+        if (top + __builtin_popcount(mask) > stack.size() ||
+            (mask != 0 && cur.depth == MAX_CODE_LENGTH)) {
+            throw std::length_error("Tree is too deep to traverse");
+        }
+        while (mask != 0) {
+            size_t index = 31 - __builtin_clz(mask);
+            mask &= child_mask_t(~(1u << index));
+            stack[top++] = pending_s{
+                cur.before != nullptr ? cur.before->get_child(index) : nullptr,
+                cur.after != nullptr ? cur.after->get_child(index) : nullptr,
+                cur.depth + 1,
+                char('0' + index)
+            };
+        }
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <array>
+#include "codename_tree.h"
+#include "prefix_tree.h"
+#include "types.h"
+
+namespace code_directory {
+
+/// Code of the node being visited, built from digits of the path to it
+struct code_path_s {
+    code_string code() const {
+        return code_string{digits.data()};
+    }
+    /// NUL-terminated digits
+    std::array<char, MAX_CODE_LENGTH + 1> digits;
+    size_t length;
+};
+
+/**
+ * \brief Walks a subtree of vendor tree together with codename tree.
+ *
+ * For every node with data in subtree of \p vendor_node calls
+ * visitor.visit(node, codename, path), where codename points to the codename
+ * whose code is the longest prefix of node's code, or is nullptr if there is
+ * none. This is the codename that CodenameTree::is_code_for_name accepts for
+ * node. Both trees are descended in one pass, so no codename lookups are done.
+ *
+ * \p Node is any node type with data(), child_mask() and get_child(), so both
+ * VendorTree and SharedTrieStore nodes can be walked.
+ *
+ * \param vendor_node Root of vendor subtree to walk
+ * \param code Code of \p vendor_node
+ * \param codename_node Node of codename tree with the same code as
+ *        \p vendor_node, or nullptr if codename tree has no such node
+ * \param codename Codename of the longest codename code above \p vendor_node
+ */
+template<class Node, class Visitor>
+void join_subtree(const Node &vendor_node,
+                  const code_string &code,
+                  const CodenameTree::node_t *codename_node,
+                  const codename_t *codename,
+                  Visitor &visitor) {
+    struct pending_s {
+        const Node *vendor;
+        const CodenameTree::node_t *codename_node;
+        const codename_t *codename;
+        size_t depth;
+        char digit;
+    };
+    code_path_s path;
+    std::string start = code;
+    std::copy(start.begin(), start.end(), path.digits.begin());
+
+    std::array<pending_s, TRAVERSAL_STACK_SIZE> stack;
+    size_t top = 0;
+    stack[top++] = pending_s{ &vendor_node, codename_node, codename, start.length(), '\0' };
+    while (top != 0) {
+        pending_s cur = stack[--top];
+        if (cur.depth > start.length()) {
+            path.digits[cur.depth - 1] = cur.digit;
+        }
+        path.digits[cur.depth] = '\0';
+        path.length = cur.depth;
+        if (cur.codename_node != nullptr && !is_empty(cur.codename_node->data())) {
+            cur.codename = &cur.codename_node->data();
+        }
+        if (!is_empty(cur.vendor->data())) {
+            visitor.visit(*cur.vendor, cur.codename, path);
+        }
+        child_mask_t mask = cur.vendor->child_mask();
+        if (top + __builtin_popcount(mask) > stack.size() ||
+            (mask != 0 && cur.depth == MAX_CODE_LENGTH)) {
+            throw std::length_error("Tree is too deep to traverse");
+        }
+        while (mask != 0) {
+            size_t index = 31 - __builtin_clz(mask);
+            mask &= child_mask_t(~(1u << index));
+            const Node *child = cur.vendor->get_child(index);
+            prefetch(child);
+            stack[top++] = pending_s{
+                child,
+                cur.codename_node != nullptr ? cur.codename_node->get_child(index) : nullptr,
+                cur.codename,
+                cur.depth + 1,
+                char('0' + index)
+            };
+        }
+    }
+}
+
+/**
+ * \brief Walks whole vendor tree from \p root together with \p codenames tree.
+ * See join_subtree.
+ */
+template<class Node, class Visitor>
+void join_trees(const Node &root, const CodenameTree *codenames, Visitor &visitor) {
+    join_subtree(root,
+                 get_empty<code_string>(),
+                 codenames != nullptr ? &codenames->root() : nullptr,
+                 nullptr,
+                 visitor);
+}
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <unordered_map>
+#include <boost/dynamic_bitset.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+#include "codename_tree.h"
+#include "rate.h"
+#include "trie_join.h"
+#include "types.h"
+
+namespace code_directory {
+
+/// Minimum, maximum and count of a set of rates
+struct rate_summary_s {
+    rate_summary_s() :
+        count(0)
+    {}
+    void add(const rate_string &rate) {
+        if (min.is_empty() || rate < min) {
+            min = rate;
+        }
+        if (max.is_empty() || max < rate) {
+            max = rate;
+        }
+        ++count;
+    }
+    void add(const rate_summary_s &other) {
+        if (other.count == 0) {
+            return;
+        }
+        if (min.is_empty() || other.min < min) {
+            min = other.min;
+        }
+        if (max.is_empty() || max < other.max) {
+            max = other.max;
+        }
+        count += other.count;
+    }
+    rate_string min;
+    rate_string max;
+    size_t count;
+};
+
+/**
+ * \brief Rate aggregates of one vendor tree, split by codename.
+ *
+ * For every codename it holds min, max and count of the rates that
+ * CodeDirectory::get_rates returns for this vendor and codename.
+ * It is computed once when a vendor or codename tree is published, by a
+ * single walk over vendor tree together with codename tree. Per-codename
+ * part is only valid for the codename tree it was built with.
+ *
+ * Codenames the vendor has rates for are also kept as a bitset over
+ * CodenameTree::codename_id, so a vendor that can't contribute to a codename
+ * is skipped with one bit test.
+ */
+class VendorSummary {
+public:
+    typedef boost::shared_ptr<const CodenameTree> codename_pointer_t;
+    typedef boost::dynamic_bitset<> coverage_t;
+
+    /// \p root is the root of a VendorTree or of a SharedTrieStore tree
+    template<class Node>
+    VendorSummary(const Node &root, codename_pointer_t codenames) :
+        _codenames(codenames),
+        _coverage(codenames ? codenames->codename_count() : 0)
+    {
+        join_trees(root, _codenames.get(), *this);
+    }
+
+    bool built_for(const codename_pointer_t &codenames) const {
+        return _codenames == codenames;
+    }
+
+    /// Summary of codename rates or nullptr if vendor has no rates for it
+    const rate_summary_s *for_codename(const codename_t &codename) const {
+        auto found = _by_codename.find(codename);
+        return found != _by_codename.end() ? &found->second : nullptr;
+    }
+
+    /// True if the vendor has rates for codename with \p codename_id
+    bool covers(size_t codename_id) const {
+        return codename_id < _coverage.size() && _coverage.test(codename_id);
+    }
+
+    const coverage_t &coverage() const {
+        return _coverage;
+    }
+
+    /// Summaries of every codename the vendor has rates for
+    const std::unordered_map<codename_t, rate_summary_s> &by_codename() const {
+        return _by_codename;
+    }
+
+    /// Summary of all rates in the tree
+    const rate_summary_s &overall() const {
+        return _overall;
+    }
+
+    /// Visitor for join_trees
+    template<class Node>
+    void visit(const Node &node, const codename_t *codename, const code_path_s &) {
+        _overall.add(node.data().rate);
+        if (codename != nullptr) {
+            auto &summary = _by_codename[*codename];
+            if (summary.count == 0) {
+                _coverage.set(_codenames->codename_id(*codename));
+            }
+            summary.add(node.data().rate);
+        }
+    }
+
+private:
+    codename_pointer_t _codenames;
+    std::unordered_map<codename_t, rate_summary_s> _by_codename;
+    coverage_t _coverage;
+    rate_summary_s _overall;
+};
+
+}
@@ -1,15 +1,21 @@
 #pragma once
 #include <iostream>
 #include <unordered_map>
+#include <vector>
 
+#include "prefix_scan.h"
 #include "prefix_tree.h"
 #include "rate.h"
 #include "types.h"
 
 namespace code_directory {
+
+/// Count of leading digits that vendor tree lookups resolve by a direct table
+constexpr size_t VENDOR_TREE_STRIDE = 3;
+
 class VendorTree {
 public:
-    typedef PrefixTree<Rate> tree_t;
+    typedef PrefixTree<Rate, is_empty<Rate>, VENDOR_TREE_STRIDE> tree_t;
     typedef tree_t::node_t node_t;
 
     VendorTree()
@@ -28,6 +34,36 @@ public:
         return tree.data_for_max_match(code, &match).rate;
     }
 
+    /**
+        Batch version of max_matching_node. Lookups for all \p codes are
+        interleaved, so it has much higher throughput for big batches.
+        */
+    std::vector<const node_t *> max_matching_nodes(const std::vector<code_string> &codes) const {
+        std::vector<const node_t *> ret(codes.size());
+        std::vector<size_t> matches(codes.size());
+        tree.maximum_matching_nodes(codes.data(), codes.size(), ret.data(), matches.data());
+        for (size_t i = 0; i < codes.size(); ++i) {
+            if (matches[i] == 0) {
+                ret[i] = nullptr;
+            }
+        }
+        return ret;
+    }
+
+    /**
+        Batch version of get_maximum_prefix_rate.
+        */
+    std::vector<rate_string> get_maximum_prefix_rates(const std::vector<code_string> &codes) const {
+        std::vector<const Rate *> found(codes.size());
+        tree.data_for_max_matches(codes.data(), codes.size(), found.data());
+        std::vector<rate_string> ret;
+        ret.reserve(codes.size());
+        for (auto rate: found) {
+            ret.push_back(rate->rate);
+        }
+        return ret;
+    }
+
     /**
         Adds \p rate for \p code in the tree of \p vendor.
 
@@ -50,11 +86,35 @@ public:
         );
     }
 
+    /// Sets \p rate for \p code whatever the dates of the old one; an empty rate clears it
+    void set_rate(const code_string &code, const Rate &rate) {
+        tree.put_data(code, rate);
+    }
+
     template<class Visitor>
     void accept(Visitor &visitor) const {
         tree.accept(visitor);
     }
 
+    /**
+        Calls visitor(code, rate) for up to \p limit codes with rates under
+        \p prefix, in code order, starting after code \p after if it is set.
+        Returns true if more codes are left, see code_directory::scan_prefix.
+        */
+    template<class Visitor>
+    bool scan_prefix(const code_string &prefix, const code_string *after, size_t limit, Visitor visitor) const {
+        return code_directory::scan_prefix(tree.root(), prefix, after, limit, visitor);
+    }
+
+    /// Cursor over codes with rates under \p prefix
+    PrefixCursor<node_t> scan(const code_string &prefix) const {
+        return PrefixCursor<node_t>(tree.root(), prefix);
+    }
+
+    const node_t &root() const {
+        return tree.root();
+    }
+
 private:
     tree_t tree;
 };
@@ -15,17 +15,7 @@ public:
     }
     bool visit(const Node<Rate> &node) {
         count++;
-#ifdef DEBUG
-        {
-            size_t node_children = 0;
-            for (auto &child: node._children) {
-                if (child != nullptr) {
-                    node_children++;
-                }
-            }
-            child_counts[node_children]++;
-        }
-#endif
+        child_counts[node.children_count()]++;
         if (!is_empty(node.data())) {
             contains_data++;
         }
@@ -48,7 +38,7 @@ public:
 
     size_t count;
     size_t contains_data;
-    std::array<size_t, 10> child_counts;
+    std::array<size_t, 11> child_counts;
 };
 
 template<class Node, class V1, class V2>
@@ -0,0 +1,203 @@
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <thread>
+
+#include "src/binary_client.h"
+#include "src/binary_server.h"
+
+using namespace code_directory;
+
+namespace {
+
+void fill(CodeDirectory &directory) {
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8613"}, {"China Mobile"});
+    directory.set_codename_tree(codenames);
+
+    auto vendorA = boost::make_shared<VendorTree>();
+    vendorA->add_rate({"86"},     {"0.005"}, 0, get_empty<time_t>());
+    vendorA->add_rate({"8620"},   {"0.002"}, 0, get_empty<time_t>());
+    vendorA->add_rate({"861390"}, {"0.007"}, 0, get_empty<time_t>());
+    directory.set_vendor_tree(1, vendorA);
+
+    auto vendorB = boost::make_shared<VendorTree>();
+    vendorB->add_rate({"86"},     {"0.003"}, 0, get_empty<time_t>());
+    directory.set_vendor_tree(2, vendorB);
+}
+
+binary_request_s get_rates(VendorId vendor, const codename_t &codename) {
+    binary_request_s request{};
+    request.op = binary_op_t::get_rates;
+    request.vendor = vendor;
+    request.codename = codename;
+    return request;
+}
+
+binary_request_s get_vendors(const codename_t &codename) {
+    binary_request_s request{};
+    request.op = binary_op_t::get_vendors;
+    request.codename = codename;
+    return request;
+}
+
+binary_request_s lpm(VendorId vendor, const char *number) {
+    binary_request_s request{};
+    request.op = binary_op_t::lpm;
+    request.vendor = vendor;
+    request.number = code_string{number};
+    return request;
+}
+
+binary_request_s lcr(const char *number, std::uint16_t count) {
+    binary_request_s request{};
+    request.op = binary_op_t::lcr;
+    request.number = code_string{number};
+    request.count = count;
+    return request;
+}
+
+/// Checks replies to requests of make_requests
+void check_responses(const binary_responses_t &responses) {
+    ASSERT_EQ(responses.size(), 6u);
+    EXPECT_EQ(responses[0].op, binary_op_t::get_rates);
+    EXPECT_EQ(responses[0].status, binary_status_t::ok);
+    EXPECT_EQ(responses[0].rates.size(), 2u);
+    EXPECT_EQ(responses[0].min, rate_string{"0.002"});
+    EXPECT_EQ(responses[0].max, rate_string{"0.005"});
+
+    ASSERT_EQ(responses[1].status, binary_status_t::ok);
+    // Rate of "86" is China Proper
+    ASSERT_EQ(responses[1].vendors.size(), 1u);
+    EXPECT_EQ(responses[1].vendors[0], CodeDirectory::vendors_result_s(1, {"0.007"}, {"0.007"}));
+
+    ASSERT_EQ(responses[2].status, binary_status_t::ok);
+    EXPECT_EQ(responses[2].rate.code, code_string{"8620"});
+    EXPECT_EQ(responses[2].rate.rate, rate_string{"0.002"});
+
+    ASSERT_EQ(responses[3].status, binary_status_t::ok);
+    ASSERT_EQ(responses[3].routes.size(), 1u);
+    EXPECT_EQ(responses[3].routes[0].vendor, 2);
+    EXPECT_EQ(responses[3].routes[0].rate, rate_string{"0.003"});
+
+    EXPECT_EQ(responses[4].op, binary_op_t::lpm);
+    EXPECT_EQ(responses[4].status, binary_status_t::not_found);
+    EXPECT_FALSE(responses[4].message.empty());
+    EXPECT_EQ(responses[5].status, binary_status_t::not_found);
+}
+
+binary_requests_t make_requests() {
+    return { get_rates(1, "China Proper"), get_vendors("China Mobile"), lpm(1, "862012345"),
+             lcr("861390", 1), lpm(3, "86"), get_rates(1, "Unknown") };
+}
+
+}
+
+TEST(BinaryProtocol, round_trip) {
+    auto requests = make_requests();
+    std::string frame;
+    BinaryProtocol::encode_requests(7, requests, &frame);
+    ASSERT_EQ(BinaryProtocol::frame_size(frame.data()), frame.size() - BinaryProtocol::HEADER_SIZE);
+
+    binary_requests_t decoded;
+    auto body = frame.data() + BinaryProtocol::HEADER_SIZE;
+    auto size = frame.size() - BinaryProtocol::HEADER_SIZE;
+    EXPECT_EQ(BinaryProtocol::decode_requests(body, size, &decoded), 7u);
+    ASSERT_EQ(decoded.size(), requests.size());
+    EXPECT_EQ(decoded[0].codename, "China Proper");
+    EXPECT_EQ(decoded[2].vendor, 1);
+    EXPECT_EQ(decoded[2].number, code_string{"862012345"});
+    EXPECT_EQ(decoded[3].count, 1u);
+
+    CodeDirectory directory;
+    fill(directory);
+    std::string reply;
+    BinaryProtocol::handle_frame(directory, body, size, &reply);
+    binary_responses_t responses;
+    EXPECT_EQ(BinaryProtocol::decode_responses(reply.data() + BinaryProtocol::HEADER_SIZE,
+                                               reply.size() - BinaryProtocol::HEADER_SIZE, &responses), 7u);
+    check_responses(responses);
+
+    // Malformed frames
+    EXPECT_THROW(BinaryProtocol::decode_requests(body, size - 1, &decoded), std::invalid_argument);
+    std::string extra(body, size);
+    extra.push_back('\0');
+    EXPECT_THROW(BinaryProtocol::decode_requests(extra.data(), extra.size(), &decoded), std::invalid_argument);
+    std::string unknown_op(body, size);
+    unknown_op[6] = char(100);
+    EXPECT_THROW(BinaryProtocol::decode_requests(unknown_op.data(), unknown_op.size(), &decoded),
+                 std::invalid_argument);
+    const char huge[] = { '\xFF', '\xFF', '\xFF', '\x7F' };
+    EXPECT_THROW(BinaryProtocol::frame_size(huge), std::invalid_argument);
+}
+
+TEST(BinaryProtocol, empty_directory) {
+    // Served before any codename tree is published
+    CodeDirectory directory;
+    auto vendor = boost::make_shared<VendorTree>();
+    vendor->add_rate({"86"}, {"0.005"}, 0, get_empty<time_t>());
+    directory.set_vendor_tree(1, vendor);
+
+    EXPECT_EQ(BinaryProtocol::handle(directory, get_rates(1, "China Proper")).status, binary_status_t::not_found);
+    EXPECT_EQ(BinaryProtocol::handle(directory, get_vendors("China Proper")).status, binary_status_t::not_found);
+    EXPECT_EQ(BinaryProtocol::handle(directory, lpm(1, "8613")).status, binary_status_t::ok);
+    EXPECT_EQ(BinaryProtocol::handle(directory, lcr("8613", 1)).status, binary_status_t::ok);
+}
+
+TEST(BinaryProtocol, server) {
+    CodeDirectory directory;
+    fill(directory);
+
+    boost::asio::io_context io_context;
+    BinaryServer server(directory, io_context);
+    auto path = "/tmp/code_directory_test_binary_" + std::to_string(getpid());
+    server.listen_local(path);
+    auto endpoint = server.listen_tcp({ boost::asio::ip::address_v4::loopback(), 0 });
+    std::thread thread([&io_context]() { io_context.run(); });
+
+    BinaryClient local, tcp;
+    local.connect_local(path);
+    tcp.connect_tcp("127.0.0.1", endpoint.port());
+    for (auto *client: { &local, &tcp }) {
+        check_responses(client->call(make_requests()));
+
+        // Pipelined frames are answered in order
+        std::vector<std::uint32_t> ids;
+        for (int i = 0; i < 50; ++i) {
+            ids.push_back(client->send({ lpm(2, "8613") }));
+            ids.push_back(client->send(make_requests()));
+        }
+        binary_responses_t responses;
+        for (size_t i = 0; i < ids.size(); i += 2) {
+            EXPECT_EQ(client->receive(&responses), ids[i]);
+            ASSERT_EQ(responses.size(), 1u);
+            EXPECT_EQ(responses[0].rate.code, code_string{"86"});
+            EXPECT_EQ(client->receive(&responses), ids[i + 1]);
+            check_responses(responses);
+        }
+    }
+
+    // A malformed frame closes the connection
+    std::string frame;
+    BinaryProtocol::encode_requests(1, { lpm(2, "8613") }, &frame);
+    frame[BinaryProtocol::HEADER_SIZE + 6] = char(100);
+    boost::asio::io_context raw_context;
+    boost::asio::local::stream_protocol::socket raw(raw_context);
+    raw.connect(boost::asio::local::stream_protocol::endpoint(path));
+    boost::asio::write(raw, boost::asio::buffer(frame));
+    char byte;
+    boost::system::error_code error;
+    boost::asio::read(raw, boost::asio::buffer(&byte, 1), error);
+    EXPECT_EQ(error, boost::asio::error::eof);
+    raw.close();
+    // Other connections are still served
+    EXPECT_EQ(local.call({ lpm(2, "8613") }).size(), 1u);
+
+    server.close();
+    local.close();
+    tcp.close();
+    thread.join();
+    EXPECT_NE(access(path.c_str(), F_OK), 0);
+}
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+#include "src/cdr_pipeline.h"
+
+using namespace code_directory;
+
+namespace {
+
+/// Vendor 1: "86" always, "8620" from 100 to 200, "862010" from 300
+void fill(CodeDirectory &directory) {
+    auto vendor = boost::make_shared<VendorTree>();
+    vendor->add_rate({"86"},     {"0.06"}, 0, get_empty<time_t>());
+    vendor->add_rate({"8620"},   {"0.03"}, 100, 200);
+    vendor->add_rate({"862010"}, {"0.01"}, 300, get_empty<time_t>());
+    directory.set_vendor_tree(1, vendor);
+}
+
+}
+
+TEST(CdrPipeline, rates_at) {
+    CodeDirectory separate, shared{true};
+    fill(separate);
+    fill(shared);
+
+    std::vector<code_string> numbers { "8620101234", "8620101234", "8620101234", "8620101234", "7123" };
+    std::vector<time_t> times {        50,           150,          250,          350,          150 };
+    for (const auto *directory: { &separate, &shared }) {
+        auto found = directory->get_rates_at(1, numbers, times);
+        ASSERT_EQ(found.size(), numbers.size());
+        EXPECT_EQ(found[0].code, code_string{"86"});
+        EXPECT_EQ(found[0].rate, rate_string{"0.06"});
+        EXPECT_EQ(found[1].code, code_string{"8620"});
+        EXPECT_EQ(found[1].rate, rate_string{"0.03"});
+        // End date is not included
+        EXPECT_EQ(found[2].code, code_string{"86"});
+        EXPECT_EQ(found[3].code, code_string{"862010"});
+        EXPECT_EQ(found[3].rate, rate_string{"0.01"});
+        EXPECT_TRUE(found[4].rate.is_empty());
+        EXPECT_EQ(found[4].code, code_string{});
+        EXPECT_THROW(directory->get_rates_at(2, numbers, times), std::out_of_range);
+    }
+}
+
+TEST(CdrPipeline, parse_and_price) {
+    cdr_s cdr;
+    EXPECT_TRUE(CdrPipeline::parse("8620101234,1,150,61", &cdr));
+    EXPECT_EQ(cdr.number, code_string{"8620101234"});
+    EXPECT_EQ(cdr.vendor, 1);
+    EXPECT_EQ(cdr.start, 150);
+    EXPECT_EQ(cdr.duration, 61);
+    EXPECT_FALSE(CdrPipeline::parse("8620101234,1,150", &cdr));
+    EXPECT_FALSE(CdrPipeline::parse("8620101234,1,150,61,1", &cdr));
+    EXPECT_FALSE(CdrPipeline::parse("86x,1,150,61", &cdr));
+    EXPECT_FALSE(CdrPipeline::parse("86,1,150,-1", &cdr));
+    EXPECT_FALSE(CdrPipeline::parse(",1,150,1", &cdr));
+
+    EXPECT_EQ(CdrPipeline::price({"0.06"}, 60), rate_string{"0.06"});
+    // Per second billing, rounded up to a billionth
+    EXPECT_EQ(CdrPipeline::price({"0.06"}, 1), rate_string{"0.001"});
+    EXPECT_EQ(CdrPipeline::price({"0.000000001"}, 1), rate_string{"0.000000001"});
+    EXPECT_EQ(CdrPipeline::price({"1.5"}, 120), rate_string{"3.0"});
+    EXPECT_TRUE(CdrPipeline::price({}, 120).is_empty());
+}
+
+TEST(CdrPipeline, run) {
+    CodeDirectory directory;
+    fill(directory);
+
+    std::stringstream in, expected;
+    for (int i = 0; i < 1000; ++i) {
+        switch (i % 5) {
+        case 0:
+            in << "8620101234,1,150,60\n";
+            expected << "8620101234,1,150,60,8620,0.03,0.03\n";
+            break;
+        case 1:
+            in << "8620101234,1,350,30\n";
+            expected << "8620101234,1,350,30,862010,0.01,0.005\n";
+            break;
+        case 2:
+            in << "861,2,150,60\n";
+            expected << "861,2,150,60,,,\n";
+            break;
+        case 3:
+            in << "not a record\n";
+            break;
+        default:
+            in << "7,1,150,60\n";
+            expected << "7,1,150,60,,,\n";
+        }
+    }
+    pipeline_options_s options { 7, 2, 3 };
+    std::stringstream out;
+    auto stats = CdrPipeline(directory, options).run(in, out);
+    EXPECT_EQ(out.str(), expected.str());
+    EXPECT_EQ(stats.records, 800u);
+    EXPECT_EQ(stats.rated, 400u);
+    EXPECT_EQ(stats.unrated, 400u);
+    EXPECT_EQ(stats.rejected, 200u);
+
+    std::stringstream empty_in, empty_out;
+    stats = CdrPipeline(directory).run(empty_in, empty_out);
+    EXPECT_EQ(stats.records, 0u);
+    EXPECT_TRUE(empty_out.str().empty());
+}
@@ -1,6 +1,15 @@
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+
 #include "src/code_directory.h"
+#include "src/parallel.h"
+#include "src/query_arena.h"
 
 using namespace code_directory;
 
@@ -8,6 +17,17 @@ const VendorId idA = {1};
 const VendorId idB = {2};
 const VendorId idC = {3};
 
+typedef std::set<CodeDirectory::rates_result_t::value_type> rates_set_t;
+
+rates_set_t get_rates_set(const CodeDirectory &directory,
+                          VendorId vendor,
+                          const codename_t &codename,
+                          rate_string *min,
+                          rate_string *max) {
+    auto rates = directory.get_rates(vendor, codename, min, max);
+    return rates_set_t(rates.begin(), rates.end());
+}
+
 void fill_directory(CodeDirectory &directory) {
     {
         auto codename = boost::make_shared<CodenameTree>();
@@ -153,3 +173,823 @@ TEST(CodeDirectory, remove_vendor) {
         EXPECT_EQ(result, expected);
     }
 }
+
+TEST(CodeDirectory, summary) {
+    CodeDirectory directory;
+    fill_directory(directory);
+
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8613"}, {"China Mobile"});
+    codenames->add_code({"8620"}, {"China Proper"});
+    codenames->add_code({"8653"}, {"China CNC"});
+    codenames->add_code({"867"}, {"Example"});
+    codenames->add_code({"8610"}, {"Beijing"});
+    directory.set_codename_tree(codenames);
+
+    auto vendorC = boost::make_shared<VendorTree>();
+    vendorC->add_rate({"86"},       {"0.006"}, 0, 1);
+    vendorC->add_rate({"862"},      {"0.003"}, 0, 1);
+    vendorC->add_rate({"86102"},    {"0.002"}, 0, 1);
+    vendorC->add_rate({"8610"},     {"0.004"}, 0, 1);
+    vendorC->add_rate({"86715"},    {"0.01"}, 0, 1);
+    VendorSummary summary(vendorC->root(), codenames);
+    directory.set_vendor_tree(idC, vendorC);
+
+    for (const auto &codename: directory.list_codenames()) {
+        rate_string min, max;
+        auto rates = directory.get_rates(idC, codename, &min, &max);
+        auto aggregate = summary.for_codename(codename);
+        if (rates.empty()) {
+            EXPECT_EQ(aggregate, nullptr);
+            continue;
+        }
+        ASSERT_NE(aggregate, nullptr);
+        EXPECT_EQ(aggregate->min, min);
+        EXPECT_EQ(aggregate->max, max);
+        EXPECT_EQ(aggregate->count, rates.size());
+    }
+    EXPECT_EQ(summary.overall().count, 5u);
+    EXPECT_EQ(summary.overall().min, rate_string{"0.002"});
+    EXPECT_EQ(summary.overall().max, rate_string{"0.01"});
+    EXPECT_TRUE(summary.built_for(codenames));
+
+    // "8610" moved from China Proper to Beijing
+    auto get_vendors = directory.get_vendors({"China Proper"});
+    typedef std::set<decltype(get_vendors)::value_type> set_t;
+    set_t expected;
+    expected.emplace(set_t::key_type(idA, {"0.001"}, {"0.005"}));
+    expected.emplace(set_t::key_type(idB, {"0.002"}, {"0.002"}));
+    expected.emplace(set_t::key_type(idC, {"0.003"}, {"0.006"}));
+    EXPECT_EQ(set_t(get_vendors.begin(), get_vendors.end()), expected);
+
+    auto beijing = directory.get_vendors({"Beijing"});
+    set_t expected_beijing;
+    expected_beijing.emplace(set_t::key_type(idA, {"0.006"}, {"0.006"}));
+    expected_beijing.emplace(set_t::key_type(idC, {"0.002"}, {"0.004"}));
+    EXPECT_EQ(set_t(beijing.begin(), beijing.end()), expected_beijing);
+
+    EXPECT_THROW(directory.get_vendors({"Nowhere"}), std::out_of_range);
+}
+
+TEST(CodeDirectory, cheapest_vendors) {
+    CodeDirectory directory;
+    fill_directory(directory);
+
+    typedef CodeDirectory::vendors_result_t::value_type result_t;
+    auto by_min = directory.get_cheapest_vendors({"China Proper"}, 2);
+    CodeDirectory::vendors_result_t expected_min {
+        result_t(idA, {"0.001"}, {"0.006"}),
+        result_t(idB, {"0.002"}, {"0.002"}),
+    };
+    EXPECT_EQ(by_min, expected_min);
+
+    auto by_max = directory.get_cheapest_vendors({"China Proper"}, 5, CodeDirectory::aggregate_t::max);
+    CodeDirectory::vendors_result_t expected_max {
+        result_t(idB, {"0.002"}, {"0.002"}),
+        result_t(idA, {"0.001"}, {"0.006"}),
+        result_t(idC, {"0.002"}, {"0.006"}),
+    };
+    EXPECT_EQ(by_max, expected_max);
+
+    EXPECT_TRUE(directory.get_cheapest_vendors({"China Proper"}, 0).empty());
+    EXPECT_THROW(directory.get_cheapest_vendors({"Nowhere"}, 1), std::out_of_range);
+
+    // Same order as sorted get_vendors after codename tree swap
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8610"}, {"Beijing"});
+    directory.set_codename_tree(codenames);
+    auto sorted = directory.get_vendors({"Beijing"});
+    std::sort(sorted.begin(), sorted.end(), [](const result_t &left, const result_t &right) {
+        return left.min < right.min || (left.min == right.min && left.vendor < right.vendor);
+    });
+    EXPECT_EQ(directory.get_cheapest_vendors({"Beijing"}, 5), sorted);
+}
+
+TEST(CodeDirectory, shared_subtrees) {
+    CodeDirectory separate, shared{true};
+    fill_directory(separate);
+    fill_directory(shared);
+
+    for (auto vendor: { idA, idB, idC }) {
+        for (const auto &codename: separate.list_codenames()) {
+            rate_string separate_min, separate_max, shared_min, shared_max;
+            EXPECT_EQ(get_rates_set(separate, vendor, codename, &separate_min, &separate_max),
+                      get_rates_set(shared, vendor, codename, &shared_min, &shared_max));
+            EXPECT_EQ(separate_min, shared_min);
+            EXPECT_EQ(separate_max, shared_max);
+        }
+    }
+    EXPECT_EQ(separate.shared_store_stats().unique_nodes, 0u);
+    auto before = shared.shared_store_stats();
+    EXPECT_GT(before.unique_nodes, 0u);
+
+    // Another vendor reselling deck of vendor A adds no nodes
+    auto resold = boost::make_shared<VendorTree>();
+    resold->add_rate({"86"},       {"0.005"}, 0, 1);
+    resold->add_rate({"86755"},    {"0.004"}, 0, 1);
+    resold->add_rate({"8621"},     {"0.003"}, 0, 1);
+    resold->add_rate({"8620"},     {"0.002"}, 0, 1);
+    resold->add_rate({"862010"},   {"0.001"}, 0, 1);
+    resold->add_rate({"8610"},     {"0.006"}, 0, 1);
+    shared.set_vendor_tree(4, resold);
+    auto after = shared.shared_store_stats();
+    EXPECT_EQ(after.unique_nodes, before.unique_nodes);
+    EXPECT_GT(after.logical_nodes, before.logical_nodes);
+    EXPECT_GT(after.bytes_saved, before.bytes_saved);
+
+    rate_string min_a, max_a, min_resold, max_resold;
+    EXPECT_EQ(get_rates_set(shared, idA, {"China Proper"}, &min_a, &max_a),
+              get_rates_set(shared, 4, {"China Proper"}, &min_resold, &max_resold));
+
+    auto vendors = shared.get_vendors({"China Proper"});
+    EXPECT_EQ(vendors.size(), 4u);
+    shared.remove_vendor(4);
+    EXPECT_EQ(shared.shared_store_stats().logical_nodes, before.logical_nodes);
+}
+
+TEST(CodeDirectory, coverage) {
+    CodeDirectory directory;
+    fill_directory(directory);
+
+    // B has rates for China Proper only
+    rate_string min, max;
+    auto misses = directory.rates_cache_stats().misses;
+    EXPECT_TRUE(directory.get_rates(idB, "China Mobile", &min, &max).empty());
+    EXPECT_TRUE(min.is_empty());
+    EXPECT_TRUE(max.is_empty());
+    EXPECT_EQ(directory.rates_cache_stats().misses, misses);
+    EXPECT_THROW(directory.get_rates(idB, "Unknown", &min, &max), std::out_of_range);
+    EXPECT_THROW(directory.get_vendors("Unknown"), std::out_of_range);
+
+    // B is skipped
+    auto vendors = directory.get_vendors("Example");
+    std::sort(vendors.begin(), vendors.end());
+    ASSERT_EQ(vendors.size(), 2u);
+    EXPECT_EQ(vendors[0].vendor, idA);
+    EXPECT_EQ(vendors[1].vendor, idC);
+    EXPECT_EQ(directory.get_cheapest_vendors("Example", 3).size(), 2u);
+
+    // Vendors covering nothing have no rows
+    auto empty = boost::make_shared<VendorTree>();
+    empty->add_rate({"44"}, {"0.1"}, 0, 1);
+    directory.set_vendor_tree(4, empty);
+    std::set<VendorId> exported;
+    directory.export_rate_matrix([&exported](VendorId vendor, const codename_t &,
+                                             const CodeDirectory::rates_result_t &,
+                                             const rate_string &, const rate_string &) {
+        exported.insert(vendor);
+    }, 1);
+    EXPECT_EQ(exported, (std::set<VendorId>{ idA, idB, idC }));
+}
+
+TEST(CodeDirectory, parallel_get_rates) {
+    // "Big" has 200 codes, some under others; vendor codes are longer and shorter
+    auto codenames = boost::make_shared<CodenameTree>();
+    auto vendor = boost::make_shared<VendorTree>();
+    codenames->add_code({"7"}, {"Other"});
+    vendor->add_rate({"7"}, {"0.5"}, 0, 1);
+    for (int i = 0; i < 200; ++i) {
+        auto code = "7" + std::to_string(100 + i);
+        codenames->add_code(code_string{code.c_str()}, i % 7 == 3 ? "Other" : "Big");
+        if (i % 3 == 0) {
+            vendor->add_rate(code_string{code.substr(0, 3).c_str()}, {"0.3"}, 0, 1);
+        }
+        for (int j = 0; j < 5; ++j) {
+            auto longer = code + std::to_string(j) + std::to_string(i % 10);
+            vendor->add_rate(code_string{longer.c_str()}, rate_string{("0.0" + std::to_string(i * 5 + j + 1)).c_str()}, 0, 1);
+        }
+        if (i % 4 == 0) {
+            codenames->add_code(code_string{(code + "1").c_str()}, "Big");
+        }
+    }
+    for (bool share: { false, true }) {
+        CodeDirectory directory{share};
+        directory.set_cache_capacity(0);
+        directory.set_codename_tree(codenames);
+        directory.set_vendor_tree(1, vendor);
+
+        for (const codename_t codename: { "Big", "Other" }) {
+            rate_string min, max, parallel_min, parallel_max;
+            directory.set_parallelism(1);
+            auto serial = directory.get_rates(1, codename, &min, &max);
+            directory.set_parallelism(4, 8);
+            auto parallel = directory.get_rates(1, codename, &parallel_min, &parallel_max);
+            EXPECT_GT(serial.size(), 100u);
+            EXPECT_EQ(parallel, serial);
+            EXPECT_EQ(parallel_min, min);
+            EXPECT_EQ(parallel_max, max);
+            // Thread count doesn't change the order
+            directory.set_parallelism(3, 1);
+            EXPECT_EQ(directory.get_rates(1, codename, nullptr, nullptr), serial);
+
+            // Chunks allocate from the arena of the query
+            QueryArena arena(1 << 20);
+            {
+                ArenaScope scope(arena);
+                auto in_arena = directory.get_rates(1, codename, nullptr, nullptr, scope.resource());
+                EXPECT_TRUE(std::equal(in_arena.begin(), in_arena.end(), serial.begin(), serial.end()));
+            }
+            EXPECT_EQ(arena.overflows(), 0u);
+        }
+    }
+}
+
+TEST(parallel, worker_pool) {
+    for (size_t threads: { 0, 1, 3 }) {
+        WorkerPool pool(threads);
+        EXPECT_EQ(pool.size(), threads);
+        std::vector<std::pair<size_t, size_t>> ranges(5);
+        auto chunks = parallel_chunks(103, 5, [&](size_t begin, size_t end, size_t chunk) {
+            ranges[chunk] = { begin, end };
+        }, pool);
+        ASSERT_EQ(chunks, 5u);
+        EXPECT_EQ(ranges.front().first, 0u);
+        EXPECT_EQ(ranges.back().second, 103u);
+        for (size_t chunk = 1; chunk < chunks; ++chunk) {
+            EXPECT_EQ(ranges[chunk].first, ranges[chunk - 1].second);
+        }
+
+        // Every chunk is done before the first error is rethrown
+        std::atomic<size_t> done(0);
+        EXPECT_THROW(parallel_chunks(10, 4, [&](size_t, size_t, size_t chunk) {
+            ++done;
+            if (chunk == 2) {
+                throw std::runtime_error("chunk");
+            }
+        }, pool), std::runtime_error);
+        EXPECT_EQ(done, 4u);
+    }
+}
+
+TEST(CodeDirectory, query_cache) {
+    CodeDirectory directory;
+    fill_directory(directory);
+
+    rate_string min, max;
+    auto first = get_rates_set(directory, idA, {"China Proper"}, &min, &max);
+    EXPECT_EQ(directory.rates_cache_stats().misses, 1u);
+    rate_string cached_min, cached_max;
+    EXPECT_EQ(get_rates_set(directory, idA, {"China Proper"}, &cached_min, &cached_max), first);
+    EXPECT_EQ(cached_min, min);
+    EXPECT_EQ(cached_max, max);
+    EXPECT_EQ(directory.rates_cache_stats().hits, 1u);
+
+    auto vendors = directory.get_vendors({"China Proper"});
+    EXPECT_EQ(directory.get_vendors({"China Proper"}), vendors);
+    EXPECT_EQ(directory.vendors_cache_stats().hits, 1u);
+    EXPECT_EQ(directory.vendors_cache_stats().misses, 1u);
+
+    // Publishing a vendor tree invalidates results of that vendor only
+    auto vendorA = boost::make_shared<VendorTree>();
+    vendorA->add_rate({"86"}, {"0.007"}, 0, 1);
+    directory.set_vendor_tree(idA, vendorA);
+    get_rates_set(directory, idA, {"China Proper"}, &min, &max);
+    EXPECT_EQ(min, rate_string{"0.007"});
+    EXPECT_EQ(directory.rates_cache_stats().misses, 2u);
+    get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    EXPECT_EQ(directory.rates_cache_stats().hits, 2u);
+
+    vendors = directory.get_vendors({"China Proper"});
+    EXPECT_EQ(directory.vendors_cache_stats().misses, 2u);
+    directory.remove_vendor(idC);
+    EXPECT_EQ(directory.get_vendors({"China Proper"}).size(), vendors.size() - 1);
+
+    // Codename tree swap invalidates everything
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"}, {"China Proper"});
+    directory.set_codename_tree(codenames);
+    get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    EXPECT_EQ(directory.rates_cache_stats().hits, 2u);
+
+    // Small capacity evicts least recently used results
+    directory.set_cache_capacity(1);
+    EXPECT_EQ(directory.rates_cache_stats().size, 0u);
+    auto evicted = directory.rates_cache_stats().evictions;
+    for (int i = 0; i < 40; ++i) {
+        auto vendorB = boost::make_shared<VendorTree>();
+        vendorB->add_rate({"86"}, {"0.002"}, 0, 1);
+        directory.set_vendor_tree(idB, vendorB);
+        get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    }
+    EXPECT_GT(directory.rates_cache_stats().evictions, evicted);
+    EXPECT_LE(directory.rates_cache_stats().size, 16u);
+
+    directory.set_cache_capacity(0);
+    auto hits = directory.rates_cache_stats().hits;
+    get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    get_rates_set(directory, idB, {"China Proper"}, &min, &max);
+    EXPECT_EQ(directory.rates_cache_stats().hits, hits);
+    EXPECT_EQ(directory.rates_cache_stats().size, 0u);
+}
+
+TEST(CodeDirectory, query_cache_codename_swaps) {
+    // China Mobile moves between two codes with different rates of vendor A
+    std::vector<CodeDirectory::codename_pointer_t> trees;
+    for (const char *code: { "8613", "8620" }) {
+        auto codenames = boost::make_shared<CodenameTree>();
+        codenames->add_code({"86"}, {"China Proper"});
+        codenames->add_code(code_string{code}, {"China Mobile"});
+        trees.push_back(codenames);
+    }
+    CodeDirectory directory;
+    fill_directory(directory);
+    directory.set_codename_tree(trees[0]);
+
+    // Readers fill the cache while the tree changes under them; a result of
+    // an older tree must never be cached under the generation of a newer one
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                directory.get_rates(idA, "China Mobile", nullptr, nullptr);
+            }
+        });
+    }
+    for (int i = 0; i < 301; ++i) {
+        directory.set_codename_tree(trees[i % 2]);
+        std::this_thread::yield();
+    }
+    done = true;
+    for (auto &reader: readers) {
+        reader.join();
+    }
+
+    CodeDirectory uncached;
+    fill_directory(uncached);
+    uncached.set_cache_capacity(0);
+    uncached.set_codename_tree(trees[0]);
+    EXPECT_EQ(get_rates_set(directory, idA, "China Mobile", nullptr, nullptr),
+              get_rates_set(uncached, idA, "China Mobile", nullptr, nullptr));
+}
+
+TEST(CodeDirectory, arena_queries) {
+    CodeDirectory separate, shared{true};
+    fill_directory(separate);
+    fill_directory(shared);
+
+    QueryArena arena(64);
+    for (auto *directory: { &separate, &shared }) {
+        for (size_t capacity: { 0, 100 }) {
+            directory->set_cache_capacity(capacity);
+            // Second round is served from the cache
+            for (int round = 0; round < 2; ++round) {
+                for (auto vendor: directory->list_vendors()) {
+                    for (const auto &codename: directory->list_codenames()) {
+                        ArenaScope scope(arena);
+                        rate_string min, max, arena_min, arena_max;
+                        auto expected = directory->get_rates(vendor, codename, &min, &max);
+                        auto found = directory->get_rates(vendor, codename, &arena_min, &arena_max,
+                                                          scope.resource());
+                        EXPECT_EQ(found.get_allocator().resource(), scope.resource());
+                        EXPECT_EQ(rates_set_t(found.begin(), found.end()),
+                                  rates_set_t(expected.begin(), expected.end()));
+                        EXPECT_EQ(arena_min, min);
+                        EXPECT_EQ(arena_max, max);
+                    }
+                }
+                for (const auto &codename: directory->list_codenames()) {
+                    ArenaScope scope(arena);
+                    auto expected = directory->get_vendors(codename);
+                    auto found = directory->get_vendors(codename, scope.resource());
+                    EXPECT_EQ(std::set<CodeDirectory::vendors_result_s>(found.begin(), found.end()),
+                              std::set<CodeDirectory::vendors_result_s>(expected.begin(), expected.end()));
+                }
+            }
+        }
+    }
+    // The buffer grew to fit the largest request
+    EXPECT_GT(arena.overflows(), 0u);
+    EXPECT_GT(arena.capacity(), 64u);
+    auto overflows = arena.overflows();
+    {
+        ArenaScope scope(arena);
+        rate_string min, max;
+        separate.get_rates(idA, "China Proper", &min, &max, scope.resource());
+    }
+    EXPECT_EQ(arena.overflows(), overflows);
+    EXPECT_THROW(separate.get_rates(4, "China Proper", nullptr, nullptr, arena.resource()), std::out_of_range);
+}
+
+TEST(CodeDirectory, export_rate_matrix) {
+    CodeDirectory separate, shared{true};
+    fill_directory(separate);
+    fill_directory(shared);
+
+    typedef std::tuple<VendorId, codename_t, rates_set_t, rate_string, rate_string> row_t;
+    std::set<row_t> expected;
+    for (auto vendor: separate.list_vendors()) {
+        for (const auto &codename: separate.list_codenames()) {
+            rate_string min, max;
+            auto rates = get_rates_set(separate, vendor, codename, &min, &max);
+            if (!rates.empty()) {
+                expected.emplace(vendor, codename, rates, min, max);
+            }
+        }
+    }
+    EXPECT_FALSE(expected.empty());
+
+    for (const auto *directory: { &separate, &shared }) {
+        for (size_t threads: { 1, 3 }) {
+            std::set<row_t> exported;
+            directory->export_rate_matrix([&exported](VendorId vendor,
+                                                      const codename_t &codename,
+                                                      const CodeDirectory::rates_result_t &rates,
+                                                      const rate_string &min,
+                                                      const rate_string &max) {
+                EXPECT_TRUE(exported.emplace(vendor, codename,
+                                             rates_set_t(rates.begin(), rates.end()),
+                                             min, max).second);
+            }, threads);
+            EXPECT_EQ(exported, expected);
+        }
+    }
+
+    // Errors of the sink stop the export
+    size_t calls = 0;
+    EXPECT_THROW(separate.export_rate_matrix([&calls](VendorId, const codename_t &,
+                                                      const CodeDirectory::rates_result_t &,
+                                                      const rate_string &, const rate_string &) {
+        ++calls;
+        throw std::runtime_error("Sink failed");
+    }, 2), std::runtime_error);
+    // Each thread stops after its first failure
+    EXPECT_GE(calls, 1u);
+    EXPECT_LE(calls, 2u);
+}
+
+TEST(CodeDirectory, scan_rates) {
+    CodeDirectory separate, shared{true};
+    fill_directory(separate);
+    fill_directory(shared);
+
+    typedef std::vector<std::string> codes_t;
+    auto codes = [](const CodeDirectory::scan_page_s &page) {
+        codes_t ret;
+        for (const auto &rate: page.rates) {
+            ret.push_back(rate.code);
+        }
+        return ret;
+    };
+    for (auto *directory: { &separate, &shared }) {
+        auto first = directory->scan_rates(idA, {"86"}, 4);
+        EXPECT_EQ(codes(first), (codes_t{ "86", "8610", "8620", "862010" }));
+        EXPECT_EQ(first.rates[3].rate, rate_string{"0.001"});
+        ASSERT_FALSE(first.continuation.empty());
+        auto second = directory->scan_rates(idA, {"86"}, 4, first.continuation);
+        EXPECT_EQ(codes(second), (codes_t{ "8621", "86755" }));
+        EXPECT_TRUE(second.continuation.empty());
+
+        EXPECT_EQ(codes(directory->scan_rates(idA, {"862"}, 10)), (codes_t{ "8620", "862010", "8621" }));
+        EXPECT_TRUE(directory->scan_rates(idA, {"44"}, 10).rates.empty());
+        EXPECT_THROW(directory->scan_rates(idA, {"86"}, 0), std::invalid_argument);
+        EXPECT_THROW(directory->scan_rates(idA, {"86"}, 4, "x:86"), std::invalid_argument);
+        EXPECT_THROW(directory->scan_rates(idA, {"86"}, 4, "123456789012345678901:86"), std::invalid_argument);
+        EXPECT_THROW(directory->scan_rates(idA, {"87"}, 4, first.continuation), std::invalid_argument);
+        EXPECT_THROW(directory->scan_rates(42, {"86"}, 4), std::out_of_range);
+
+        // New tree of the vendor invalidates tokens of the old one
+        auto vendorA = boost::make_shared<VendorTree>();
+        vendorA->add_rate({"86"}, {"0.005"}, 0, 1);
+        directory->set_vendor_tree(idA, vendorA);
+        EXPECT_THROW(directory->scan_rates(idA, {"86"}, 4, first.continuation), std::invalid_argument);
+        EXPECT_EQ(codes(directory->scan_rates(idA, {"86"}, 4)), (codes_t{ "86" }));
+    }
+}
+
+TEST(CodeDirectory, get_vendors_batch) {
+    CodeDirectory directory;
+    fill_directory(directory);
+    auto names = directory.list_codenames();
+
+    typedef std::set<CodeDirectory::vendors_result_s> set_t;
+    for (size_t capacity: { 0, 100 }) {
+        directory.set_cache_capacity(capacity);
+        for (size_t threads: { 1, 4 }) {
+            directory.set_parallelism(threads, 1);
+            auto batch = directory.get_vendors_batch(names);
+            ASSERT_EQ(batch.size(), names.size());
+            for (size_t i = 0; i < names.size(); ++i) {
+                auto single = directory.get_vendors(names[i]);
+                EXPECT_EQ(set_t(batch[i].begin(), batch[i].end()), set_t(single.begin(), single.end()))
+                    << names[i];
+            }
+        }
+    }
+    // Repeated codenames and cached results
+    auto twice = directory.get_vendors_batch({ "China Mobile", "China Mobile" });
+    ASSERT_EQ(twice.size(), 2u);
+    EXPECT_EQ(twice[0], twice[1]);
+    EXPECT_TRUE(directory.get_vendors_batch({}).empty());
+    EXPECT_THROW(directory.get_vendors_batch({ "China Proper", "Nowhere" }), std::out_of_range);
+}
+
+TEST(CodeDirectory, classify) {
+    CodeDirectory directory;
+    fill_directory(directory);
+
+    auto found = directory.classify(code_string{"862012345"});
+    EXPECT_EQ(found.codename, "China Proper");
+    EXPECT_EQ(found.code, code_string{"8620"});
+    found = directory.classify(code_string{"44"});
+    EXPECT_TRUE(found.codename.empty());
+
+    auto batch = directory.classify({ {"8613999"}, {"8653"}, {"44"}, {"8671"} });
+    ASSERT_EQ(batch.size(), 4u);
+    EXPECT_EQ(batch[0].codename, "China Mobile");
+    EXPECT_EQ(batch[1].codename, "China CNC");
+    EXPECT_EQ(batch[1].code, code_string{"8653"});
+    EXPECT_TRUE(batch[2].codename.empty());
+    EXPECT_EQ(batch[3].codename, "Example");
+}
+
+TEST(CodeDirectory, get_routes) {
+    CodeDirectory separate, shared{true};
+    fill_directory(separate);
+    fill_directory(shared);
+
+    for (const auto *directory: { &separate, &shared }) {
+        auto routes = directory->get_routes(code_string{"8620101234"}, 0, 2);
+        ASSERT_EQ(routes.size(), 2u);
+        EXPECT_EQ(routes[0].vendor, idA);
+        EXPECT_EQ(routes[0].code, code_string{"862010"});
+        EXPECT_EQ(routes[0].rate, rate_string{"0.001"});
+        EXPECT_EQ(routes[1].vendor, idB);
+        EXPECT_EQ(routes[1].code, code_string{"86"});
+
+        routes = directory->get_routes(code_string{"86102"}, 0, 10);
+        ASSERT_EQ(routes.size(), 3u);
+        EXPECT_EQ(routes[0].vendor, idB);
+        EXPECT_EQ(routes[1].vendor, idC);
+        EXPECT_EQ(routes[1].code, code_string{"86102"});
+        EXPECT_EQ(routes[2].vendor, idA);
+        // Rates end at 1
+        EXPECT_TRUE(directory->get_routes(code_string{"86102"}, 1, 10).empty());
+        EXPECT_TRUE(directory->get_routes(code_string{"44"}, 0, 10).empty());
+    }
+}
+
+TEST(CodeDirectory, scheduled_activation) {
+    CodeDirectory directory;
+    fill_directory(directory);
+    time_t now = 50;
+    directory.set_clock([&now]() { return now; });
+    std::vector<CodeDirectory::deltas_t> published;
+    directory.subscribe([&published](const CodeDirectory::deltas_t &deltas) {
+        published.push_back(deltas);
+    });
+
+    auto cheaper = boost::make_shared<VendorTree>();
+    cheaper->add_rate({"86"}, {"0.001"}, 0, 1);
+    auto removed = directory.schedule_vendor_tree(idB, nullptr, 100);
+    auto first = directory.schedule_vendor_tree(idB, cheaper, 100);
+    auto canceled = directory.schedule_vendor_tree(idC, nullptr, 200);
+    EXPECT_EQ(directory.next_activation(), 100);
+    EXPECT_THROW(directory.schedule_vendor_tree(42, cheaper, 100), std::out_of_range);
+
+    rate_string min, max;
+    EXPECT_EQ(directory.run_due(), 0u);
+    directory.get_rates(idB, "China Proper", &min, &max);
+    EXPECT_EQ(min, rate_string{"0.002"});
+
+    // Both trees are due; the one scheduled later wins
+    now = 100;
+    EXPECT_EQ(directory.run_due(), 2u);
+    directory.get_rates(idB, "China Proper", &min, &max);
+    EXPECT_EQ(min, rate_string{"0.001"});
+    ASSERT_EQ(published.size(), 2u);
+    EXPECT_EQ(published[1].front().after.min, rate_string{"0.001"});
+    EXPECT_FALSE(directory.cancel_scheduled(removed));
+    EXPECT_FALSE(directory.cancel_scheduled(first));
+
+    EXPECT_EQ(directory.next_activation(), 200);
+    EXPECT_TRUE(directory.cancel_scheduled(canceled));
+    EXPECT_TRUE(is_empty(directory.next_activation()));
+    now = 300;
+    EXPECT_EQ(directory.run_due(), 0u);
+    directory.get_rates(idC, "China Proper", &min, &max);
+    EXPECT_EQ(min, rate_string{"0.002"});
+
+    // Codenames changed after scheduling: summary is rebuilt by set_codename_tree
+    auto vendorB = boost::make_shared<VendorTree>();
+    vendorB->add_rate({"86"},   {"0.002"}, 0, 1);
+    vendorB->add_rate({"8613"}, {"0.009"}, 0, 1);
+    directory.schedule_vendor_tree(idB, vendorB, 400);
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8613"}, {"China Mobile"});
+    directory.set_codename_tree(codenames);
+    now = 400;
+    EXPECT_EQ(directory.run_due(), 1u);
+    EXPECT_EQ(directory.activation_rebuilds(), 0u);
+    auto vendors = directory.get_vendors("China Mobile");
+    ASSERT_EQ(vendors.size(), 1u);
+    EXPECT_EQ(vendors[0], CodeDirectory::vendors_result_s(idB, {"0.009"}, {"0.009"}));
+}
+
+TEST(CodeDirectory, scheduler_thread) {
+    CodeDirectory directory;
+    fill_directory(directory);
+    std::atomic<time_t> now{50};
+    directory.set_clock([&now]() { return now.load(); });
+    directory.start_scheduler();
+
+    directory.schedule_vendor_tree(idB, nullptr, 1000);
+    // Already due
+    directory.schedule_vendor_tree(idA, nullptr, 10);
+    auto wait = [&directory](VendorId vendor) {
+        for (int i = 0; i < 500; ++i) {
+            rate_string min, max;
+            if (directory.get_rates(vendor, "China Proper", &min, &max).empty()) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    };
+    EXPECT_TRUE(wait(idA));
+    EXPECT_EQ(directory.next_activation(), 1000);
+
+    // A new clock wakes the scheduler
+    directory.set_clock([]() { return time_t(1000); });
+    EXPECT_TRUE(wait(idB));
+    directory.stop_scheduler();
+}
+
+TEST(CodeDirectory, change_feed) {
+    for (bool share_subtrees: { false, true }) {
+        CodeDirectory directory{share_subtrees};
+        fill_directory(directory);
+
+        std::vector<CodeDirectory::deltas_t> feed;
+        auto subscription = directory.subscribe([&feed](const CodeDirectory::deltas_t &deltas) {
+            feed.push_back(deltas);
+        });
+
+        auto vendorA = [](const char *rate_8621, const char *rate_86755) {
+            auto tree = boost::make_shared<VendorTree>();
+            tree->add_rate({"86"},       {"0.005"}, 0, 1);
+            tree->add_rate({"86755"},    {rate_86755}, 0, 1);
+            tree->add_rate({"8621"},     {rate_8621}, 0, 1);
+            tree->add_rate({"8620"},     {"0.002"}, 0, 1);
+            tree->add_rate({"862010"},   {"0.001"}, 0, 1);
+            tree->add_rate({"8610"},     {"0.006"}, 0, 1);
+            return tree;
+        };
+        // Same deck, and a change inside min and max: nothing to report
+        directory.set_vendor_tree(idA, vendorA("0.003", "0.004"));
+        directory.set_vendor_tree(idA, vendorA("0.004", "0.004"));
+        EXPECT_TRUE(feed.empty());
+
+        directory.set_vendor_tree(idA, vendorA("0.0005", "0.02"));
+        ASSERT_EQ(feed.size(), 1u);
+        ASSERT_EQ(feed[0].size(), 2u);
+        EXPECT_EQ(feed[0][0].codename, "China Proper");
+        EXPECT_EQ(feed[0][0].vendor, idA);
+        EXPECT_EQ(feed[0][0].before.min, rate_string{"0.001"});
+        EXPECT_EQ(feed[0][0].after.min, rate_string{"0.0005"});
+        EXPECT_EQ(feed[0][0].after.max, rate_string{"0.006"});
+        EXPECT_EQ(feed[0][1].codename, "Example");
+        EXPECT_EQ(feed[0][1].after.max, rate_string{"0.02"});
+
+        // Moving 8610 to a new codename changes it for vendors with rates there
+        feed.clear();
+        auto codenames = boost::make_shared<CodenameTree>();
+        codenames->add_code({"86"},  {"China Proper"});
+        codenames->add_code({"8613"}, {"China Mobile"});
+        codenames->add_code({"8620"}, {"China Proper"});
+        codenames->add_code({"8653"}, {"China CNC"});
+        codenames->add_code({"867"}, {"Example"});
+        codenames->add_code({"8610"}, {"Beijing"});
+        directory.set_codename_tree(codenames);
+        ASSERT_EQ(feed.size(), 1u);
+        std::set<std::pair<codename_t, VendorId>> changed;
+        for (const auto &delta: feed[0]) {
+            changed.emplace(delta.codename, delta.vendor);
+        }
+        std::set<std::pair<codename_t, VendorId>> expected {
+            { "Beijing", idA }, { "Beijing", idC }, { "China Proper", idA }, { "China Proper", idC },
+        };
+        EXPECT_EQ(changed, expected);
+
+        feed.clear();
+        directory.remove_vendor(idB);
+        ASSERT_EQ(feed.size(), 1u);
+        ASSERT_EQ(feed[0].size(), 1u);
+        EXPECT_EQ(feed[0][0].vendor, idB);
+        EXPECT_EQ(feed[0][0].after.count, 0u);
+        EXPECT_TRUE(feed[0][0].after.min.is_empty());
+
+        directory.unsubscribe(subscription);
+        feed.clear();
+        directory.remove_vendor(idA);
+        EXPECT_TRUE(feed.empty());
+    }
+}
+
+TEST(CodeDirectory, reload_fingerprints) {
+    CodeDirectory directory;
+    fill_directory(directory);
+    size_t published = 0;
+    directory.subscribe([&published](const CodeDirectory::deltas_t &) { ++published; });
+
+    std::map<VendorId, std::string> decks {
+        { idA, "86,0.005\n8620,0.002\n" },
+        { idB, "86,0.002\n" },
+    };
+    size_t loads = 0;
+    auto load = [&loads](const std::string &deck) {
+        ++loads;
+        auto tree = boost::make_shared<VendorTree>();
+        tree->add_rate({"86"}, {deck == "86,0.002\n" ? "0.002" : "0.005"}, 0, 1);
+        if (deck.find("8620,") != std::string::npos) {
+            tree->add_rate({"8620"}, {"0.002"}, 0, 1);
+        }
+        return CodeDirectory::tree_pointer_t(tree);
+    };
+    auto reload = [&]() {
+        directory.begin_reload();
+        for (const auto &deck: decks) {
+            directory.reload_vendor_tree(deck.first, CodeDirectory::fingerprint(deck.second),
+                                         [&]() { return load(deck.second); });
+        }
+        return directory.end_reload();
+    };
+
+    EXPECT_FALSE(directory.vendor_fingerprint(idA));
+    auto first = reload();
+    EXPECT_EQ(loads, 2u);
+    EXPECT_EQ(first.changed, (std::vector<VendorId>{ idA, idB }));
+    EXPECT_TRUE(first.unchanged.empty());
+    EXPECT_EQ(first.missing, std::vector<VendorId>{ idC });
+    EXPECT_FALSE(first.codenames_changed);
+    ASSERT_TRUE(directory.vendor_fingerprint(idB));
+    EXPECT_EQ(*directory.vendor_fingerprint(idB), CodeDirectory::fingerprint("86,0.002\n"));
+
+    // Same input: nothing is parsed or published
+    published = 0;
+    auto second = reload();
+    EXPECT_EQ(loads, 2u);
+    EXPECT_EQ(published, 0u);
+    EXPECT_TRUE(second.changed.empty());
+    EXPECT_EQ(second.unchanged, (std::vector<VendorId>{ idA, idB }));
+
+    decks[idA] = "86,0.005\n";
+    auto third = reload();
+    EXPECT_EQ(loads, 3u);
+    EXPECT_EQ(published, 1u);
+    EXPECT_EQ(third.changed, std::vector<VendorId>{ idA });
+    EXPECT_EQ(third.unchanged, std::vector<VendorId>{ idB });
+    EXPECT_TRUE(get_rates_set(directory, idA, "China Proper", nullptr, nullptr) ==
+                rates_set_t({ { {"86"}, {"0.005"} } }));
+
+    // Publishing otherwise forgets the fingerprint
+    directory.set_vendor_tree(idB, load(decks[idB]));
+    EXPECT_FALSE(directory.vendor_fingerprint(idB));
+    EXPECT_TRUE(directory.reload_vendor_tree(idB, CodeDirectory::fingerprint(decks[idB]),
+                                             [&]() { return load(decks[idB]); }));
+    directory.remove_vendor(idB);
+    EXPECT_FALSE(directory.vendor_fingerprint(idB));
+
+    size_t codename_loads = 0;
+    auto codenames = [&codename_loads]() {
+        ++codename_loads;
+        auto tree = boost::make_shared<CodenameTree>();
+        tree->add_code({"86"}, {"China Proper"});
+        return CodeDirectory::codename_pointer_t(tree);
+    };
+    directory.begin_reload();
+    EXPECT_TRUE(directory.reload_codename_tree(42, codenames));
+    EXPECT_FALSE(directory.reload_codename_tree(42, codenames));
+    EXPECT_TRUE(directory.end_reload().codenames_changed);
+    EXPECT_EQ(codename_loads, 1u);
+    ASSERT_TRUE(directory.codename_fingerprint());
+    EXPECT_EQ(*directory.codename_fingerprint(), 42u);
+    EXPECT_EQ(directory.list_codenames(), std::vector<codename_t>{ "China Proper" });
+
+    EXPECT_THROW(directory.end_reload(), std::logic_error);
+}
+
+TEST(CodeDirectory, no_codename_tree) {
+    CodeDirectory directory;
+    EXPECT_THROW(directory.get_vendors("China Proper"), std::out_of_range);
+
+    auto vendor = boost::make_shared<VendorTree>();
+    vendor->add_rate({"86"}, {"0.005"}, 0, 1);
+    directory.set_vendor_tree(idA, vendor);
+    EXPECT_THROW(directory.get_vendors("China Proper"), std::out_of_range);
+    EXPECT_THROW(directory.get_cheapest_vendors("China Proper", 1), std::out_of_range);
+    EXPECT_THROW(directory.get_vendors_batch({ "China Proper" }), std::out_of_range);
+    EXPECT_THROW(directory.get_rates(idA, "China Proper", nullptr, nullptr), std::out_of_range);
+    directory.remove_vendor(idA);
+    EXPECT_TRUE(directory.get_rates(idA, "China Proper", nullptr, nullptr).empty());
+
+    EXPECT_TRUE(directory.classify(code_string{"8613"}).codename.empty());
+    auto batch = directory.classify(std::vector<code_string>{ {"8613"}, {"44"} });
+    ASSERT_EQ(batch.size(), 2u);
+    EXPECT_TRUE(batch[1].codename.empty());
+    EXPECT_EQ(batch[1].code.length(), 0u);
+}
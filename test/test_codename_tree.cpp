@@ -44,3 +44,55 @@ TEST(codename, with_data) {
     std::set<code_string> test{codes.begin(),codes.end()};
     EXPECT_EQ(control, test);
 }
+
+TEST(codename, batch) {
+    CodenameTree tree;
+
+    tree.add_code({"86"}, {"China Proper"});
+    tree.add_code({"8613"}, {"China Mobile"});
+    tree.add_code({"867"}, {"Example"});
+
+    auto nodes = tree.max_matching_nodes({ {"8613000"}, {"8612"}, {"8"}, {"86711"}, {"1"} });
+    ASSERT_EQ(nodes.size(), 5u);
+    EXPECT_EQ(nodes[0]->data(), "China Mobile");
+    EXPECT_EQ(nodes[0]->code(), code_string{"8613"});
+    EXPECT_EQ(nodes[1]->data(), "China Proper");
+    EXPECT_EQ(nodes[2], nullptr);
+    EXPECT_EQ(nodes[3]->data(), "Example");
+    EXPECT_EQ(nodes[4], nullptr);
+}
+
+TEST(codename, classify) {
+    CodenameTree tree;
+
+    tree.add_code({"86"}, {"China Proper"});
+    tree.add_code({"8613"}, {"China Mobile"});
+    tree.add_code({"867"}, {"Example"});
+
+    EXPECT_EQ(tree.codename_count(), 3u);
+    EXPECT_EQ(tree.codename_id("China Proper"), 0u);
+    EXPECT_EQ(tree.codename_id("Example"), 2u);
+    EXPECT_THROW(tree.codename_id("Unknown"), std::out_of_range);
+
+    auto found = tree.classify(code_string{"8613000"});
+    ASSERT_NE(found.codename, nullptr);
+    EXPECT_EQ(*found.codename, "China Mobile");
+    EXPECT_EQ(found.code, code_string{"8613"});
+    found = tree.classify(code_string{"1"});
+    EXPECT_EQ(found.codename, nullptr);
+    EXPECT_EQ(found.code, code_string{});
+
+    std::vector<code_string> numbers { {"8613000"}, {"8612"}, {"8"}, {"86711"}, {"1"}, {"86"} };
+    auto batch = tree.classify(numbers);
+    ASSERT_EQ(batch.size(), numbers.size());
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        auto single = tree.classify(numbers[i]);
+        EXPECT_EQ(batch[i].codename, single.codename);
+        EXPECT_EQ(batch[i].code, single.code);
+        if (single.codename != nullptr) {
+            EXPECT_TRUE(tree.is_code_for_name(numbers[i], *single.codename));
+        }
+    }
+    EXPECT_EQ(*batch[5].codename, "China Proper");
+    EXPECT_EQ(batch[5].code, code_string{"86"});
+}
@@ -0,0 +1,90 @@
+#include <cstdlib>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "src/compact_trie.h"
+#include "src/vendor_tree.h"
+
+using namespace code_directory;
+
+TEST(compact_trie, empty) {
+    VendorTree tree;
+    CompactVendorTrie trie(tree);
+
+    EXPECT_EQ(trie.size(), 1u);
+    EXPECT_EQ(trie.max_match({"86"}), CompactVendorTrie::npos);
+    EXPECT_TRUE(trie.get_maximum_prefix_rate({"86"}).is_empty());
+    EXPECT_TRUE(trie.get_maximum_prefix_rate({""}).is_empty());
+
+    CompactVendorTrie none;
+    EXPECT_EQ(none.max_match({"86"}), CompactVendorTrie::npos);
+}
+
+TEST(compact_trie, with_data) {
+    VendorTree tree;
+    tree.add_rate({"86"}, {"0.01"}, 0, 1);
+    tree.add_rate({"860"}, {"0.02"}, 0, 1);
+    tree.add_rate({"869"}, {"0.03"}, 5, 7);
+    tree.add_rate({"06755"}, {"0.012"}, 0, 1);
+    tree.add_rate({"9999999999999999"}, {"0.5"}, 0, 1);
+    CompactVendorTrie trie(tree);
+
+    EXPECT_EQ(trie.get_maximum_prefix_rate({"86"}), rate_string{"0.01"});
+    EXPECT_EQ(trie.get_maximum_prefix_rate({"8600"}), rate_string{"0.02"});
+    EXPECT_EQ(trie.get_maximum_prefix_rate({"861"}), rate_string{"0.01"});
+    EXPECT_EQ(trie.get_maximum_prefix_rate({"067551"}), rate_string{"0.012"});
+    EXPECT_EQ(trie.get_maximum_prefix_rate({"9999999999999999"}), rate_string{"0.5"});
+    EXPECT_TRUE(trie.get_maximum_prefix_rate({"8"}).is_empty());
+    EXPECT_TRUE(trie.get_maximum_prefix_rate({"0675"}).is_empty());
+    EXPECT_TRUE(trie.get_maximum_prefix_rate({"87"}).is_empty());
+
+    // Cold data of the match
+    auto found = trie.max_match({"8699"});
+    ASSERT_NE(found, CompactVendorTrie::npos);
+    EXPECT_EQ(trie.code(found), code_string{"869"});
+    EXPECT_EQ(trie.data(found).rate, rate_string{"0.03"});
+    EXPECT_EQ(trie.data(found).effective_date, 5);
+    EXPECT_EQ(trie.data(found).end_date, 7);
+    EXPECT_EQ(trie.code(trie.parent(found)), code_string{"86"});
+
+    EXPECT_EQ(sizeof(CompactVendorTrie::hot_node_s), 8u);
+    EXPECT_LT(trie.hot_memory_usage(), trie.memory_usage());
+}
+
+TEST(compact_trie, same_as_tree) {
+    VendorTree tree;
+    std::srand(45);
+    for (size_t i = 0; i < 3000; ++i) {
+        std::string code = std::to_string(std::rand() % 1000);
+        size_t tail = std::rand() % 10;
+        for (size_t j = 0; j < tail; ++j) {
+            code += char('0' + std::rand() % 10);
+        }
+        auto rate = "0." + std::to_string(std::rand() % 1000);
+        tree.add_rate(code_string{code.c_str()}, rate_string{rate.c_str()}, 0, 1);
+    }
+    CompactVendorTrie trie(tree);
+
+    for (size_t i = 0; i < 5000; ++i) {
+        std::string number = std::to_string(std::rand() % 1000);
+        while (number.length() < 14) {
+            number += char('0' + std::rand() % 10);
+        }
+        code_string code{number.substr(0, 1 + std::rand() % 14).c_str()};
+        EXPECT_EQ(trie.get_maximum_prefix_rate(code), tree.get_maximum_prefix_rate(code));
+
+        // Tree returns the deepest node on the path, with data or not
+        auto node = tree.max_matching_node(code);
+        while (node != nullptr && is_empty(node->data())) {
+            node = node->parent();
+        }
+        auto found = trie.max_match(code);
+        if (node == nullptr || node->parent() == nullptr) {
+            EXPECT_EQ(found, CompactVendorTrie::npos);
+            continue;
+        }
+        ASSERT_NE(found, CompactVendorTrie::npos);
+        EXPECT_EQ(trie.code(found), node->code());
+        EXPECT_EQ(trie.data(found).rate, node->data().rate);
+    }
+}
@@ -0,0 +1,395 @@
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "src/journal.h"
+
+using namespace code_directory;
+
+namespace {
+
+namespace fs = std::filesystem;
+
+/// Journal directory removed before and after a test
+class JournalPath {
+public:
+    explicit JournalPath(const std::string &name = "main") :
+        path("/tmp/code_directory_test_journal_" + std::to_string(getpid()) + "_" + name)
+    {
+        fs::remove_all(path);
+    }
+    ~JournalPath() {
+        fs::remove_all(path);
+    }
+    const std::string path;
+};
+
+typedef std::set<std::pair<std::string, std::uint64_t>> rates_set_t;
+
+/// Everything get_rates returns, to compare directories
+std::map<std::pair<VendorId, std::string>, rates_set_t> snapshot(const CodeDirectory &directory) {
+    std::map<std::pair<VendorId, std::string>, rates_set_t> ret;
+    for (auto vendor: directory.list_vendors()) {
+        for (const auto &codename: directory.list_codenames()) {
+            rates_set_t rates;
+            for (const auto &rate: directory.get_rates(vendor, codename, nullptr, nullptr)) {
+                rates.emplace(rate.code, rate.rate.value);
+            }
+            // Removed vendors may still be listed
+            if (!rates.empty()) {
+                ret[{ vendor, codename }] = rates;
+            }
+        }
+    }
+    return ret;
+}
+
+CodeDirectory::codename_pointer_t make_codenames() {
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8613"}, {"China Mobile"});
+    codenames->add_code({"44"}, {"UK"});
+    return codenames;
+}
+
+CodeDirectory::tree_pointer_t make_tree(int version) {
+    auto tree = boost::make_shared<VendorTree>();
+    tree->add_rate({"86"}, {"0.005"}, 0, 10);
+    tree->add_rate({"8613"}, rate_string{("0.00" + std::to_string(version % 10)).c_str()}, version, 10 + version);
+    tree->add_rate(code_string{("8613" + std::to_string(version)).c_str()}, {"0.007"}, 0, 10);
+    if (version % 2 == 0) {
+        tree->add_rate({"44"}, {"0.02"}, 0, 10);
+    }
+    return tree;
+}
+
+/// Applies changes \p first to \p last of a fixed series
+/// Applies changes \p first to \p last to a DirectoryJournal or a CodeDirectory
+template<class Target>
+void mutate(Target &target, int first, int last) {
+    for (int i = first; i < last; ++i) {
+        switch (i % 5) {
+        case 0:
+            target.set_codename_tree(make_codenames());
+            break;
+        case 4:
+            target.remove_vendor(i % 3);
+            break;
+        default:
+            target.set_vendor_tree(i % 3, make_tree(i));
+        }
+    }
+}
+
+/// Directory after changes 0 to \p count, without a journal
+std::map<std::pair<VendorId, std::string>, rates_set_t> expected(int count) {
+    CodeDirectory directory;
+    mutate(directory, 0, count);
+    return snapshot(directory);
+}
+
+std::vector<fs::path> files(const std::string &path, const std::string &kind) {
+    std::vector<fs::path> ret;
+    for (const auto &entry: fs::directory_iterator(path)) {
+        if (entry.path().filename().string().compare(0, kind.size(), kind) == 0) {
+            ret.push_back(entry.path());
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+}
+
+TEST(journal, replay) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 0;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        EXPECT_EQ(journal.recovery().replayed, 0u);
+        mutate(journal, 0, 20);
+        journal.flush();
+        EXPECT_EQ(journal.sequence(), 20u);
+    }
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        EXPECT_EQ(journal.recovery().checkpoint, 0u);
+        EXPECT_EQ(journal.recovery().replayed, 20u);
+        EXPECT_EQ(journal.recovery().truncated_bytes, 0u);
+        EXPECT_EQ(snapshot(directory), expected(20));
+        EXPECT_FALSE(snapshot(directory).empty());
+
+        // Appends continue after the replayed records
+        mutate(journal, 20, 27);
+        EXPECT_EQ(journal.sequence(), 27u);
+    }
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().replayed, 27u);
+    EXPECT_EQ(snapshot(directory), expected(27));
+}
+
+TEST(journal, shared_subtrees) {
+    JournalPath path;
+    CodeDirectory directory(true);
+    EXPECT_THROW(DirectoryJournal(directory, path.path), std::invalid_argument);
+}
+
+TEST(journal, reload) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 0;
+    size_t loads = 0;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        directory.begin_reload();
+        EXPECT_TRUE(journal.reload_codename_tree(1, []() { return make_codenames(); }));
+        for (VendorId vendor: { 0, 1 }) {
+            EXPECT_TRUE(journal.reload_vendor_tree(vendor, 10 + vendor, [&]() { ++loads; return make_tree(vendor + 2); }));
+        }
+        EXPECT_EQ(directory.end_reload().changed, (std::vector<VendorId>{ 0, 1 }));
+        EXPECT_EQ(journal.sequence(), 3u);
+
+        // Unchanged inputs are neither loaded nor logged
+        EXPECT_FALSE(journal.reload_codename_tree(1, []() { return make_codenames(); }));
+        EXPECT_FALSE(journal.reload_vendor_tree(0, 10, [&]() { ++loads; return make_tree(5); }));
+        EXPECT_TRUE(journal.reload_vendor_tree(1, 12, [&]() { ++loads; return make_tree(5); }));
+        EXPECT_EQ(loads, 3u);
+        EXPECT_EQ(journal.sequence(), 4u);
+        journal.flush();
+    }
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().replayed, 4u);
+    CodeDirectory reference;
+    reference.set_codename_tree(make_codenames());
+    reference.set_vendor_tree(0, make_tree(2));
+    reference.set_vendor_tree(1, make_tree(5));
+    EXPECT_EQ(snapshot(directory), snapshot(reference));
+}
+
+TEST(journal, checkpoints) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 6;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        mutate(journal, 0, 20);
+        // The latest two checkpoints and the journal after the older one are kept
+        EXPECT_EQ(files(path.path, "checkpoint"),
+                  (std::vector<fs::path>{ path.path + "/checkpoint.12", path.path + "/checkpoint.18" }));
+        EXPECT_EQ(files(path.path, "journal"),
+                  (std::vector<fs::path>{ path.path + "/journal.13", path.path + "/journal.19" }));
+    }
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        EXPECT_EQ(journal.recovery().checkpoint, 18u);
+        EXPECT_EQ(journal.recovery().replayed, 2u);
+        EXPECT_EQ(snapshot(directory), expected(20));
+
+        mutate(journal, 20, 22);
+        journal.checkpoint();
+        EXPECT_EQ(files(path.path, "checkpoint"),
+                  (std::vector<fs::path>{ path.path + "/checkpoint.18", path.path + "/checkpoint.22" }));
+    }
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().checkpoint, 22u);
+    EXPECT_EQ(journal.recovery().replayed, 0u);
+    EXPECT_EQ(snapshot(directory), expected(22));
+
+    // A torn checkpoint is never used; the previous one and the journal
+    // after it are
+    fs::resize_file(path.path + "/checkpoint.22", fs::file_size(path.path + "/checkpoint.22") - 1);
+    fs::copy_file(path.path + "/checkpoint.22", path.path + "/checkpoint.30");
+    CodeDirectory torn;
+    DirectoryJournal recovered(torn, path.path, options);
+    EXPECT_EQ(recovered.recovery().checkpoint, 18u);
+    EXPECT_EQ(recovered.recovery().replayed, 4u);
+    EXPECT_EQ(snapshot(torn), expected(22));
+}
+
+TEST(journal, damaged_checkpoint) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 0;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        mutate(journal, 0, 2);
+        journal.checkpoint();
+        mutate(journal, 2, 3);
+        journal.flush();
+    }
+    std::string data;
+    {
+        std::ifstream file(path.path + "/checkpoint.2", std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    data[data.size() / 2] ^= 0x40;
+    {
+        std::ofstream file(path.path + "/checkpoint.2", std::ios::binary | std::ios::trunc);
+        file.write(data.data(), std::streamsize(data.size()));
+    }
+    // The journal before the first checkpoint is still there
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().checkpoint, 0u);
+    EXPECT_EQ(journal.recovery().replayed, 3u);
+    EXPECT_EQ(journal.recovery().truncated_bytes, 0u);
+    EXPECT_EQ(snapshot(directory), expected(3));
+}
+
+TEST(journal, damaged_journal) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 0;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        mutate(journal, 0, 4);
+        journal.checkpoint();
+        mutate(journal, 4, 6);
+        journal.checkpoint();
+        mutate(journal, 6, 8);
+        journal.flush();
+    }
+    // Records before the last checkpoint can't be replayed from the first one
+    fs::remove(path.path + "/checkpoint.6");
+    fs::rename(path.path + "/journal.5", path.path + "/journal.5.moved");
+    auto sizes = [&path]() {
+        std::map<std::string, std::uintmax_t> ret;
+        for (const auto &entry: fs::directory_iterator(path.path)) {
+            ret[entry.path().filename().string()] = entry.file_size();
+        }
+        return ret;
+    };
+    auto before = sizes();
+    {
+        CodeDirectory directory;
+        EXPECT_THROW(DirectoryJournal(directory, path.path, options), std::runtime_error);
+    }
+    EXPECT_EQ(sizes(), before);
+    fs::rename(path.path + "/journal.5.moved", path.path + "/journal.5");
+
+    // A corrupt record with readable records after it is not a torn write
+    const auto journal_file = path.path + "/journal.5";
+    std::string data;
+    {
+        std::ifstream file(journal_file, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    data[20] ^= 0x40;
+    {
+        std::ofstream file(journal_file, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), std::streamsize(data.size()));
+    }
+    before = sizes();
+    {
+        CodeDirectory directory;
+        EXPECT_THROW(DirectoryJournal(directory, path.path, options), std::runtime_error);
+    }
+    EXPECT_EQ(sizes(), before);
+
+    data[20] ^= 0x40;
+    {
+        std::ofstream file(journal_file, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), std::streamsize(data.size()));
+    }
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().checkpoint, 4u);
+    EXPECT_EQ(journal.recovery().replayed, 4u);
+    EXPECT_EQ(snapshot(directory), expected(8));
+}
+
+TEST(journal, truncated_record) {
+    JournalPath path;
+    journal_options_s options;
+    options.checkpoint_records = 0;
+    {
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, path.path, options);
+        mutate(journal, 0, 9);
+        journal.flush();
+    }
+    auto journal_file = path.path + "/journal.1";
+    const auto full_size = fs::file_size(journal_file);
+    std::string full;
+    {
+        std::ifstream file(journal_file, std::ios::binary);
+        full.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    // Where the ninth record starts
+    size_t eight_size;
+    {
+        JournalPath eight("eight");
+        CodeDirectory directory;
+        DirectoryJournal journal(directory, eight.path, options);
+        mutate(journal, 0, 8);
+        journal.flush();
+        eight_size = fs::file_size(eight.path + "/journal.1");
+    }
+    ASSERT_LT(eight_size, full_size);
+    auto remove_later_journals = [&]() {
+        for (const auto &later: files(path.path, "journal")) {
+            if (later != journal_file) {
+                fs::remove(later);
+            }
+        }
+    };
+
+    // Cut inside the header, inside the body, and one byte short
+    for (size_t cut: { eight_size + 3, eight_size + 12, size_t(full_size) - 1 }) {
+        // Written after the previous recovery
+        remove_later_journals();
+        {
+            std::ofstream file(journal_file, std::ios::binary | std::ios::trunc);
+            file.write(full.data(), std::streamsize(cut));
+        }
+        CodeDirectory directory;
+        {
+            DirectoryJournal journal(directory, path.path, options);
+            EXPECT_EQ(journal.recovery().replayed, 8u) << cut;
+            EXPECT_EQ(journal.recovery().truncated_bytes, cut - eight_size) << cut;
+            EXPECT_EQ(snapshot(directory), expected(8)) << cut;
+            EXPECT_EQ(fs::file_size(journal_file), eight_size);
+
+            // The torn record is gone, so new records are found after it
+            mutate(journal, 8, 9);
+        }
+        CodeDirectory reopened;
+        DirectoryJournal journal(reopened, path.path, options);
+        EXPECT_EQ(journal.recovery().replayed, 9u);
+        EXPECT_EQ(journal.recovery().truncated_bytes, 0u);
+        EXPECT_EQ(snapshot(reopened), expected(9));
+    }
+
+    // A flipped byte in the last record fails the CRC; it is dropped
+    remove_later_journals();
+    {
+        std::ofstream file(journal_file, std::ios::binary | std::ios::trunc);
+        std::string corrupt = full;
+        corrupt[eight_size + 20] ^= 0x40;
+        file.write(corrupt.data(), std::streamsize(corrupt.size()));
+    }
+    CodeDirectory directory;
+    DirectoryJournal journal(directory, path.path, options);
+    EXPECT_EQ(journal.recovery().replayed, 8u);
+    EXPECT_EQ(snapshot(directory), expected(8));
+}
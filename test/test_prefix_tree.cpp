@@ -1,5 +1,7 @@
 #include <cstring>
 #include <limits>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "src/prefix_tree.h"
@@ -49,6 +51,10 @@ TEST(node, children) {
     EXPECT_EQ(a->get_child(9), nullptr);
 
     EXPECT_EQ(bp->parent(), ap);
+
+    EXPECT_EQ(a->child_mask(), (1 << 0) | (1 << 1) | (1 << 5));
+    EXPECT_EQ(a->children_count(), 3u);
+    EXPECT_EQ(bp->child_mask(), 0);
 }
 
 namespace code_directory {
@@ -184,3 +190,144 @@ TEST(prefix_tree, visitor) {
         EXPECT_EQ(global.sum, 355);
     }
 }
+
+class CodeCollector {
+public:
+    CodeCollector(const std::string &_stop = "-") :
+        stop(_stop)
+    {}
+    bool visit(const TTree::node_t &node) {
+        codes.push_back(node.code());
+        return std::string(node.code()) != stop;
+    }
+    std::string stop;
+    std::vector<std::string> codes;
+};
+
+TEST(prefix_tree, visit_order) {
+    TTree tree { code_directory::get_empty<int>() };
+    PUT_DATA(32);
+    PUT_DATA(1);
+    PUT_DATA(313);
+    PUT_DATA(30);
+    PUT_DATA(9);
+
+    {
+        CodeCollector all;
+        tree.accept(all);
+        std::vector<std::string> expected { "", "1", "3", "30", "31", "313", "32", "9" };
+        EXPECT_EQ(all.codes, expected);
+    }
+    {
+        // Children of "31" must not be visited
+        CodeCollector pruned { "31" };
+        tree.accept(pruned);
+        std::vector<std::string> expected { "", "1", "3", "30", "31", "32", "9" };
+        EXPECT_EQ(pruned.codes, expected);
+    }
+    {
+        CodeCollector subtree;
+        tree.exactly_matching_node({"3"})->accept(subtree);
+        std::vector<std::string> expected { "3", "30", "31", "313", "32" };
+        EXPECT_EQ(subtree.codes, expected);
+    }
+}
+
+TEST(prefix_tree, visit_full_depth) {
+    TTree tree { code_directory::get_empty<int>() };
+    // Every node on the path has all ten children
+    std::string code;
+    for (size_t len = 0; len < MAX_CODE_LENGTH; ++len) {
+        for (char digit = '0'; digit <= '9'; ++digit) {
+            tree.put_data(code_string{(code + digit).c_str()}, digit - '0');
+        }
+        code += '9';
+    }
+    StatsInt stats;
+    tree.accept(stats);
+    EXPECT_EQ(stats.count, int(10 * MAX_CODE_LENGTH + 1));
+    EXPECT_EQ(stats.with_data, int(10 * MAX_CODE_LENGTH));
+}
+
+TEST(prefix_tree, batch_search) {
+    TTree tree { code_directory::get_empty<int>() };
+    PUT_DATA(313);
+    PUT_DATA(3);
+    PUT_DATA(32);
+    PUT_DATA(1);
+    PUT_DATA(4444);
+
+    std::vector<code_string> codes;
+    for (int i = 0; i < 100; ++i) {
+        codes.emplace_back(std::to_string(i * 37).c_str());
+    }
+    codes.emplace_back("");
+    codes.emplace_back("44449");
+
+    std::vector<const TTree::node_t *> nodes(codes.size());
+    std::vector<size_t> matches(codes.size());
+    std::vector<const int *> data(codes.size());
+    tree.maximum_matching_nodes(codes.data(), codes.size(), nodes.data(), matches.data());
+    tree.data_for_max_matches(codes.data(), codes.size(), data.data());
+    for (size_t i = 0; i < codes.size(); ++i) {
+        size_t match;
+        EXPECT_EQ(nodes[i], tree.maximum_matching_node(codes[i], &match));
+        EXPECT_EQ(matches[i], match);
+        EXPECT_EQ(*data[i], tree.data_for_max_match(codes[i], &match));
+    }
+}
+
+template<class Tree>
+class prefix_tree_stride : public ::testing::Test {
+};
+typedef ::testing::Types<PrefixTree<int, is_empty<int>, 1>,
+                         PrefixTree<int, is_empty<int>, 2>,
+                         PrefixTree<int, is_empty<int>, 3>> strides_t;
+TYPED_TEST_SUITE(prefix_tree_stride, strides_t);
+
+TYPED_TEST(prefix_tree_stride, same_as_without_stride) {
+    TTree plain { code_directory::get_empty<int>() };
+    TypeParam strided { code_directory::get_empty<int>() };
+
+    std::srand(29);
+    for (int i = 0; i < 3000; ++i) {
+        std::string code = std::to_string(std::rand() % 10000).substr(0, 1 + std::rand() % 5);
+        plain.put_data(code_string{code.c_str()}, i);
+        strided.put_data(code_string{code.c_str()}, i);
+        if (i % 100 == 0) {
+            // Data above and inside the table levels
+            plain.put_data(code_string{code.substr(0, 1).c_str()}, -i);
+            strided.put_data(code_string{code.substr(0, 1).c_str()}, -i);
+        }
+    }
+
+    std::vector<code_string> codes;
+    for (int i = 0; i < 3000; ++i) {
+        codes.emplace_back(std::to_string(std::rand()).substr(0, std::rand() % 9).c_str());
+    }
+    std::vector<const int *> batch(codes.size());
+    strided.data_for_max_matches(codes.data(), codes.size(), batch.data());
+    for (size_t i = 0; i < codes.size(); ++i) {
+        size_t plain_match, strided_match;
+        auto plain_node = plain.maximum_matching_node(codes[i], &plain_match);
+        auto strided_node = strided.maximum_matching_node(codes[i], &strided_match);
+        EXPECT_EQ(plain_match, strided_match);
+        EXPECT_EQ(plain_node->code(), strided_node->code());
+        EXPECT_EQ(plain.data_for_max_match(codes[i], &plain_match),
+                  strided.data_for_max_match(codes[i], &strided_match));
+        EXPECT_EQ(*batch[i], plain.data_for_max_match(codes[i], &plain_match));
+        if (codes[i].length() >= TypeParam::stride) {
+            // Table entries point to the deepest node of their digits
+            EXPECT_EQ(strided.stride_depth(codes[i]), std::min(strided_match, TypeParam::stride)) << i;
+        }
+    }
+}
+
+TEST(prefix_tree_stride, new_shallow_nodes) {
+    PrefixTree<int, is_empty<int>, 2> tree { code_directory::get_empty<int>() };
+    tree.put_data({"123"}, 1);
+    EXPECT_EQ(tree.stride_depth({"12"}), 2u);
+    // Sibling under the new first level node
+    EXPECT_EQ(tree.stride_depth({"13"}), 1u);
+    EXPECT_EQ(tree.stride_depth({"23"}), 0u);
+}
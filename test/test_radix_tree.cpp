@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "src/prefix_tree.h"
+#include "src/radix_tree.h"
+#include "src/visit_stats.h"
+
+using namespace code_directory;
+
+typedef RadixTree<std::string> RTree;
+typedef PrefixTree<std::string> PTree;
+
+class CountNodes {
+public:
+    CountNodes() :
+        count(0),
+        with_data(0)
+    {}
+    bool visit(const RTree::node_t &node) {
+        count++;
+        if (!is_empty(node.data())) {
+            with_data++;
+        }
+        return true;
+    }
+    int count;
+    int with_data;
+};
+
+TEST(radix_tree, compressed_edges) {
+    RTree tree;
+    tree.put_data({"8613800138000"}, "mobile");
+
+    CountNodes stats;
+    tree.accept(stats);
+    EXPECT_EQ(stats.count, 2);
+    EXPECT_EQ(stats.with_data, 1);
+
+    size_t match;
+    auto node = tree.maximum_matching_node({"86138"}, &match);
+    EXPECT_EQ(match, 5u);
+    EXPECT_EQ(node->code(), code_string{"8613800138000"});
+    EXPECT_EQ(tree.exactly_matching_node({"86138"}), nullptr);
+    EXPECT_TRUE(tree.data_for_max_match({"86138"}, &match).empty());
+    EXPECT_EQ(tree.data_for_max_match({"861380013800012"}, &match), "mobile");
+
+    // Splits the edge at "86"
+    tree.put_data({"86"}, "china");
+    tree.put_data({"8620"}, "guangzhou");
+    CountNodes split;
+    tree.accept(split);
+    EXPECT_EQ(split.count, 4);
+    EXPECT_EQ(split.with_data, 3);
+    EXPECT_EQ(tree.data_for_max_match({"86138"}, &match), "china");
+    EXPECT_EQ(tree.data_for_max_match({"8620555"}, &match), "guangzhou");
+    EXPECT_EQ(tree.exactly_matching_node({"86"})->data(), "china");
+    EXPECT_EQ(tree.exactly_matching_node({"8613800138000"})->parent(),
+              tree.exactly_matching_node({"86"}));
+
+    // Diverging inside an edge creates an empty branching node
+    tree.put_data({"8613900"}, "other");
+    EXPECT_EQ(tree.exactly_matching_node({"8613"})->data(), "");
+    EXPECT_EQ(tree.exactly_matching_node({"8613"})->children_count(), 2u);
+    EXPECT_EQ(tree.data_for_max_match({"861390012"}, &match), "other");
+    EXPECT_EQ(tree.data_for_max_match({"86138"}, &match), "china");
+}
+
+TEST(radix_tree, tester) {
+    RTree tree;
+    tree.put_data({"86123"}, "first");
+    tree.put_data({"86123"}, "second", [](const std::string &old) { return old.empty(); });
+    EXPECT_EQ(tree.exactly_matching_node({"86123"})->data(), "first");
+    tree.put_data({"86"}, "inside", [](const std::string &old) { return old.empty(); });
+    EXPECT_EQ(tree.exactly_matching_node({"86"})->data(), "inside");
+}
+
+class CollectData {
+public:
+    bool visit(const RTree::node_t &node) {
+        if (!is_empty(node.data())) {
+            codes.push_back(node.code());
+        }
+        return true;
+    }
+    std::vector<std::string> codes;
+};
+
+TEST(radix_tree, same_as_prefix_tree) {
+    RTree radix;
+    PTree prefix;
+    std::srand(27);
+    std::vector<std::string> codes;
+    for (size_t i = 0; i < 2000; ++i) {
+        std::string code = std::to_string(std::rand() % 1000);
+        size_t tail = std::rand() % 9;
+        for (size_t j = 0; j < tail; ++j) {
+            code += char('0' + std::rand() % 10);
+        }
+        codes.push_back(code);
+        radix.put_data(code_string{code.c_str()}, code);
+        prefix.put_data(code_string{code.c_str()}, code);
+    }
+
+    for (size_t i = 0; i < 5000; ++i) {
+        std::string number = std::to_string(std::rand() % 1000);
+        while (number.length() < 12) {
+            number += char('0' + std::rand() % 10);
+        }
+        code_string code{number.substr(0, 1 + std::rand() % 12).c_str()};
+        size_t radix_match, prefix_match;
+        EXPECT_EQ(radix.data_for_max_match(code, &radix_match),
+                  prefix.data_for_max_match(code, &prefix_match));
+        EXPECT_EQ(radix_match, prefix_match);
+
+        // Subtrees below the matched position hold the same codes
+        CollectData radix_codes, prefix_codes;
+        radix.maximum_matching_node(code, &radix_match)->accept(radix_codes);
+        prefix.maximum_matching_node(code, &prefix_match)->accept(prefix_codes);
+        EXPECT_EQ(radix_codes.codes, prefix_codes.codes);
+    }
+    for (const auto &code: codes) {
+        auto node = radix.exactly_matching_node(code_string{code.c_str()});
+        ASSERT_NE(node, nullptr);
+        EXPECT_EQ(node->data(), prefix.exactly_matching_node(code_string{code.c_str()})->data());
+    }
+}
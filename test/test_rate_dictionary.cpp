@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include <boost/smart_ptr/make_shared.hpp>
+
+#include "src/compact_trie.h"
+#include "src/rate_dictionary.h"
+
+using namespace code_directory;
+
+TEST(rate_dictionary, order_preserving) {
+    RateDictionary dictionary;
+    dictionary.add(Rate{{"0.5"}, 0, 10});
+    dictionary.add(Rate{{"0.01"}, 5, 10});
+    dictionary.add(Rate{{"0.01"}, 0, 10});
+    dictionary.add(Rate{{"0.5"}, 0, 10});
+    dictionary.add(Rate{});
+    EXPECT_THROW(dictionary.id(Rate{{"0.5"}, 0, 10}), std::logic_error);
+    dictionary.freeze();
+    EXPECT_THROW(dictionary.add(Rate{{"0.7"}, 0, 10}), std::logic_error);
+
+    // Duplicates and empty rates are not stored
+    EXPECT_EQ(dictionary.size(), 3u);
+    auto low = dictionary.id(Rate{{"0.01"}, 0, 10});
+    auto low_later = dictionary.id(Rate{{"0.01"}, 5, 10});
+    auto high = dictionary.id(Rate{{"0.5"}, 0, 10});
+    EXPECT_LT(low, low_later);
+    EXPECT_LT(low_later, high);
+    EXPECT_LT(high, RateDictionary::empty_id);
+    EXPECT_EQ(dictionary.id(Rate{}), RateDictionary::empty_id);
+    EXPECT_TRUE(dictionary.rate(RateDictionary::empty_id).is_empty());
+    EXPECT_EQ(dictionary.rate(low_later).rate, rate_string{"0.01"});
+    EXPECT_EQ(dictionary.rate(low_later).effective_date, 5);
+    EXPECT_THROW(dictionary.id(Rate{{"0.5"}, 1, 10}), std::out_of_range);
+}
+
+TEST(rate_dictionary, shared_by_tries) {
+    VendorTree first, second;
+    first.add_rate({"86"}, {"0.03"}, 0, 1);
+    first.add_rate({"8613"}, {"0.01"}, 0, 1);
+    second.add_rate({"86"}, {"0.01"}, 0, 1);
+    second.add_rate({"44"}, {"0.2"}, 0, 1);
+
+    auto dictionary = boost::make_shared<RateDictionary>();
+    dictionary->add(first);
+    dictionary->add(second);
+    dictionary->freeze();
+    EXPECT_EQ(dictionary->size(), 3u);
+
+    CompactVendorTrie first_trie(first, dictionary), second_trie(second, dictionary);
+    EXPECT_EQ(&first_trie.dictionary(), &second_trie.dictionary());
+    EXPECT_EQ(first_trie.get_maximum_prefix_rate({"861390"}), rate_string{"0.01"});
+    EXPECT_EQ(second_trie.get_maximum_prefix_rate({"4420"}), rate_string{"0.2"});
+
+    // Cheaper rate found by ids alone
+    auto a = first_trie.rate_id(first_trie.max_match({"8620"}));
+    auto b = second_trie.rate_id(second_trie.max_match({"8620"}));
+    EXPECT_LT(b, a);
+    EXPECT_EQ(first_trie.rate_id(0), RateDictionary::empty_id);
+
+    // Rate missing from the dictionary
+    VendorTree other;
+    other.add_rate({"1"}, {"0.9"}, 0, 1);
+    EXPECT_THROW(CompactVendorTrie(other, dictionary), std::out_of_range);
+}
@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include "src/shared_trie_store.h"
+#include "src/vendor_tree.h"
+
+using namespace code_directory;
+
+static void fill_tree(VendorTree &tree) {
+    tree.add_rate({"86"},       {"0.005"}, 0, 1);
+    tree.add_rate({"86755"},    {"0.004"}, 0, 1);
+    tree.add_rate({"8621"},     {"0.003"}, 0, 1);
+    tree.add_rate({"8620"},     {"0.002"}, 0, 1);
+}
+
+TEST(shared_trie_store, identical_trees) {
+    SharedTrieStore store;
+    VendorTree first, second;
+    fill_tree(first);
+    fill_tree(second);
+
+    auto first_root = store.intern(first);
+    auto stats = store.stats();
+    // "", 8, 86, 862, 8620, 8621, 867, 8675, 86755
+    EXPECT_EQ(stats.logical_nodes, 9u);
+    EXPECT_EQ(stats.unique_nodes, 9u);
+
+    auto second_root = store.intern(second);
+    EXPECT_EQ(second_root.get(), first_root.get());
+    stats = store.stats();
+    EXPECT_EQ(stats.logical_nodes, 18u);
+    EXPECT_EQ(stats.unique_nodes, 9u);
+    EXPECT_GT(stats.bytes_saved, 0u);
+
+    first_root.reset();
+    EXPECT_EQ(store.stats().unique_nodes, 9u);
+    second_root.reset();
+    EXPECT_EQ(store.stats().unique_nodes, 0u);
+    EXPECT_EQ(store.stats().logical_nodes, 0u);
+}
+
+TEST(shared_trie_store, shared_subtrees) {
+    SharedTrieStore store;
+    VendorTree first, second;
+    fill_tree(first);
+    fill_tree(second);
+    second.add_rate({"44"}, {"0.1"}, 0, 1);
+    second.add_rate({"4420"}, {"0.002"}, 0, 1);
+
+    auto first_root = store.intern(first);
+    auto second_root = store.intern(second);
+    EXPECT_NE(second_root.get(), first_root.get());
+    // New root, 4, 44 and 442; "8" subtree is shared and "4420" reuses leaf of "8620"
+    EXPECT_EQ(store.stats().unique_nodes, 9u + 4u);
+    EXPECT_EQ(first_root->get_child(8), second_root->get_child(8));
+
+    for (auto code: { "86", "8620", "86201", "862", "8", "867551", "44", "44209", "4" }) {
+        EXPECT_EQ(SharedTrieStore::get_maximum_prefix_rate(*second_root, code_string{code}),
+                  second.get_maximum_prefix_rate(code_string{code}));
+    }
+    EXPECT_NE(SharedTrieStore::exactly_matching_node(*second_root, {"4420"}), nullptr);
+    EXPECT_EQ(SharedTrieStore::exactly_matching_node(*first_root, {"4420"}), nullptr);
+
+    first_root.reset();
+    EXPECT_EQ(store.stats().unique_nodes, 9u + 4u - 1u);
+}
@@ -0,0 +1,183 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "src/shm_directory.h"
+
+using namespace code_directory;
+
+namespace {
+
+typedef std::set<CodeDirectory::rates_result_t::value_type> rates_set_t;
+
+template<class Directory>
+rates_set_t rates_set(const Directory &directory,
+                      VendorId vendor,
+                      const codename_t &codename,
+                      rate_string *min,
+                      rate_string *max) {
+    auto rates = directory.get_rates(vendor, codename, min, max);
+    return rates_set_t(rates.begin(), rates.end());
+}
+
+std::string shm_name(const char *test) {
+    return std::string("/code_directory_test_") + test + "_" + std::to_string(getpid());
+}
+
+template<class Directory>
+void fill(Directory &directory) {
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"86"},  {"China Proper"});
+    codenames->add_code({"8613"}, {"China Mobile"});
+    codenames->add_code({"8620"}, {"China Proper"});
+    codenames->add_code({"8653"}, {"China CNC"});
+    codenames->add_code({"867"}, {"Example"});
+    directory.set_codename_tree(codenames);
+
+    auto vendorA = boost::make_shared<VendorTree>();
+    vendorA->add_rate({"86"},       {"0.005"}, 0, 1);
+    vendorA->add_rate({"86755"},    {"0.004"}, 0, 1);
+    vendorA->add_rate({"8621"},     {"0.003"}, 0, 1);
+    vendorA->add_rate({"8620"},     {"0.002"}, 0, 1);
+    vendorA->add_rate({"862010"},   {"0.001"}, 0, 1);
+    vendorA->add_rate({"8610"},     {"0.006"}, 0, 1);
+    vendorA->add_rate({"86130"},    {"0.009"}, 0, 1);
+    directory.set_vendor_tree(1, vendorA);
+
+    auto vendorB = boost::make_shared<VendorTree>();
+    vendorB->add_rate({"86"},       {"0.002"}, 0, 1);
+    directory.set_vendor_tree(2, vendorB);
+
+    auto vendorC = boost::make_shared<VendorTree>();
+    vendorC->add_rate({"86"},       {"0.006"}, 0, 1);
+    vendorC->add_rate({"862"},      {"0.003"}, 0, 1);
+    vendorC->add_rate({"86102"},    {"0.002"}, 0, 1);
+    vendorC->add_rate({"8610"},     {"0.004"}, 0, 1);
+    vendorC->add_rate({"86715"},    {"0.01"}, 0, 1);
+    vendorC->add_rate({"8653"},     {"0.02"}, 0, 1);
+    directory.set_vendor_tree(3, vendorC);
+    directory.set_vendor_tree(4, boost::make_shared<VendorTree>());
+    directory.remove_vendor(4);
+}
+
+}
+
+TEST(ShmDirectory, same_as_code_directory) {
+    const auto name = shm_name("same");
+    CodeDirectory expected;
+    fill(expected);
+    ShmDirectoryPublisher publisher(name);
+    fill(publisher);
+    publisher.publish();
+    ShmDirectory directory(name);
+
+    auto vendors = expected.list_vendors();
+    std::sort(vendors.begin(), vendors.end());
+    EXPECT_EQ(directory.list_vendors(), vendors);
+    auto codenames = expected.list_codenames();
+    std::sort(codenames.begin(), codenames.end());
+    EXPECT_EQ(directory.list_codenames(), codenames);
+
+    for (auto vendor: vendors) {
+        for (const auto &codename: codenames) {
+            rate_string expected_min, expected_max, min, max;
+            EXPECT_EQ(rates_set(directory, vendor, codename, &min, &max),
+                      rates_set(expected, vendor, codename, &expected_min, &expected_max));
+            EXPECT_EQ(min, expected_min);
+            EXPECT_EQ(max, expected_max);
+        }
+    }
+    for (const auto &codename: codenames) {
+        auto expected_vendors = expected.get_vendors(codename);
+        std::sort(expected_vendors.begin(), expected_vendors.end(),
+                  [](const CodeDirectory::vendors_result_s &left, const CodeDirectory::vendors_result_s &right) {
+            return left.vendor < right.vendor;
+        });
+        EXPECT_EQ(directory.get_vendors(codename), expected_vendors);
+    }
+
+    rate_string min, max;
+    EXPECT_THROW(directory.get_rates(5, {"China Proper"}, &min, &max), std::out_of_range);
+    EXPECT_THROW(directory.get_rates(1, {"Nowhere"}, &min, &max), std::out_of_range);
+    EXPECT_THROW(directory.get_vendors({"Nowhere"}), std::out_of_range);
+
+    ShmDirectoryPublisher::remove(name);
+}
+
+TEST(ShmDirectory, generations) {
+    const auto name = shm_name("generations");
+    EXPECT_THROW(ShmDirectory{name}, std::system_error);
+    EXPECT_THROW(ShmDirectoryPublisher{"no_slash"}, std::invalid_argument);
+
+    ShmDirectoryPublisher publisher(name);
+    ShmDirectory directory(name);
+    EXPECT_EQ(directory.generation(), 0u);
+    EXPECT_TRUE(directory.list_vendors().empty());
+
+    fill(publisher);
+    EXPECT_EQ(publisher.publish(), 1u);
+    EXPECT_EQ(directory.generation(), 1u);
+    rate_string min, max;
+    directory.get_rates(2, {"China Proper"}, &min, &max);
+    EXPECT_EQ(min, rate_string{"0.002"});
+
+    // Workers switch on the next query
+    auto vendorB = boost::make_shared<VendorTree>();
+    vendorB->add_rate({"86"}, {"0.008"}, 0, 1);
+    publisher.set_vendor_tree(2, vendorB);
+    EXPECT_EQ(publisher.publish(), 2u);
+    directory.get_rates(2, {"China Proper"}, &min, &max);
+    EXPECT_EQ(min, rate_string{"0.008"});
+    EXPECT_EQ(directory.generation(), 2u);
+
+    // Generation before the previous one is unlinked
+    publisher.remove_vendor(2);
+    EXPECT_EQ(publisher.publish(), 3u);
+    int fd = shm_open((name + ".1").c_str(), O_RDONLY, 0);
+    EXPECT_LT(fd, 0);
+    fd = shm_open((name + ".2").c_str(), O_RDONLY, 0);
+    EXPECT_GE(fd, 0);
+    close(fd);
+    EXPECT_TRUE(directory.get_rates(2, {"China Proper"}, &min, &max).empty());
+    EXPECT_TRUE(min.is_empty());
+
+    // Next loader continues numbering
+    {
+        ShmDirectoryPublisher restarted(name);
+        fill(restarted);
+        EXPECT_EQ(restarted.publish(), 4u);
+    }
+    directory.get_rates(2, {"China Proper"}, &min, &max);
+    EXPECT_EQ(min, rate_string{"0.002"});
+
+    ShmDirectoryPublisher::remove(name);
+    fd = shm_open(name.c_str(), O_RDONLY, 0);
+    EXPECT_LT(fd, 0);
+    // Attached worker still has its mapping
+    EXPECT_EQ(directory.get_vendors({"China Proper"}).size(), 3u);
+}
+
+TEST(ShmDirectory, other_process) {
+    const auto name = shm_name("process");
+    ShmDirectoryPublisher publisher(name);
+    fill(publisher);
+    publisher.publish();
+
+    auto child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        ShmDirectory directory(name);
+        rate_string min, max;
+        auto rates = directory.get_rates(1, {"China Proper"}, &min, &max);
+        _exit(rates.size() == 5 && min == rate_string{"0.001"} && max == rate_string{"0.006"} ? 0 : 1);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    ShmDirectoryPublisher::remove(name);
+}
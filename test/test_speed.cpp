@@ -1,10 +1,35 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <numeric>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
+#include "src/binary_client.h"
+#include "src/binary_server.h"
+#include "src/cdr_pipeline.h"
+#include "src/code_directory.h"
 #include "src/codename.h"
+#include "src/compact_trie.h"
+#include "src/journal.h"
+#include "src/prefix_tree.h"
+#include "src/query_arena.h"
+#include "src/radix_tree.h"
+#include "src/rate.h"
+#include "src/rate_dictionary.h"
+#include "src/static_index.h"
+#include "src/vendor_tree.h"
+#include "src/visit_stats.h"
+
+using namespace code_directory;
 
 #define SAMPLES 1'000'000
 static const uint64_t random_sum = 1073890749828105;
@@ -33,3 +58,763 @@ TEST(random, vector_generate) {
     EXPECT_EQ(random_sum, std::accumulate(vec.begin(), vec.end(), uint64_t(0)));
 }
 
+
+struct deck_entry_s {
+    std::string code;
+    std::string rate;
+};
+typedef std::vector<deck_entry_s> deck_t;
+
+static std::string random_digits(size_t count) {
+    std::string ret;
+    for (size_t i = 0; i < count; ++i) {
+        ret += char('0' + std::rand() % 10);
+    }
+    return ret;
+}
+
+/**
+ * Real-shaped deck: country codes of 1-3 digits, each with a few dense
+ * area codes and many sparse 11-12 digit mobile ranges.
+ */
+static deck_t make_deck(size_t countries, unsigned seed) {
+    std::srand(seed);
+    deck_t deck;
+    for (size_t country = 0; country < countries; ++country) {
+        auto cc = std::to_string(1 + std::rand() % 999);
+        deck.push_back({cc, "0." + random_digits(3)});
+        for (size_t area = 0; area < 20; ++area) {
+            deck.push_back({cc + random_digits(2 + std::rand() % 2), "0." + random_digits(3)});
+        }
+        for (size_t mobile = 0; mobile < 50; ++mobile) {
+            deck.push_back({cc + random_digits(8 + std::rand() % 2), "0." + random_digits(4)});
+        }
+    }
+    return deck;
+}
+
+/// Dialed numbers that fall under codes of \p deck
+static std::vector<code_string> make_numbers(const deck_t &deck, size_t count, unsigned seed) {
+    std::srand(seed);
+    std::vector<code_string> numbers;
+    numbers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto number = deck[std::rand() % deck.size()].code;
+        number += random_digits(number.length() < 12 ? 12 - number.length() : 0);
+        numbers.emplace_back(number.c_str());
+    }
+    return numbers;
+}
+
+template<class Tree>
+static void fill_tree(Tree &tree, const deck_t &deck) {
+    for (const auto &entry: deck) {
+        tree.put_data(code_string{entry.code.c_str()}, Rate{rate_string{entry.rate.c_str()}, 0, 1});
+    }
+}
+
+/// Node memory of a tree, without heap parts of long code strings
+template<class Tree>
+static size_t tree_bytes(const Tree &tree) {
+    StatsRates stats;
+    tree.accept(stats);
+    return stats.count * sizeof(typename Tree::node_t);
+}
+
+template<class Function>
+static double seconds(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+TEST(speed, radix_tree) {
+    auto deck = make_deck(200, 27);
+    auto numbers = make_numbers(deck, 200000, 28);
+
+    PrefixTree<Rate> prefix;
+    RadixTree<Rate> radix;
+    fill_tree(prefix, deck);
+    fill_tree(radix, deck);
+
+    size_t prefix_sum = 0, radix_sum = 0;
+    auto prefix_time = seconds([&]() {
+        size_t match;
+        for (const auto &number: numbers) {
+            prefix_sum += prefix.data_for_max_match(number, &match).rate.value;
+        }
+    });
+    auto radix_time = seconds([&]() {
+        size_t match;
+        for (const auto &number: numbers) {
+            radix_sum += radix.data_for_max_match(number, &match).rate.value;
+        }
+    });
+    EXPECT_EQ(prefix_sum, radix_sum);
+
+    std::cout << "Deck of " << deck.size() << " codes" << std::endl
+              << "PrefixTree: " << tree_bytes(prefix) << " bytes, "
+              << numbers.size() / prefix_time << " LPM/s" << std::endl
+              << "RadixTree:  " << tree_bytes(radix) << " bytes, "
+              << numbers.size() / radix_time << " LPM/s" << std::endl;
+    EXPECT_LT(tree_bytes(radix), tree_bytes(prefix));
+}
+
+TEST(speed, batch_lpm) {
+    auto deck = make_deck(200, 28);
+    auto numbers = make_numbers(deck, 200000, 29);
+
+    VendorTree tree;
+    for (const auto &entry: deck) {
+        tree.add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+    }
+
+    uint64_t scalar_sum = 0, batch_sum = 0;
+    auto scalar_time = seconds([&]() {
+        for (const auto &number: numbers) {
+            scalar_sum += tree.get_maximum_prefix_rate(number).value;
+        }
+    });
+    auto batch_time = seconds([&]() {
+        for (auto rate: tree.get_maximum_prefix_rates(numbers)) {
+            batch_sum += rate.value;
+        }
+    });
+    EXPECT_EQ(scalar_sum, batch_sum);
+
+    std::cout << "Scalar LPM: " << numbers.size() / scalar_time << " lookups/s" << std::endl
+              << "Batch LPM:  " << numbers.size() / batch_time << " lookups/s" << std::endl;
+}
+
+template<size_t Stride>
+static double stride_lookups(const deck_t &deck, const std::vector<code_string> &numbers, uint64_t *sum) {
+    PrefixTree<Rate, is_empty<Rate>, Stride> tree;
+    fill_tree(tree, deck);
+    return numbers.size() / seconds([&]() {
+        size_t match;
+        for (const auto &number: numbers) {
+            *sum += tree.data_for_max_match(number, &match).rate.value;
+        }
+    });
+}
+
+TEST(speed, stride_table) {
+    auto deck = make_deck(200, 29);
+    auto numbers = make_numbers(deck, 200000, 30);
+
+    uint64_t sum0 = 0, sum2 = 0, sum3 = 0;
+    auto stride0 = stride_lookups<0>(deck, numbers, &sum0);
+    auto stride2 = stride_lookups<2>(deck, numbers, &sum2);
+    auto stride3 = stride_lookups<3>(deck, numbers, &sum3);
+    EXPECT_EQ(sum0, sum2);
+    EXPECT_EQ(sum0, sum3);
+
+    std::cout << "Stride 0: " << stride0 << " LPM/s" << std::endl
+              << "Stride 2: " << stride2 << " LPM/s" << std::endl
+              << "Stride 3: " << stride3 << " LPM/s" << std::endl;
+}
+
+/// Directory of \p vendors vendors over the same countries, with codename per country
+static void fill_directory(CodeDirectory &directory, size_t vendors, size_t countries) {
+    auto codenames = boost::make_shared<CodenameTree>();
+    for (const auto &entry: make_deck(countries, 31)) {
+        if (entry.code.length() <= 3) {
+            codenames->add_code(code_string{entry.code.c_str()}, "Country " + entry.code);
+        }
+    }
+    directory.set_codename_tree(codenames);
+    for (size_t vendor = 0; vendor < vendors; ++vendor) {
+        auto tree = boost::make_shared<VendorTree>();
+        for (const auto &entry: make_deck(countries, 31)) {
+            // Same codes for every vendor, but different rates
+            auto rate = "0." + std::to_string(100 + (std::rand() % 900));
+            tree->add_rate(code_string{entry.code.c_str()}, rate_string{rate.c_str()}, 0, 1);
+        }
+        directory.set_vendor_tree(VendorId(vendor), tree);
+    }
+}
+
+TEST(speed, cheapest_vendors) {
+    CodeDirectory directory;
+    fill_directory(directory, 300, 10);
+    auto codenames = directory.list_codenames();
+
+    const size_t repeat = 20;
+    size_t sorted_count = 0, top_count = 0;
+    auto sorted_time = seconds([&]() {
+        for (size_t i = 0; i < repeat; ++i) {
+            for (const auto &codename: codenames) {
+                auto vendors = directory.get_vendors(codename);
+                std::sort(vendors.begin(), vendors.end(),
+                          [](const CodeDirectory::vendors_result_s &left,
+                             const CodeDirectory::vendors_result_s &right) {
+                    return left.min < right.min;
+                });
+                sorted_count += std::min<size_t>(vendors.size(), 5);
+            }
+        }
+    });
+    auto top_time = seconds([&]() {
+        for (size_t i = 0; i < repeat; ++i) {
+            for (const auto &codename: codenames) {
+                top_count += directory.get_cheapest_vendors(codename, 5).size();
+            }
+        }
+    });
+    EXPECT_EQ(sorted_count, top_count);
+
+    auto queries = repeat * codenames.size();
+    std::cout << "Top 5 of 300 vendors, get_vendors and sort: "
+              << queries / sorted_time << " queries/s" << std::endl
+              << "Top 5 of 300 vendors, get_cheapest_vendors: "
+              << queries / top_time << " queries/s" << std::endl;
+}
+
+TEST(speed, coverage) {
+    // 300 vendors, each with rates for a tenth of the countries
+    CodeDirectory directory;
+    directory.set_cache_capacity(0);
+    auto deck = make_deck(50, 37);
+    auto codenames = boost::make_shared<CodenameTree>();
+    for (const auto &entry: deck) {
+        if (entry.code.length() <= 3) {
+            codenames->add_code(code_string{entry.code.c_str()}, "Country " + entry.code);
+        }
+    }
+    directory.set_codename_tree(codenames);
+    std::srand(38);
+    for (VendorId vendor = 0; vendor < 300; ++vendor) {
+        auto tree = boost::make_shared<VendorTree>();
+        std::string country;
+        bool serving = false;
+        for (const auto &entry: deck) {
+            if (entry.code.length() <= 3) {
+                country = entry.code;
+                serving = std::rand() % 10 == 0;
+            }
+            if (serving) {
+                tree->add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+            }
+        }
+        directory.set_vendor_tree(vendor, tree);
+    }
+    auto names = directory.list_codenames();
+
+    size_t pairs = 0, serving = 0;
+    auto rates_time = seconds([&]() {
+        for (VendorId vendor = 0; vendor < 300; ++vendor) {
+            for (const auto &codename: names) {
+                rate_string min, max;
+                serving += directory.get_rates(vendor, codename, &min, &max).empty() ? 0 : 1;
+                ++pairs;
+            }
+        }
+    });
+    size_t vendors = 0;
+    auto vendors_time = seconds([&]() {
+        for (int i = 0; i < 100; ++i) {
+            for (const auto &codename: names) {
+                vendors += directory.get_vendors(codename).size();
+            }
+        }
+    });
+    EXPECT_EQ(vendors, serving * 100);
+
+    std::cout << "get_rates of 300 vendors x " << names.size() << " codenames, "
+              << serving << " pairs served: " << pairs / rates_time << " queries/s" << std::endl
+              << "get_vendors of 300 vendors serving a tenth: "
+              << 100 * names.size() / vendors_time << " queries/s" << std::endl;
+}
+
+TEST(speed, get_vendors_batch) {
+    CodeDirectory directory;
+    directory.set_cache_capacity(0);
+    fill_directory(directory, 300, 50);
+    auto names = directory.list_codenames();
+
+    const size_t repeat = 20;
+    size_t single_count = 0, batch_count = 0;
+    auto single_time = seconds([&]() {
+        for (size_t i = 0; i < repeat; ++i) {
+            for (const auto &codename: names) {
+                single_count += directory.get_vendors(codename).size();
+            }
+        }
+    });
+    auto batch_time = seconds([&]() {
+        for (size_t i = 0; i < repeat; ++i) {
+            for (const auto &vendors: directory.get_vendors_batch(names)) {
+                batch_count += vendors.size();
+            }
+        }
+    });
+    EXPECT_EQ(single_count, batch_count);
+
+    auto queries = repeat * names.size();
+    std::cout << "get_vendors of 300 vendors, one codename at a time: "
+              << queries / single_time << " codenames/s" << std::endl
+              << "get_vendors_batch of " << names.size() << " codenames: "
+              << queries / batch_time << " codenames/s" << std::endl;
+}
+
+TEST(speed, reload_fingerprints) {
+    // 100 vendor decks of 2000 "code,rate" lines; 5 change between reloads
+    const size_t vendors = 100, changing = 5, cycles = 10;
+    std::srand(50);
+    std::vector<std::string> decks(vendors);
+    for (auto &deck: decks) {
+        for (int i = 0; i < 2000; ++i) {
+            deck += "86" + random_digits(5) + ",0." + random_digits(4) + "\n";
+        }
+    }
+    auto parse = [](const std::string &deck) {
+        auto tree = boost::make_shared<VendorTree>();
+        std::istringstream lines(deck);
+        std::string line;
+        while (std::getline(lines, line)) {
+            auto comma = line.find(',');
+            tree->add_rate(code_string{line.substr(0, comma).c_str()},
+                           rate_string{line.substr(comma + 1).c_str()}, 0, 1);
+        }
+        return CodeDirectory::tree_pointer_t(tree);
+    };
+
+    CodeDirectory full, skipping;
+    size_t changed = 0;
+    auto full_time = seconds([&]() {
+        for (size_t cycle = 0; cycle < cycles; ++cycle) {
+            for (size_t vendor = 0; vendor < vendors; ++vendor) {
+                full.set_vendor_tree(VendorId(vendor), parse(decks[vendor]));
+            }
+        }
+    });
+    auto skipping_time = seconds([&]() {
+        for (size_t cycle = 0; cycle < cycles; ++cycle) {
+            for (size_t i = 0; i < changing && cycle > 0; ++i) {
+                decks[(cycle * changing + i) % vendors] += "8600,0.01\n";
+            }
+            skipping.begin_reload();
+            for (size_t vendor = 0; vendor < vendors; ++vendor) {
+                const auto &deck = decks[vendor];
+                skipping.reload_vendor_tree(VendorId(vendor), CodeDirectory::fingerprint(deck),
+                                            [&]() { return parse(deck); });
+            }
+            changed += skipping.end_reload().changed.size();
+        }
+    });
+    EXPECT_EQ(changed, vendors + (cycles - 1) * changing);
+
+    std::cout << "Reload of " << vendors << " decks, " << changing << " changed: "
+              << cycles / full_time << " cycles/s parsing all, "
+              << cycles / skipping_time << " cycles/s skipping unchanged" << std::endl;
+}
+
+TEST(speed, parallel_get_rates) {
+    // One codename of 4000 area codes with 10 rates under each
+    auto codenames = boost::make_shared<CodenameTree>();
+    auto vendor = boost::make_shared<VendorTree>();
+    std::srand(39);
+    for (int area = 0; area < 4000; ++area) {
+        auto code = "1" + std::to_string(1000 + area);
+        codenames->add_code(code_string{code.c_str()}, "Big");
+        for (int i = 0; i < 10; ++i) {
+            auto rate = "0." + random_digits(4);
+            vendor->add_rate(code_string{(code + random_digits(4)).c_str()}, rate_string{rate.c_str()}, 0, 1);
+        }
+    }
+    CodeDirectory directory;
+    directory.set_cache_capacity(0);
+    directory.set_codename_tree(codenames);
+    directory.set_vendor_tree(1, vendor);
+
+    const size_t threads = std::max(4u, std::thread::hardware_concurrency());
+    size_t serial_count = 0, parallel_count = 0;
+    directory.set_parallelism(1);
+    auto serial = seconds([&]() {
+        for (int i = 0; i < 10; ++i) {
+            serial_count += directory.get_rates(1, "Big", nullptr, nullptr).size();
+        }
+    });
+    directory.set_parallelism(threads);
+    auto parallel = seconds([&]() {
+        for (int i = 0; i < 10; ++i) {
+            parallel_count += directory.get_rates(1, "Big", nullptr, nullptr).size();
+        }
+    });
+    EXPECT_EQ(serial_count, parallel_count);
+
+    std::cout << "get_rates of 4000 codes, " << serial_count / 10 << " rates, 1 thread: "
+              << serial / 10 * 1e3 << " ms" << std::endl
+              << "get_rates of 4000 codes, " << serial_count / 10 << " rates, " << threads << " threads: "
+              << parallel / 10 * 1e3 << " ms" << std::endl;
+}
+
+TEST(speed, query_arena) {
+    CodeDirectory directory;
+    fill_directory(directory, 100, 10);
+    auto vendors = directory.list_vendors();
+    auto codenames = directory.list_codenames();
+    const size_t threads = std::max(4u, std::thread::hardware_concurrency());
+    const size_t repeat = 3;
+
+    // Every thread asks for every pair
+    auto run = [&](bool arena) {
+        std::vector<size_t> counts(threads, 0);
+        auto time = seconds([&]() {
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t]() {
+                    for (size_t i = 0; i < repeat; ++i) {
+                        for (auto vendor: vendors) {
+                            for (const auto &codename: codenames) {
+                                rate_string min, max;
+                                if (arena) {
+                                    ArenaScope scope;
+                                    counts[t] += directory.get_rates(vendor, codename, &min, &max,
+                                                                     scope.resource()).size();
+                                } else {
+                                    counts[t] += directory.get_rates(vendor, codename, &min, &max).size();
+                                }
+                            }
+                        }
+                    }
+                });
+            }
+            for (auto &worker: workers) {
+                worker.join();
+            }
+        });
+        return std::make_pair(std::accumulate(counts.begin(), counts.end(), size_t(0)),
+                              threads * repeat * vendors.size() * codenames.size() / time);
+    };
+    for (size_t capacity: { size_t(0), DEFAULT_CACHE_CAPACITY }) {
+        directory.set_cache_capacity(capacity);
+        auto heap = run(false);
+        auto arena = run(true);
+        EXPECT_EQ(heap.first, arena.first);
+        std::cout << "get_rates on " << threads << " threads, cache " << capacity << ", global heap: "
+                  << heap.second << " queries/s" << std::endl
+                  << "get_rates on " << threads << " threads, cache " << capacity << ", thread arena: "
+                  << arena.second << " queries/s" << std::endl;
+    }
+}
+
+TEST(speed, scheduled_activation) {
+    CodeDirectory directory;
+    fill_directory(directory, 10, 20);
+    time_t now = 0;
+    directory.set_clock([&now]() { return now; });
+
+    auto tree = boost::make_shared<VendorTree>();
+    for (const auto &entry: make_deck(200, 36)) {
+        tree->add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+    }
+    // New vendors: time to free a replaced tree is not counted
+    auto publish = seconds([&]() {
+        directory.set_vendor_tree(10, tree);
+    });
+    // Only published vendors can be scheduled
+    directory.set_vendor_tree(11, nullptr);
+    directory.schedule_vendor_tree(11, tree, 100);
+    now = 100;
+    auto activate = seconds([&]() {
+        EXPECT_EQ(directory.run_due(), 1u);
+    });
+
+    std::cout << "Deck of 200 countries, set_vendor_tree: " << publish * 1e6 << " us" << std::endl
+              << "Deck of 200 countries, scheduled activation: " << activate * 1e6 << " us" << std::endl;
+}
+
+TEST(speed, rate_matrix) {
+    CodeDirectory directory;
+    fill_directory(directory, 300, 10);
+    directory.set_cache_capacity(0);
+    auto vendors = directory.list_vendors();
+    auto codenames = directory.list_codenames();
+
+    size_t pair_rates = 0;
+    auto pairs_time = seconds([&]() {
+        for (auto vendor: vendors) {
+            for (const auto &codename: codenames) {
+                rate_string min, max;
+                pair_rates += directory.get_rates(vendor, codename, &min, &max).size();
+            }
+        }
+    });
+    auto export_time = [&directory](size_t threads, size_t &rates) {
+        return seconds([&]() {
+            directory.export_rate_matrix([&rates](VendorId, const codename_t &,
+                                                  const CodeDirectory::rates_result_t &row,
+                                                  const rate_string &, const rate_string &) {
+                rates += row.size();
+            }, threads);
+        });
+    };
+    size_t single_rates = 0, parallel_rates = 0;
+    auto single_time = export_time(1, single_rates);
+    auto parallel_time = export_time(0, parallel_rates);
+    EXPECT_EQ(pair_rates, single_rates);
+    EXPECT_EQ(pair_rates, parallel_rates);
+
+    std::cout << "Matrix of 300 vendors x " << codenames.size() << " codenames, get_rates per pair: "
+              << pairs_time << " s" << std::endl
+              << "Matrix of 300 vendors x " << codenames.size() << " codenames, trie join: "
+              << single_time << " s" << std::endl
+              << "Matrix of 300 vendors x " << codenames.size() << " codenames, trie join, all cores: "
+              << parallel_time << " s" << std::endl;
+}
+
+TEST(speed, cdr_pipeline) {
+    CodeDirectory directory;
+    fill_directory(directory, 50, 20);
+    auto numbers = make_numbers(make_deck(20, 31), 200000, 34);
+
+    std::string records;
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        // Rates of fill_directory are in effect at time 0
+        records += std::string(numbers[i]) + "," + std::to_string(i % 50) + ",0," +
+                   std::to_string(i % 600) + "\n";
+    }
+    auto rate_records = [&](size_t threads) {
+        std::istringstream in(records);
+        std::ostringstream out;
+        pipeline_options_s options = DEFAULT_PIPELINE_OPTIONS;
+        options.threads = threads;
+        pipeline_stats_s stats;
+        auto time = seconds([&]() {
+            stats = CdrPipeline(directory, options).run(in, out);
+        });
+        EXPECT_EQ(stats.records, numbers.size());
+        EXPECT_EQ(stats.rated, numbers.size());
+        return numbers.size() / time;
+    };
+    auto single = rate_records(1);
+    auto parallel = rate_records(0);
+
+    std::cout << "CDR pipeline, 1 thread per stage: " << single << " records/s" << std::endl
+              << "CDR pipeline, all cores: " << parallel << " records/s" << std::endl;
+}
+
+TEST(speed, binary_protocol) {
+    CodeDirectory directory;
+    fill_directory(directory, 50, 20);
+    auto numbers = make_numbers(make_deck(20, 31), 20000, 35);
+
+    boost::asio::io_context io_context;
+    BinaryServer server(directory, io_context);
+    auto path = "/tmp/code_directory_speed_binary_" + std::to_string(getpid());
+    server.listen_local(path);
+    auto endpoint = server.listen_tcp({ boost::asio::ip::address_v4::loopback(), 0 });
+    std::thread thread([&io_context]() { io_context.run(); });
+
+    auto request = [&numbers](size_t i) {
+        binary_request_s request{};
+        request.op = binary_op_t::lpm;
+        request.vendor = VendorId(i % 50);
+        request.number = numbers[i % numbers.size()];
+        return request;
+    };
+    auto measure = [&](BinaryClient &client, const char *name) {
+        // Round trip of one lookup per frame
+        std::vector<double> latencies;
+        latencies.reserve(numbers.size());
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            latencies.push_back(seconds([&]() {
+                EXPECT_EQ(client.call({ request(i) }).front().status, binary_status_t::ok);
+            }));
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        // 10 frames of 100 lookups in flight
+        const size_t batch = 100, window = 10;
+        size_t answered = 0;
+        auto pipelined = seconds([&]() {
+            binary_requests_t requests;
+            binary_responses_t responses;
+            for (size_t first = 0; first < numbers.size(); first += batch * window) {
+                for (size_t frame = 0; frame < window; ++frame) {
+                    requests.clear();
+                    for (size_t i = 0; i < batch; ++i) {
+                        requests.push_back(request(first + frame * batch + i));
+                    }
+                    client.send(requests);
+                }
+                for (size_t frame = 0; frame < window; ++frame) {
+                    client.receive(&responses);
+                    answered += responses.size();
+                }
+            }
+        });
+        EXPECT_EQ(answered, numbers.size());
+
+        std::cout << "Binary protocol over " << name << ", one LPM per frame: p50 "
+                  << latencies[latencies.size() / 2] * 1e6 << " us, p99 "
+                  << latencies[latencies.size() * 99 / 100] * 1e6 << " us" << std::endl
+                  << "Binary protocol over " << name << ", pipelined frames of 100 LPM: "
+                  << numbers.size() / pipelined << " lookups/s" << std::endl;
+    };
+    BinaryClient local, tcp;
+    local.connect_local(path);
+    tcp.connect_tcp("127.0.0.1", endpoint.port());
+    measure(local, "Unix socket");
+    measure(tcp, "TCP");
+
+    server.close();
+    local.close();
+    tcp.close();
+    thread.join();
+}
+
+TEST(speed, journal) {
+    // Updates that change a few rates of a small deck
+    auto deck = make_deck(2, 49);
+    auto codenames = boost::make_shared<CodenameTree>();
+    codenames->add_code({"1"}, "World");
+    std::vector<CodeDirectory::tree_pointer_t> versions;
+    for (size_t version = 0; version < 10; ++version) {
+        auto tree = boost::make_shared<VendorTree>();
+        for (size_t i = 0; i < deck.size(); ++i) {
+            auto rate = i % 10 == version ? "0.9" + std::to_string(version) : deck[i].rate;
+            tree->add_rate(code_string{deck[i].code.c_str()}, rate_string{rate.c_str()}, 0, 1);
+        }
+        versions.push_back(tree);
+    }
+    const size_t updates = 500;
+    const std::string path = "/tmp/code_directory_speed_journal_" + std::to_string(getpid());
+
+    auto run = [&](bool journaled, bool flush_each) {
+        CodeDirectory directory;
+        directory.set_cache_capacity(0);
+        std::filesystem::remove_all(path);
+        std::unique_ptr<DirectoryJournal> journal;
+        if (journaled) {
+            journal.reset(new DirectoryJournal(directory, path));
+            journal->set_codename_tree(codenames);
+        } else {
+            directory.set_codename_tree(codenames);
+        }
+        auto time = seconds([&]() {
+            for (size_t i = 0; i < updates; ++i) {
+                if (journal) {
+                    journal->set_vendor_tree(VendorId(i % 20), versions[i % versions.size()]);
+                    if (flush_each) {
+                        journal->flush();
+                    }
+                } else {
+                    directory.set_vendor_tree(VendorId(i % 20), versions[i % versions.size()]);
+                }
+            }
+            if (journal) {
+                journal->flush();
+            }
+        });
+        journal.reset();
+        std::filesystem::remove_all(path);
+        return updates / time;
+    };
+    auto plain = run(false, false);
+    auto grouped = run(true, false);
+    auto synced = run(true, true);
+
+    std::cout << "Updates of " << deck.size() << " codes, no journal: " << plain << " updates/s" << std::endl
+              << "Journal, grouped syncs:    " << grouped << " updates/s" << std::endl
+              << "Journal, sync per update:  " << synced << " updates/s" << std::endl;
+}
+
+TEST(speed, static_index) {
+    auto deck = make_deck(200, 32);
+    auto numbers = make_numbers(deck, 200000, 33);
+
+    VendorTree tree;
+    for (const auto &entry: deck) {
+        tree.add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+    }
+    StaticVendorIndex index(tree);
+
+    uint64_t tree_sum = 0, index_sum = 0;
+    auto tree_time = seconds([&]() {
+        for (const auto &number: numbers) {
+            tree_sum += tree.get_maximum_prefix_rate(number).value;
+        }
+    });
+    auto index_time = seconds([&]() {
+        for (const auto &number: numbers) {
+            index_sum += index.get_maximum_prefix_rate(number).value;
+        }
+    });
+    EXPECT_EQ(tree_sum, index_sum);
+
+    StatsRates stats;
+    tree.accept(stats);
+    std::cout << "VendorTree:        " << stats.count * sizeof(VendorTree::node_t) << " bytes, "
+              << numbers.size() / tree_time << " LPM/s" << std::endl
+              << "StaticVendorIndex: " << index.memory_usage() << " bytes, "
+              << numbers.size() / index_time << " LPM/s" << std::endl;
+}
+
+TEST(speed, compact_trie) {
+    auto deck = make_deck(200, 45);
+    auto numbers = make_numbers(deck, 200000, 46);
+
+    VendorTree tree;
+    for (const auto &entry: deck) {
+        tree.add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+    }
+    CompactVendorTrie trie(tree);
+
+    uint64_t tree_sum = 0, trie_sum = 0;
+    auto tree_time = seconds([&]() {
+        for (const auto &number: numbers) {
+            tree_sum += tree.get_maximum_prefix_rate(number).value;
+        }
+    });
+    auto trie_time = seconds([&]() {
+        for (const auto &number: numbers) {
+            trie_sum += trie.get_maximum_prefix_rate(number).value;
+        }
+    });
+    EXPECT_EQ(tree_sum, trie_sum);
+
+    std::cout << "VendorTree:        " << trie.size() * sizeof(VendorTree::node_t) << " bytes, "
+              << numbers.size() / tree_time << " LPM/s" << std::endl
+              << "CompactVendorTrie: " << trie.hot_memory_usage() << " hot of "
+              << trie.memory_usage() << " bytes, "
+              << numbers.size() / trie_time << " LPM/s" << std::endl;
+}
+
+TEST(speed, rate_dictionary) {
+    // Vendors quoting prices for the same destinations
+    const size_t vendors = 10;
+    std::vector<VendorTree> trees(vendors);
+    size_t rates = 0;
+    for (size_t vendor = 0; vendor < vendors; ++vendor) {
+        for (const auto &entry: make_deck(200, 46 + vendor)) {
+            trees[vendor].add_rate(code_string{entry.code.c_str()}, rate_string{entry.rate.c_str()}, 0, 1);
+        }
+    }
+    auto dictionary = boost::make_shared<RateDictionary>();
+    for (const auto &tree: trees) {
+        dictionary->add(tree);
+    }
+    dictionary->freeze();
+
+    size_t nodes = 0, ids = 0;
+    for (const auto &tree: trees) {
+        CompactVendorTrie trie(tree, dictionary);
+        nodes += trie.size();
+        for (CompactVendorTrie::node_id_t id = 0; id < trie.size(); ++id) {
+            rates += !trie.data(id).is_empty();
+        }
+        ids += trie.size() * sizeof(RateDictionary::rate_id_t);
+    }
+    const size_t payloads = nodes * sizeof(Rate);
+    EXPECT_LT(ids + dictionary->memory_usage(), payloads);
+
+    std::cout << vendors << " vendors, " << nodes << " nodes, " << rates << " rates, "
+              << dictionary->size() << " distinct" << std::endl
+              << "Rate payloads:    " << payloads << " bytes" << std::endl
+              << "Dictionary ids:   " << ids << " bytes + " << dictionary->memory_usage()
+              << " bytes of dictionary, "
+              << 100.0 * (payloads - ids - dictionary->memory_usage()) / payloads << "% saved" << std::endl;
+}
@@ -0,0 +1,100 @@
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "src/static_index.h"
+#include "src/vendor_tree.h"
+
+using namespace code_directory;
+
+TEST(static_index, empty) {
+    VendorTree tree;
+    StaticVendorIndex index(tree);
+
+    EXPECT_EQ(index.size(), 0u);
+    EXPECT_EQ(index.max_match({"86"}), StaticVendorIndex::npos);
+    EXPECT_TRUE(index.get_maximum_prefix_rate({"86"}).is_empty());
+    auto range = index.prefix_range({""});
+    EXPECT_EQ(range.first, range.second);
+}
+
+TEST(static_index, with_data) {
+    VendorTree tree;
+    tree.add_rate({"86"}, {"0.01"}, 0, 1);
+    tree.add_rate({"860"}, {"0.02"}, 0, 1);
+    tree.add_rate({"869"}, {"0.03"}, 0, 1);
+    tree.add_rate({"06755"}, {"0.012"}, 0, 1);
+    tree.add_rate({"9999999999999999"}, {"0.5"}, 0, 1);
+    StaticVendorIndex index(tree);
+
+    EXPECT_EQ(index.size(), 5u);
+    EXPECT_EQ(index.get_maximum_prefix_rate({"86"}), rate_string{"0.01"});
+    EXPECT_EQ(index.get_maximum_prefix_rate({"8600"}), rate_string{"0.02"});
+    EXPECT_EQ(index.get_maximum_prefix_rate({"861"}), rate_string{"0.01"});
+    EXPECT_EQ(index.get_maximum_prefix_rate({"8699"}), rate_string{"0.03"});
+    EXPECT_EQ(index.get_maximum_prefix_rate({"067551"}), rate_string{"0.012"});
+    EXPECT_EQ(index.get_maximum_prefix_rate({"9999999999999999"}), rate_string{"0.5"});
+    EXPECT_TRUE(index.get_maximum_prefix_rate({"8"}).is_empty());
+    EXPECT_TRUE(index.get_maximum_prefix_rate({"0675"}).is_empty());
+    EXPECT_TRUE(index.get_maximum_prefix_rate({"87"}).is_empty());
+    EXPECT_TRUE(index.get_maximum_prefix_rate({""}).is_empty());
+
+    std::vector<std::string> codes;
+    index.for_each_with_prefix({"86"}, [&codes](const code_string &code, const Rate &) {
+        codes.push_back(code);
+    });
+    EXPECT_EQ(codes, (std::vector<std::string>{ "86", "860", "869" }));
+    codes.clear();
+    index.for_each_with_prefix({"860"}, [&codes](const code_string &code, const Rate &) {
+        codes.push_back(code);
+    });
+    EXPECT_EQ(codes, (std::vector<std::string>{ "860" }));
+    EXPECT_EQ(index.prefix_range({""}).second, 5u);
+}
+
+class CollectRates {
+public:
+    bool visit(const VendorTree::node_t &node) {
+        if (!is_empty(node.data())) {
+            codes.push_back(node.code());
+        }
+        return true;
+    }
+    std::vector<std::string> codes;
+};
+
+TEST(static_index, same_as_tree) {
+    VendorTree tree;
+    std::srand(32);
+    for (size_t i = 0; i < 3000; ++i) {
+        std::string code = std::to_string(std::rand() % 1000);
+        size_t tail = std::rand() % 10;
+        for (size_t j = 0; j < tail; ++j) {
+            code += char('0' + std::rand() % 10);
+        }
+        auto rate = "0." + std::to_string(std::rand() % 1000);
+        tree.add_rate(code_string{code.c_str()}, rate_string{rate.c_str()}, 0, 1);
+    }
+    StaticVendorIndex index(tree);
+
+    for (size_t i = 0; i < 5000; ++i) {
+        std::string number = std::to_string(std::rand() % 1000);
+        while (number.length() < 14) {
+            number += char('0' + std::rand() % 10);
+        }
+        code_string code{number.substr(0, 1 + std::rand() % 14).c_str()};
+        EXPECT_EQ(index.get_maximum_prefix_rate(code), tree.get_maximum_prefix_rate(code));
+
+        std::vector<std::string> from_index;
+        index.for_each_with_prefix(code, [&from_index](const code_string &code, const Rate &) {
+            from_index.push_back(code);
+        });
+        CollectRates from_tree;
+        auto node = tree.max_matching_node(code);
+        if (node != nullptr && node->code().length() == code.length()) {
+            node->accept(from_tree);
+        }
+        EXPECT_EQ(from_index, from_tree.codes);
+    }
+}
@@ -1,3 +1,6 @@
+#include <cstdlib>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "src/vendor_tree.h"
@@ -70,6 +73,24 @@ TEST(vendor, with_data) {
     EXPECT_EQ(stats.with_data, 2);
 }
 
+TEST(vendor, batch) {
+    VendorTree tree;
+    tree.add_rate({"86"}, {"0.01"}, 0, 1);
+    tree.add_rate({"06755"}, {"0.012"}, 0, 1);
+
+    std::vector<code_string> codes { {"86"}, {"8"}, {"868"}, {"067550"}, {"0675"}, {"1"} };
+    auto nodes = tree.max_matching_nodes(codes);
+    auto rates = tree.get_maximum_prefix_rates(codes);
+    ASSERT_EQ(nodes.size(), codes.size());
+    ASSERT_EQ(rates.size(), codes.size());
+    for (size_t i = 0; i < codes.size(); ++i) {
+        EXPECT_EQ(nodes[i], tree.max_matching_node(codes[i]));
+        EXPECT_EQ(rates[i], tree.get_maximum_prefix_rate(codes[i]));
+    }
+    EXPECT_EQ(nodes.back(), nullptr);
+    EXPECT_TRUE(rates[1].is_empty());
+}
+
 TEST(vendor, dates) {
     VendorTree tree;
     tree.add_rate({"86"}, {"0.01"}, 10, 20);
@@ -87,3 +108,71 @@ TEST(vendor, wrong_data) {
 
     EXPECT_THROW(tree.add_rate({"-86"}, {"0.12"}, 0, 1), std::invalid_argument);
 }
+
+TEST(vendor, scan_prefix) {
+    VendorTree tree;
+    std::srand(47);
+    for (size_t i = 0; i < 2000; ++i) {
+        std::string code = std::to_string(std::rand() % 100);
+        size_t tail = std::rand() % 8;
+        for (size_t j = 0; j < tail; ++j) {
+            code += char('0' + std::rand() % 10);
+        }
+        tree.add_rate(code_string{code.c_str()}, {"0.01"}, 0, 1);
+    }
+
+    for (const char *prefix: { "", "4", "44", "447", "0", "9999999" }) {
+        // Pre-order visit yields codes in code order
+        class Collect {
+        public:
+            explicit Collect(const std::string &_prefix) :
+                prefix(_prefix)
+            {}
+            bool visit(const VendorTree::node_t &node) {
+                std::string code = node.code();
+                if (!is_empty(node.data()) && code.compare(0, prefix.length(), prefix) == 0) {
+                    codes.push_back(code);
+                }
+                return true;
+            }
+            std::string prefix;
+            std::vector<std::string> codes;
+        } expected { prefix };
+        tree.accept(expected);
+
+        for (size_t page: { 1, 3, 50, 100000 }) {
+            std::vector<std::string> codes;
+            auto cursor = tree.scan({prefix});
+            size_t pages = 0;
+            while (cursor.next(page, [&codes](const code_string &code, const Rate &rate) {
+                EXPECT_FALSE(rate.is_empty());
+                codes.push_back(code);
+            })) {
+                ++pages;
+                EXPECT_EQ(std::string(cursor.position()), codes.back());
+            }
+            EXPECT_TRUE(cursor.done());
+            EXPECT_FALSE(cursor.next(page, [](const code_string &, const Rate &) { FAIL(); }));
+            EXPECT_EQ(codes, expected.codes);
+            EXPECT_EQ(pages, expected.codes.empty() ? 0 : (expected.codes.size() - 1) / page);
+        }
+
+        // Resuming after a code that is not in the tree
+        code_string after{(std::string(prefix) + "5").c_str()};
+        std::vector<std::string> rest;
+        tree.scan_prefix({prefix}, &after, 100000, [&rest](const code_string &code, const Rate &) {
+            rest.push_back(code);
+        });
+        std::vector<std::string> greater;
+        for (const auto &code: expected.codes) {
+            if (std::string(after) < code) {
+                greater.push_back(code);
+            }
+        }
+        EXPECT_EQ(rest, greater);
+    }
+
+    code_string outside{"55"};
+    EXPECT_THROW(tree.scan_prefix({"44"}, &outside, 10, [](const code_string &, const Rate &) {}),
+                 std::invalid_argument);
+}